@@ -0,0 +1,981 @@
+/* Benchmarks of the mesh code.
+ *
+ * Build with `make bench mode=release` and run ./mesh_bench from the
+ * repository root, optionally with the names of the benchmarks to
+ * run, all of them run otherwise. A hidden window is created since
+ * mesh elements need a GL context for their default shader.
+ *
+ * `./mesh_bench verify`, or `make verify`, instead compares the
+ * accelerated queries against brute force on the bundled models,
+ * optionally only the named checks, and exits with 1 when any of them
+ * doesn't match. */
+
+#include <iostream>
+#include <iomanip>
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdlib>
+#include <functional>
+#include <set>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <glad/glad.h>
+#include <GLFW/glfw3.h>
+
+#include "bvh.hpp"
+#include "mesh.hpp"
+#include "normal_kernels.hpp"
+#include "thread_pool.hpp"
+
+using namespace std;
+
+static const char *monkey_models[] = {
+    "models/monkey_subd_00.obj",
+    "models/monkey_subd_01.obj",
+    "models/monkey_subd_02.obj",
+};
+
+/* Average time in milliseconds of func over repeat runs */
+static double timeMs(int repeat, const function<void()> &func)
+{
+  auto start = chrono::steady_clock::now();
+  for (int i = 0; i < repeat; i++) {
+    func();
+  }
+  auto end = chrono::steady_clock::now();
+  return chrono::duration<double, milli>(end - start).count() / repeat;
+}
+
+static void printRow(const string &name, const string &what, double ms)
+{
+  cout << "  " << left << setw(28) << name << setw(24) << what << right << fixed
+       << setprecision(3) << setw(10) << ms << " ms" << endl;
+}
+
+/* Load (without the binary cache), traversal and teardown of the
+ * element topology, compare against a build with pool=off */
+static void benchElements()
+{
+#ifdef MESH_POOL_DISABLE
+  cout << "elements (new/delete per element)" << endl;
+#else
+  cout << "elements (element pools)" << endl;
+#endif
+  Mesh::cache_enabled = false;
+  for (const char *model : monkey_models) {
+    const int repeat = 10;
+    vector<Mesh *> meshes(repeat);
+    int i = 0;
+    double load = timeMs(repeat, [&] { meshes[i++] = new Mesh(model); });
+
+    double sum = 0.0;
+    double traverse = timeMs(repeat, [&] {
+      const Mesh &mesh = *meshes[0];
+      for (const Face *face : mesh.faces) {
+        for (int j = 0; j < 3; j++) {
+          sum += face->v[j]->node->x()[0] + face->v[j]->uv[0];
+          sum += face->adj_e[j]->n[0]->x()[1];
+        }
+      }
+      for (const Node *node : mesh.nodes) {
+        for (const Edge *edge : node->adj_e) {
+          sum += edge->n[0]->x()[2];
+        }
+      }
+    });
+
+    i = 0;
+    double teardown = timeMs(repeat, [&] { delete meshes[i++]; });
+
+    printRow(model, "load", load);
+    printRow(model, "traverse", traverse);
+    printRow(model, "teardown", teardown);
+    if (sum == 0.12345) {
+      cout << sum << endl; /* keep the traversal from being optimized out */
+    }
+  }
+  Mesh::cache_enabled = true;
+}
+
+/* Regular grid of res x res quads split into triangles, with uvs */
+static MeshArrays gridArrays(int res)
+{
+  MeshArrays arrays;
+  for (int j = 0; j <= res; j++) {
+    for (int i = 0; i <= res; i++) {
+      arrays.positions.push_back(Vec3(i, j, 0.0));
+      arrays.uvs.push_back(Vec2(i / (double)res, j / (double)res));
+    }
+  }
+  for (int j = 0; j < res; j++) {
+    for (int i = 0; i < res; i++) {
+      int n0 = j * (res + 1) + i, n1 = n0 + 1, n2 = n0 + res + 2, n3 = n0 + res + 1;
+      int tris[6] = {n0, n1, n2, n0, n2, n3};
+      arrays.tris.insert(arrays.tris.end(), tris, tris + 6);
+    }
+  }
+  return arrays;
+}
+
+/* Mesh::buildFromArrays() on procedural grids */
+static void benchBuild()
+{
+  cout << "build from arrays" << endl;
+  for (int res : {64, 256, 708}) {
+    MeshArrays arrays = gridArrays(res);
+    Mesh mesh;
+    double build = timeMs(3, [&] { mesh.buildFromArrays(arrays); });
+    printRow(to_string(2 * res * res) + " triangles", "build", build);
+  }
+}
+
+/* Mesh::loadObj() without the binary cache and buildFromArrays() on a
+ * grid with 1, 2, 4, ... threads up to the hardware */
+static void benchLoad()
+{
+  const char *model = "models/monkey_subd_02.obj";
+  cout << "load (" << model << ", 1002528 grid triangles)" << endl;
+  const int max_threads = max(1u, thread::hardware_concurrency());
+  vector<int> thread_counts;
+  for (int n = 1; n < max_threads; n *= 2) {
+    thread_counts.push_back(n);
+  }
+  thread_counts.push_back(max_threads);
+  MeshArrays arrays = gridArrays(708);
+  Mesh::cache_enabled = false;
+  for (int n : thread_counts) {
+    ThreadPool::global().setNumThreads(n);
+    Mesh mesh;
+    double load = timeMs(5, [&] { mesh.loadObj(model); });
+    double build = timeMs(3, [&] { mesh.buildFromArrays(arrays); });
+    printRow(to_string(n) + " threads", "load obj", load);
+    printRow(to_string(n) + " threads", "build grid", build);
+  }
+  Mesh::cache_enabled = true;
+  ThreadPool::global().setNumThreads(0);
+}
+
+/* Mesh::loadObj() parsing the OBJ file against reading the binary
+ * cache */
+static void benchCache()
+{
+  cout << "binary cache" << endl;
+  for (const char *model : monkey_models) {
+    Mesh mesh;
+    Mesh::cache_enabled = false;
+    double parse = timeMs(5, [&] { mesh.loadObj(model); });
+    Mesh::cache_enabled = true;
+    if (!mesh.saveCache(model)) {
+      cout << "  could not write the cache of " << model << endl;
+      continue;
+    }
+    double cached = timeMs(5, [&] { mesh.loadObj(model); });
+    printRow(model, "parse obj", parse);
+    printRow(model, "load cache", cached);
+  }
+}
+
+/* Face normal kernels on gathered arrays and Mesh::updateFaceNormals()
+ * as a whole */
+static void benchFaceNormals()
+{
+  const char *model = "models/monkey_subd_02.obj";
+  cout << "face normals (" << model << ")" << endl;
+  Mesh mesh(model);
+  const int num_tris = mesh.faces.size();
+  vector<int> corners(3 * num_tris);
+  for (int i = 0; i < num_tris; i++) {
+    for (int j = 0; j < 3; j++) {
+      corners[3 * i + j] = mesh.faces[i]->v[j]->node->slot;
+    }
+  }
+  const Scalar *x = mesh.nodeBuffers().x[0].data();
+
+  vector<Scalar> scalar_normals(3 * num_tris), normals(3 * num_tris);
+  computeFaceNormals(x, corners.data(), num_tris, scalar_normals.data(), NORMAL_KERNEL_SCALAR);
+  double scalar_ms = 0.0;
+  for (int kernel = 0; kernel < NORMAL_KERNEL_NUM; kernel++) {
+    if (!normalKernelSupported((NormalKernel)kernel)) {
+      continue;
+    }
+    double ms = timeMs(100, [&] {
+      computeFaceNormals(x, corners.data(), num_tris, normals.data(), (NormalKernel)kernel);
+    });
+    if (kernel == NORMAL_KERNEL_SCALAR) {
+      scalar_ms = ms;
+    }
+    printRow(string("kernel ") + normalKernelName((NormalKernel)kernel), "compute", ms);
+    cout << "    speedup " << setprecision(2) << scalar_ms / ms << "x"
+         << (normals == scalar_normals ? "" : ", DIFFERS from scalar") << endl;
+  }
+  printRow("updateFaceNormals", normalKernelName(bestNormalKernel()), timeMs(100, [&] {
+             mesh.updateFaceNormals();
+           }));
+}
+
+/* Mesh::shadeSmooth() with every weighting, the first call builds the
+ * cached corner tables */
+static void benchSmoothNormals()
+{
+  const char *model = "models/monkey_subd_02.obj";
+  cout << "smooth normals (" << model << ")" << endl;
+  Mesh mesh(model);
+  printRow("first call", "tables + max", timeMs(1, [&] { mesh.shadeSmooth(); }));
+  const char *names[] = {"uniform", "area", "angle", "max"};
+  for (int weighting = NORMAL_WEIGHT_UNIFORM; weighting <= NORMAL_WEIGHT_MAX; weighting++) {
+    mesh.setNormalWeighting((NormalWeighting)weighting);
+    printRow("shadeSmooth", names[weighting], timeMs(100, [&] { mesh.shadeSmooth(); }));
+  }
+}
+
+/* Shuffles the faces and nodes of mesh, and the node buffers with
+ * them, to get a layout without any locality. The mesh must not have
+ * free node slots. */
+static void shuffleLayout(Mesh &mesh)
+{
+  srand(1);
+  for (int i = mesh.faces.size() - 1; i > 0; i--) {
+    swap(mesh.faces[i], mesh.faces[rand() % (i + 1)]);
+  }
+  for (int i = mesh.nodes.size() - 1; i > 0; i--) {
+    swap(mesh.nodes[i], mesh.nodes[rand() % (i + 1)]);
+  }
+  for (int i = 0; i < mesh.faces.size(); i++) {
+    mesh.faces[i]->index = i;
+  }
+  vector<Vec3> x(mesh.nodes.size()), n(mesh.nodes.size());
+  for (int i = 0; i < mesh.nodes.size(); i++) {
+    x[i] = mesh.nodes[i]->x();
+    n[i] = mesh.nodes[i]->n();
+  }
+  for (int i = 0; i < mesh.nodes.size(); i++) {
+    Node *node = mesh.nodes[i];
+    node->index = i;
+    node->slot = i;
+    node->x() = x[i];
+    node->n() = n[i];
+  }
+  mesh.invalidateCornerTables();
+}
+
+/* Vertex cache misses per face and normal computations in file order,
+ * in a shuffled order and after Mesh::optimizeLayout() */
+static void benchLayout()
+{
+  for (const char *model : monkey_models) {
+    cout << "layout (" << model << ")" << endl;
+    Mesh mesh(model);
+    auto report = [&](const char *layout) {
+      cout << "  " << left << setw(28) << layout << "ACMR " << fixed << setprecision(3)
+           << mesh.averageCacheMissRatio(16) << " (16), " << mesh.averageCacheMissRatio(32)
+           << " (32)" << endl;
+      mesh.shadeSmooth();
+      printRow("", "updateFaceNormals", timeMs(100, [&] { mesh.updateFaceNormals(); }));
+      printRow("", "shadeSmooth", timeMs(100, [&] { mesh.shadeSmooth(); }));
+    };
+    report("file order");
+    mesh.optimizeLayout();
+    report("optimized");
+    shuffleLayout(mesh);
+    report("shuffled");
+    printRow("optimizeLayout", "shuffled", timeMs(1, [&] { mesh.optimizeLayout(); }));
+    report("shuffled, optimized");
+  }
+}
+
+/* BVH::build() over the faces of a model and of a procedural grid of
+ * about a million triangles */
+static void benchBvh()
+{
+  cout << "bvh (" << ThreadPool::global().numThreads() << " threads)" << endl;
+  auto bench = [](const string &name, const Mesh &mesh) {
+    vector<AABB> bounds;
+    BVH bvh;
+    printRow(name, "face bounds", timeMs(10, [&] { meshFaceBounds(mesh, bounds); }));
+    printRow(name, "build", timeMs(3, [&] { bvh.build(bounds); }));
+    cout << "    " << bvh.nodes.size() << " nodes, SAH cost " << fixed << setprecision(2)
+         << bvh.sahCost() << ", " << bvh.memoryBytes() / 1024 << " KiB" << endl;
+  };
+  Mesh model("models/monkey_subd_02.obj");
+  bench("models/monkey_subd_02.obj", model);
+  Mesh grid;
+  grid.buildFromArrays(gridArrays(708));
+  bench(to_string(grid.faces.size()) + " triangles", grid);
+}
+
+/* Updating the BVH of Mesh::intersectionTest() after every node of a
+ * grid of about a million triangles moved, by refitting and by
+ * rebuilding it */
+static void benchRefit()
+{
+  cout << "bvh refit (" << ThreadPool::global().numThreads() << " threads)" << endl;
+  Mesh mesh;
+  mesh.buildFromArrays(gridArrays(708));
+  vector<Vec3> rest(mesh.nodes.size());
+  for (const Node *node : mesh.nodes) {
+    rest[node->index] = node->x();
+  }
+  int step = 0;
+  auto wave = [&] {
+    step++;
+    for (Node *node : mesh.nodes) {
+      const Vec3 &x = rest[node->index];
+      mesh.setPosition(node, Vec3(x[0], x[1], 10 * sin(0.02 * x[0] + 0.1 * step)));
+    }
+  };
+  const Vec3 p(354, 354, 20);
+  Vec3 normal;
+  double distance;
+  const string name = to_string(mesh.faces.size()) + " triangles";
+  for (Scalar threshold : {0.0, 1.5}) {
+    mesh.setBVHRebuildThreshold(threshold);
+    wave();
+    mesh.intersectionTest(p, normal, distance);
+    double ms = 0.0;
+    const int repeat = 5;
+    for (int i = 0; i < repeat; i++) {
+      wave();
+      ms += timeMs(1, [&] { mesh.intersectionTest(p, normal, distance); });
+    }
+    printRow(name, threshold < 1 ? "rebuild" : "refit", ms / repeat);
+    cout << "    degradation " << setprecision(3) << mesh.bvhDegradation() << endl;
+  }
+}
+
+/* Batched Mesh::intersectionTest() of random points around a model,
+ * the first call builds the BVH */
+static void benchDistance()
+{
+  const char *model = "models/monkey_subd_02.obj";
+  cout << "signed distance (" << model << ")" << endl;
+  Mesh mesh(model);
+  AABB box;
+  for (const Node *node : mesh.nodes) {
+    box.extend(node->x());
+  }
+  const int num_points = 100000;
+  vector<Vec3> points(num_points);
+  srand(1);
+  for (Vec3 &p : points) {
+    const Vec3 t = Vec3::Random() * 0.75 + Vec3::Constant(0.5);
+    p = box.lower + t.cwiseProduct(box.upper - box.lower);
+  }
+  vector<Vec3> normals;
+  vector<double> distances;
+  vector<Vec3> first(1, points[0]);
+  printRow("first call", "BVH build", timeMs(1, [&] {
+             mesh.intersectionTest(first, normals, distances);
+           }));
+  int inside = 0;
+  const double ms = timeMs(10, [&] {
+    inside = mesh.intersectionTest(points, normals, distances);
+  });
+  printRow(to_string(num_points) + " points", "intersectionTest", ms);
+  cout << "    " << setprecision(3) << 1000.0 * ms / num_points << " us per point, " << inside
+       << " inside" << endl;
+}
+
+/* Rays per second of Mesh::rayCast() for the pixels of a view of a
+ * model, one ray at a time and as a stream of packets, and of
+ * Mesh::bakeAmbientOcclusion() */
+static void benchRaycast()
+{
+  const char *model = "models/monkey_subd_02.obj";
+  cout << "ray cast (" << model << ", " << ThreadPool::global().numThreads() << " threads)"
+       << endl;
+  Mesh mesh(model);
+  AABB box;
+  for (const Node *node : mesh.nodes) {
+    box.extend(node->x());
+  }
+  const Scalar size = (box.upper - box.lower).norm();
+  const Vec3 eye = box.center() + Vec3(0, 0, size);
+
+  /* pixels in tiles of 4 x ray_packet_size / 4 so that every packet is
+   * a small block of the image */
+  const int res = 512;
+  const int tile_height = Mesh::ray_packet_size / 4;
+  vector<Vec3> origins, directions;
+  for (int tile_y = 0; tile_y < res; tile_y += tile_height) {
+    for (int tile_x = 0; tile_x < res; tile_x += 4) {
+      for (int y = tile_y; y < tile_y + tile_height; y++) {
+        for (int x = tile_x; x < tile_x + 4; x++) {
+          const Vec3 target = box.center() +
+                              Vec3((x + 0.5) / res - 0.5, (y + 0.5) / res - 0.5, 0) * size;
+          origins.push_back(eye);
+          directions.push_back(target - eye);
+        }
+      }
+    }
+  }
+  const int num_rays = origins.size();
+  auto printRate = [](const string &name, const string &what, double ms, long num_rays) {
+    printRow(name, what, ms);
+    cout << "    " << setprecision(2) << num_rays / ms / 1000.0 << " Mrays/s" << endl;
+  };
+
+  RayHit hit;
+  mesh.rayCast(eye, directions[0], hit); /* builds the BVH */
+  int num_hits = 0;
+  printRate(to_string(num_rays) + " rays", "single", timeMs(3, [&] {
+              num_hits = 0;
+              for (int i = 0; i < num_rays; i++) {
+                num_hits += mesh.rayCast(origins[i], directions[i], hit);
+              }
+            }), num_rays);
+  vector<RayHit> hits;
+  printRate(to_string(num_rays) + " rays", "packets", timeMs(3, [&] {
+              mesh.rayCast(origins, directions, hits);
+            }), num_rays);
+  cout << "    " << num_hits << " hits" << endl;
+
+  const int num_samples = 64;
+  vector<Scalar> occlusion;
+  printRate(to_string(mesh.nodes.size()) + " nodes", "ambient occlusion", timeMs(1, [&] {
+              mesh.bakeAmbientOcclusion(occlusion, num_samples, size / 2);
+            }), (long)mesh.nodes.size() * num_samples);
+}
+
+/* Mesh::selfCollisionCandidates() of a grid of half a million
+ * triangles folded in half, with the upper layer waving into the lower
+ * one, including the refit of the BVH after every step */
+static void benchSelfCollision()
+{
+  cout << "self collision (" << ThreadPool::global().numThreads() << " threads)" << endl;
+  const int res = 500;
+  Mesh mesh;
+  mesh.buildFromArrays(gridArrays(res));
+  vector<Vec3> rest(mesh.nodes.size());
+  for (const Node *node : mesh.nodes) {
+    rest[node->index] = node->x();
+  }
+  int step = 0;
+  auto fold = [&] {
+    step++;
+    for (Node *node : mesh.nodes) {
+      const Vec3 &x = rest[node->index];
+      if (x[0] <= res / 2) {
+        mesh.setPosition(node, x);
+      }
+      else {
+        const Scalar z = (x[0] - res / 2) * (0.6 + 0.5 * sin(0.05 * x[1] + 0.1 * step)) / res;
+        mesh.setPosition(node, Vec3(res - x[0], x[1], z));
+      }
+    }
+  };
+  const Scalar thickness = 0.1;
+  SelfCollisionCandidates candidates;
+  fold();
+  mesh.selfCollisionCandidates(thickness, candidates);
+  double ms = 0.0;
+  const int repeat = 5;
+  for (int i = 0; i < repeat; i++) {
+    fold();
+    ms += timeMs(1, [&] { mesh.selfCollisionCandidates(thickness, candidates); });
+  }
+  printRow(to_string(mesh.faces.size()) + " triangles", "broad phase", ms / repeat);
+  cout << "    " << candidates.vertex_face.size() << " vertex face, "
+       << candidates.edge_edge.size() << " edge edge pairs" << endl;
+}
+
+/* Checks of the accelerated queries against brute force, run with
+ * `./mesh_bench verify`. Every check prints its number of mismatches
+ * and returns true when there were none. */
+
+static const char *verify_models[] = {
+    "models/monkey_subd_00.obj",
+    "models/monkey_subd_01.obj",
+    "models/monkey_subd_02.obj",
+    "models/cube.obj",
+};
+
+/* Relative tolerance of results computed in Scalar and in float */
+static const Scalar scalar_tolerance = sqrt(numeric_limits<Scalar>::epsilon());
+static const Scalar float_tolerance = 1e-4;
+
+static bool reportMismatches(const string &name, const string &what, int mismatches)
+{
+  cout << "  " << left << setw(28) << name << setw(24) << what << right << setw(10)
+       << (mismatches == 0 ? string("ok") : to_string(mismatches) + " mismatches") << endl;
+  return mismatches == 0;
+}
+
+/* Position of node as the queries see it, with pos and scale applied */
+static Vec3 worldPosition(const Mesh &mesh, const Node *node)
+{
+  return node->x().cwiseProduct(mesh.scale) + mesh.pos;
+}
+
+static AABB worldBounds(const Mesh &mesh)
+{
+  AABB box;
+  for (const Node *node : mesh.nodes) {
+    box.extend(worldPosition(mesh, node));
+  }
+  return box;
+}
+
+/* Whether every edge has two faces */
+static bool isClosed(const Mesh &mesh)
+{
+  for (const Edge *edge : mesh.edges) {
+    if (!edge->adj_f[0] || !edge->adj_f[1]) {
+      return false;
+    }
+  }
+  return true;
+}
+
+/* Distance from p to the triangle a b c, the projection of p onto its
+ * plane when that is inside and otherwise the closest edge */
+static Scalar triangleDistance(const Vec3 &p, const Vec3 &a, const Vec3 &b, const Vec3 &c)
+{
+  Scalar distance = numeric_limits<Scalar>::infinity();
+  const Vec3 n = (b - a).cross(c - a);
+  if (n.squaredNorm() > 0) {
+    const Vec3 q = p - n * ((p - a).dot(n) / n.squaredNorm());
+    if ((b - q).cross(c - q).dot(n) >= 0 && (c - q).cross(a - q).dot(n) >= 0 &&
+        (a - q).cross(b - q).dot(n) >= 0) {
+      distance = (q - p).norm();
+    }
+  }
+  const Vec3 x[3] = {a, b, c};
+  for (int j = 0; j < 3; j++) {
+    const Vec3 e = x[NEXT(j)] - x[j];
+    const Scalar len2 = e.squaredNorm();
+    const Scalar t = len2 > 0 ? ::clamp<Scalar>((p - x[j]).dot(e) / len2, 0, 1) : 0;
+    distance = min(distance, (x[j] + e * t - p).norm());
+  }
+  return distance;
+}
+
+/* Generalized winding number of the faces around p, the sum of their
+ * solid angles (Van Oosterom and Strackee 1983). It is +-1 inside and
+ * 0 outside of a closed mesh. */
+static Scalar windingNumber(const Mesh &mesh, const Vec3 &p)
+{
+  Scalar sum = 0;
+  for (const Face *face : mesh.faces) {
+    const Vec3 a = worldPosition(mesh, face->v[0]->node) - p;
+    const Vec3 b = worldPosition(mesh, face->v[1]->node) - p;
+    const Vec3 c = worldPosition(mesh, face->v[2]->node) - p;
+    const Scalar la = a.norm(), lb = b.norm(), lc = c.norm();
+    sum += 2 * atan2(a.dot(b.cross(c)),
+                     la * lb * lc + a.dot(b) * lc + b.dot(c) * la + c.dot(a) * lb);
+  }
+  return sum / (4 * M_PI);
+}
+
+/* Mesh::intersectionTest() against the closest of all faces, and the
+ * inside test against the winding number for closed meshes */
+static bool verifyDistance()
+{
+  cout << "signed distance" << endl;
+  bool ok = true;
+  for (const char *model : verify_models) {
+    Mesh mesh(model);
+    mesh.pos = Vec3(0.5, -1.0, 2.0);
+    mesh.scale = Vec3(2.0, 1.0, 0.5);
+    const AABB box = worldBounds(mesh);
+    const bool closed = isClosed(mesh);
+    vector<Vec3> points(500);
+    srand(1);
+    for (Vec3 &p : points) {
+      p = box.center() + Vec3::Random().cwiseProduct(box.upper - box.lower) * 0.7;
+    }
+    vector<Vec3> normals;
+    vector<double> distances;
+    mesh.intersectionTest(points, normals, distances);
+
+    int mismatches = 0;
+    for (int i = 0; i < points.size(); i++) {
+      const Vec3 &p = points[i];
+      Vec3 normal;
+      double distance;
+      const bool inside = mesh.intersectionTest(p, normal, distance);
+      Scalar expected = numeric_limits<Scalar>::infinity();
+      for (const Face *face : mesh.faces) {
+        expected = min(expected,
+                       triangleDistance(p,
+                                        worldPosition(mesh, face->v[0]->node),
+                                        worldPosition(mesh, face->v[1]->node),
+                                        worldPosition(mesh, face->v[2]->node)));
+      }
+      bool match = fabs(fabs(distance) - expected) <= scalar_tolerance * (1 + expected) &&
+                   fabs(normal.norm() - 1) <= scalar_tolerance && inside == (distance < 0) &&
+                   distance == distances[i] && normal == normals[i];
+      if (closed && expected > scalar_tolerance) {
+        match &= inside == (fabs(windingNumber(mesh, p)) > 0.5);
+      }
+      mismatches += !match;
+    }
+    ok &= reportMismatches(model, closed ? "distance, inside" : "distance", mismatches);
+  }
+  return ok;
+}
+
+/* Closest hit of a ray with any face like Mesh::rayCast(), the
+ * distance along the ray or infinity for a miss */
+static Scalar rayCastFaces(const Mesh &mesh, const Vec3 &origin, const Vec3 &direction)
+{
+  Scalar best_t = numeric_limits<Scalar>::infinity();
+  for (const Face *face : mesh.faces) {
+    const Vec3 a = worldPosition(mesh, face->v[0]->node);
+    const Vec3 e1 = worldPosition(mesh, face->v[1]->node) - a;
+    const Vec3 e2 = worldPosition(mesh, face->v[2]->node) - a;
+    const Vec3 p = direction.cross(e2);
+    const Scalar det = e1.dot(p);
+    if (det == 0) {
+      continue;
+    }
+    const Vec3 s = origin - a;
+    const Scalar u = s.dot(p) / det;
+    const Vec3 q = s.cross(e1);
+    const Scalar v = direction.dot(q) / det;
+    const Scalar t = e2.dot(q) / det;
+    if (u >= 0 && v >= 0 && u + v <= 1 && t >= 0 && t < best_t) {
+      best_t = t;
+    }
+  }
+  return best_t;
+}
+
+/* Single rays and ray packets of Mesh::rayCast() against testing every
+ * face, the packets with the tolerance of their single precision */
+static bool verifyRaycast()
+{
+  cout << "raycast" << endl;
+  bool ok = true;
+  for (const char *model : verify_models) {
+    Mesh mesh(model);
+    mesh.pos = Vec3(0.3, 0.1, -0.2);
+    mesh.scale = Vec3(1.5, 1.0, 0.8);
+    const AABB box = worldBounds(mesh);
+    const Scalar radius = (box.upper - box.lower).norm();
+    const int num_rays = 1000;
+    vector<Vec3> origins(num_rays), directions(num_rays);
+    srand(2);
+    for (int i = 0; i < num_rays; i++) {
+      origins[i] = box.center() + Vec3::Random().normalized() * radius;
+      const Vec3 target = box.center() + Vec3::Random().cwiseProduct(box.upper - box.lower) * 0.5;
+      directions[i] = target - origins[i];
+    }
+    vector<RayHit> packet_hits;
+    mesh.rayCast(origins, directions, packet_hits);
+
+    int single_mismatches = 0, packet_mismatches = 0;
+    for (int i = 0; i < num_rays; i++) {
+      const Scalar expected = rayCastFaces(mesh, origins[i], directions[i]);
+      const bool expected_hit = expected != numeric_limits<Scalar>::infinity();
+      RayHit hit;
+      const bool single_hit = mesh.rayCast(origins[i], directions[i], hit);
+      single_mismatches += single_hit != expected_hit ||
+                           (single_hit &&
+                            fabs(hit.distance - expected) > scalar_tolerance * (1 + expected));
+      const RayHit &packet_hit = packet_hits[i];
+      packet_mismatches += (packet_hit.face != NULL) != expected_hit ||
+                           (expected_hit && fabs(packet_hit.distance - expected) >
+                                                float_tolerance * (1 + expected));
+    }
+    ok &= reportMismatches(model, "single rays", single_mismatches);
+    ok &= reportMismatches(model, "ray packets", packet_mismatches);
+  }
+  return ok;
+}
+
+/* Whether the boxes are within thickness of each other on every axis,
+ * the test of the self collision broad phase */
+static bool boxesWithin(const AABB &a, const AABB &b, Scalar thickness)
+{
+  for (int axis = 0; axis < 3; axis++) {
+    if (a.lower[axis] - thickness > b.upper[axis] || b.lower[axis] - thickness > a.upper[axis]) {
+      return false;
+    }
+  }
+  return true;
+}
+
+/* Mesh::selfCollisionCandidates() against testing all node face and
+ * edge edge pairs of the elements of the faces */
+static bool verifySelfCollision()
+{
+  cout << "self collision" << endl;
+  bool ok = true;
+  for (int m = 0; m < 2; m++) {
+    const char *model = monkey_models[m];
+    Mesh mesh(model);
+    for (int transformed = 0; transformed < 2; transformed++) {
+      if (transformed) {
+        mesh.pos = Vec3(1.0, 0.0, 0.0);
+        mesh.scale = Vec3(2.0, 1.0, 1.0);
+      }
+      for (Scalar thickness : {0.0, 0.02}) {
+        SelfCollisionCandidates candidates;
+        mesh.selfCollisionCandidates(thickness, candidates);
+        int mismatches = 0;
+        set<pair<int, int>> vertex_face, edge_edge;
+        for (const auto &pair : candidates.vertex_face) {
+          mismatches += !vertex_face.insert({pair.first->index, pair.second->index}).second;
+        }
+        for (const auto &pair : candidates.edge_edge) {
+          const int a = pair.first->index, b = pair.second->index;
+          mismatches += !edge_edge.insert({min(a, b), max(a, b)}).second;
+        }
+
+        vector<bool> face_node(mesh.nodes.size(), false), face_edge(mesh.edges.size(), false);
+        for (const Face *face : mesh.faces) {
+          for (int j = 0; j < 3; j++) {
+            face_node[face->v[j]->node->index] = true;
+            face_edge[face->adj_e[j]->index] = true;
+          }
+        }
+        int num_expected = 0, num_found = 0;
+        for (const Face *face : mesh.faces) {
+          AABB face_box;
+          for (int j = 0; j < 3; j++) {
+            face_box.extend(worldPosition(mesh, face->v[j]->node));
+          }
+          for (const Node *node : mesh.nodes) {
+            if (!face_node[node->index] || node == face->v[0]->node ||
+                node == face->v[1]->node || node == face->v[2]->node) {
+              continue;
+            }
+            const Vec3 x = worldPosition(mesh, node);
+            if (boxesWithin(AABB(x, x), face_box, thickness)) {
+              num_expected++;
+              num_found += vertex_face.count({node->index, face->index});
+            }
+          }
+        }
+        vector<AABB> edge_boxes(mesh.edges.size());
+        for (const Edge *edge : mesh.edges) {
+          edge_boxes[edge->index].extend(worldPosition(mesh, edge->n[0]));
+          edge_boxes[edge->index].extend(worldPosition(mesh, edge->n[1]));
+        }
+        for (const Edge *a : mesh.edges) {
+          for (int i = a->index + 1; i < mesh.edges.size(); i++) {
+            const Edge *b = mesh.edges[i];
+            if (!face_edge[a->index] || !face_edge[b->index] || a->n[0] == b->n[0] ||
+                a->n[0] == b->n[1] || a->n[1] == b->n[0] || a->n[1] == b->n[1]) {
+              continue;
+            }
+            if (boxesWithin(edge_boxes[a->index], edge_boxes[b->index], thickness)) {
+              num_expected++;
+              num_found += edge_edge.count({a->index, b->index});
+            }
+          }
+        }
+        /* missed pairs and reported pairs that aren't within thickness */
+        mismatches += num_expected - num_found;
+        mismatches += vertex_face.size() + edge_edge.size() - num_found;
+        ostringstream what;
+        what << "thickness " << thickness << (transformed ? " scaled" : "");
+        ok &= reportMismatches(model, what.str(), mismatches);
+      }
+    }
+  }
+  return ok;
+}
+
+/* Mesh::refreshNormals() must give bit for bit the normals of
+ * updateFaceNormals() and shadeSmooth() on the whole mesh */
+static bool verifyRefreshNormals()
+{
+  const char *model = "models/monkey_subd_01.obj";
+  cout << "refresh normals (" << model << ")" << endl;
+  const char *names[] = {"uniform", "area", "angle", "max"};
+  bool ok = true;
+  Mesh mesh(model);
+  srand(3);
+  for (int weighting = NORMAL_WEIGHT_UNIFORM; weighting <= NORMAL_WEIGHT_MAX; weighting++) {
+    mesh.setNormalWeighting((NormalWeighting)weighting);
+    mesh.updateFaceNormals();
+    mesh.shadeSmooth();
+    int mismatches = 0;
+    for (int num_moved : {50, (int)mesh.nodes.size() / 2}) {
+      for (int i = 0; i < num_moved; i++) {
+        Node *node = mesh.nodes[rand() % mesh.nodes.size()];
+        mesh.setPosition(node, node->x() + Vec3::Random() * 0.05);
+      }
+      mesh.refreshNormals();
+      vector<Vec3> face_normals, node_normals;
+      for (const Face *face : mesh.faces) {
+        face_normals.push_back(face->n);
+      }
+      for (const Node *node : mesh.nodes) {
+        node_normals.push_back(node->n());
+      }
+      mesh.updateFaceNormals();
+      mesh.shadeSmooth();
+      for (int i = 0; i < mesh.faces.size(); i++) {
+        mismatches += face_normals[i] != mesh.faces[i]->n;
+      }
+      for (int i = 0; i < mesh.nodes.size(); i++) {
+        mismatches += node_normals[i] != mesh.nodes[i]->n();
+      }
+    }
+    ok &= reportMismatches("refreshNormals", names[weighting], mismatches);
+  }
+  return ok;
+}
+
+/* Index of element or -1 for NULL */
+template<typename T> static int indexOf(const T *element)
+{
+  return element ? element->index : -1;
+}
+
+/* A mesh loaded from its binary cache must have the elements, links
+ * and node and vert data of the mesh parsed from the OBJ file, in the
+ * same order */
+static bool verifyCache()
+{
+  cout << "binary cache" << endl;
+  bool ok = true;
+  for (const char *model : verify_models) {
+    Mesh::cache_enabled = false;
+    Mesh parsed(model);
+    Mesh::cache_enabled = true;
+    Mesh cached;
+    if (!parsed.saveCache(model) || !cached.loadCache(model)) {
+      ok &= reportMismatches(model, "save and load", 1);
+      continue;
+    }
+    int mismatches = 0;
+    if (cached.verts.size() != parsed.verts.size() ||
+        cached.nodes.size() != parsed.nodes.size() ||
+        cached.edges.size() != parsed.edges.size() ||
+        cached.faces.size() != parsed.faces.size()) {
+      ok &= reportMismatches(model, "element counts", 1);
+      continue;
+    }
+    for (int i = 0; i < parsed.verts.size(); i++) {
+      const Vert *a = parsed.verts[i], *b = cached.verts[i];
+      bool match = a->uv == b->uv && indexOf(a->node) == indexOf(b->node) &&
+                   a->adj_f.size() == b->adj_f.size();
+      for (int k = 0; match && k < a->adj_f.size(); k++) {
+        match = indexOf(a->adj_f[k]) == indexOf(b->adj_f[k]);
+      }
+      mismatches += !match;
+    }
+    for (int i = 0; i < parsed.nodes.size(); i++) {
+      const Node *a = parsed.nodes[i], *b = cached.nodes[i];
+      bool match = a->x() == b->x() && a->n() == b->n() && a->verts.size() == b->verts.size() &&
+                   a->adj_e.size() == b->adj_e.size();
+      for (int k = 0; match && k < a->verts.size(); k++) {
+        match = indexOf(a->verts[k]) == indexOf(b->verts[k]);
+      }
+      for (int k = 0; match && k < a->adj_e.size(); k++) {
+        match = indexOf(a->adj_e[k]) == indexOf(b->adj_e[k]);
+      }
+      mismatches += !match;
+    }
+    for (int i = 0; i < parsed.edges.size(); i++) {
+      const Edge *a = parsed.edges[i], *b = cached.edges[i];
+      bool match = true;
+      for (int k = 0; k < 2; k++) {
+        match &= indexOf(a->n[k]) == indexOf(b->n[k]);
+        match &= indexOf(a->adj_f[k]) == indexOf(b->adj_f[k]);
+      }
+      mismatches += !match;
+    }
+    for (int i = 0; i < parsed.faces.size(); i++) {
+      const Face *a = parsed.faces[i], *b = cached.faces[i];
+      bool match = true;
+      for (int k = 0; k < 3; k++) {
+        match &= indexOf(a->v[k]) == indexOf(b->v[k]);
+        match &= indexOf(a->adj_e[k]) == indexOf(b->adj_e[k]);
+      }
+      mismatches += !match;
+    }
+    ok &= reportMismatches(model, "elements and links", mismatches);
+  }
+  return ok;
+}
+
+struct Benchmark {
+  const char *name;
+  void (*func)();
+};
+
+static const Benchmark benchmarks[] = {
+    {"elements", benchElements},
+    {"build", benchBuild},
+    {"load", benchLoad},
+    {"cache", benchCache},
+    {"face_normals", benchFaceNormals},
+    {"smooth_normals", benchSmoothNormals},
+    {"layout", benchLayout},
+    {"bvh", benchBvh},
+    {"distance", benchDistance},
+    {"refit", benchRefit},
+    {"raycast", benchRaycast},
+    {"self_collision", benchSelfCollision},
+};
+
+struct Check {
+  const char *name;
+  bool (*func)();
+};
+
+static const Check checks[] = {
+    {"distance", verifyDistance},
+    {"raycast", verifyRaycast},
+    {"self_collision", verifySelfCollision},
+    {"refresh_normals", verifyRefreshNormals},
+    {"cache", verifyCache},
+};
+
+int main(int argc, char **argv)
+{
+  glfwInit();
+  glfwWindowHint(GLFW_CONTEXT_VERSION_MAJOR, 3);
+  glfwWindowHint(GLFW_CONTEXT_VERSION_MINOR, 3);
+  glfwWindowHint(GLFW_OPENGL_PROFILE, GLFW_OPENGL_CORE_PROFILE);
+  glfwWindowHint(GLFW_VISIBLE, GLFW_FALSE);
+  GLFWwindow *window = glfwCreateWindow(64, 64, "mesh_bench", NULL, NULL);
+  if (window == NULL) {
+    cout << "Failed to create GLFW window" << endl;
+    glfwTerminate();
+    return -1;
+  }
+  glfwMakeContextCurrent(window);
+  if (!gladLoadGLLoader((GLADloadproc)glfwGetProcAddress)) {
+    cout << "Failed to initialize GLAD" << endl;
+    return -1;
+  }
+
+  if (argc > 1 && string(argv[1]) == "verify") {
+    int num_failed = 0;
+    for (const Check &check : checks) {
+      bool run = argc == 2;
+      for (int i = 2; i < argc; i++) {
+        run |= string(argv[i]) == check.name;
+      }
+      if (run && !check.func()) {
+        num_failed++;
+      }
+    }
+    cout << (num_failed == 0 ? "all checks passed" : to_string(num_failed) + " checks failed")
+         << endl;
+    glfwTerminate();
+    return num_failed == 0 ? 0 : 1;
+  }
+
+  for (const Benchmark &benchmark : benchmarks) {
+    bool run = argc == 1;
+    for (int i = 1; i < argc; i++) {
+      run |= string(argv[i]) == benchmark.name;
+    }
+    if (run) {
+      benchmark.func();
+    }
+  }
+
+  glfwTerminate();
+  return 0;
+}
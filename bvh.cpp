@@ -0,0 +1,535 @@
+#include "bvh.hpp"
+#include "mesh.hpp"
+#include "thread_pool.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <cassert>
+#include <cmath>
+
+/* Centroid bins per axis when searching for a split */
+static const int num_bins = 16;
+/* Ranges with at least this many items are binned in parallel */
+static const int parallel_bin_size = 1 << 16;
+
+/* Bounds as floats, rounded outwards */
+static inline float roundDown(Scalar value)
+{
+  float f = (float)value;
+  return (Scalar)f > value ? nextafterf(f, -numeric_limits<float>::infinity()) : f;
+}
+
+static inline float roundUp(Scalar value)
+{
+  float f = (float)value;
+  return (Scalar)f < value ? nextafterf(f, numeric_limits<float>::infinity()) : f;
+}
+
+void BVHNode::setBounds(int k, const AABB &box)
+{
+  for (int axis = 0; axis < 3; axis++) {
+    lower[axis][k] = roundDown(box.lower[axis]);
+    upper[axis][k] = roundUp(box.upper[axis]);
+  }
+}
+
+/* Node of the binary tree that is collapsed into the BVH */
+struct BVHBuildNode {
+  AABB bounds;
+  int left;  /* the children are left and left + 1, -1 for a leaf */
+  int first; /* items of a leaf */
+  int count;
+};
+
+/* Items [begin, end) of BVH::items that make up build node `node` */
+struct BVHBuildRange {
+  int node;
+  int begin;
+  int end;
+  AABB bounds;
+  AABB centroid_bounds;
+
+  int size() const
+  {
+    return end - begin;
+  }
+};
+
+struct BVHBin {
+  AABB bounds;
+  AABB centroid_bounds;
+  int count = 0;
+
+  void add(const BVHBin &other)
+  {
+    bounds.extend(other.bounds);
+    centroid_bounds.extend(other.centroid_bounds);
+    count += other.count;
+  }
+};
+
+struct BVHSplit {
+  int axis = -1; /* -1 if there is no split */
+  int bin = 0;   /* items in bins below go to the left */
+  Scalar cost = numeric_limits<Scalar>::infinity();
+  BVHBin left;
+  BVHBin right;
+};
+
+class BVHBuilder {
+ private:
+  const vector<AABB> &item_bounds;
+  vector<Vec3> centroids;
+  vector<int> &items;
+  vector<BVHBuildNode> build_nodes;
+  atomic<int> num_build_nodes;
+
+  /* Maps the centroids of range to bins, an axis without extent has
+   * no bins */
+  struct BinMapping {
+    Vec3 lower;
+    Vec3 scale;
+    bool axes[3];
+    int num_bins;
+
+    BinMapping(const BVHBuildRange &range)
+    {
+      /* fewer bins for small ranges, where setting them up dominates */
+      num_bins = range.size() < 4 * ::num_bins ? ::num_bins / 2 : ::num_bins;
+      lower = range.centroid_bounds.lower;
+      for (int axis = 0; axis < 3; axis++) {
+        const Scalar extent = range.centroid_bounds.upper[axis] - lower[axis];
+        axes[axis] = extent > 0;
+        scale[axis] = axes[axis] ? num_bins / extent : 0;
+      }
+    }
+
+    int bin(const Vec3 &centroid, int axis) const
+    {
+      return ::clamp((int)((centroid[axis] - lower[axis]) * scale[axis]), 0, num_bins - 1);
+    }
+  };
+
+  void binItems(const BinMapping &mapping, int begin, int end, BVHBin bins[3][num_bins]) const
+  {
+    for (int i = begin; i < end; i++) {
+      const int item = items[i];
+      const Vec3 &centroid = centroids[item];
+      for (int axis = 0; axis < 3; axis++) {
+        if (mapping.axes[axis]) {
+          BVHBin &bin = bins[axis][mapping.bin(centroid, axis)];
+          bin.bounds.extend(item_bounds[item]);
+          bin.centroid_bounds.extend(centroid);
+          bin.count++;
+        }
+      }
+    }
+  }
+
+  /* Best split of range by the surface area heuristic. Large ranges
+   * are binned in parallel, the bins are merged in range order so the
+   * result is the same. */
+  BVHSplit findSplit(const BVHBuildRange &range, const BinMapping &mapping, bool parallel) const
+  {
+    BVHBin bins[3][num_bins];
+    if (parallel) {
+      ThreadPool &pool = ThreadPool::global();
+      const int num_chunks = pool.numThreads() * 4;
+      const int chunk_len = (range.size() + num_chunks - 1) / num_chunks;
+      vector<BVHBin> chunk_bins(num_chunks * 3 * num_bins);
+      pool.parallelFor(num_chunks, [&](int chunk) {
+        const int begin = range.begin + chunk * chunk_len;
+        const int end = min(range.end, begin + chunk_len);
+        binItems(mapping, begin, end, (BVHBin(*)[num_bins]) & chunk_bins[chunk * 3 * num_bins]);
+      });
+      for (int chunk = 0; chunk < num_chunks; chunk++) {
+        for (int axis = 0; axis < 3; axis++) {
+          for (int b = 0; b < num_bins; b++) {
+            bins[axis][b].add(chunk_bins[(chunk * 3 + axis) * num_bins + b]);
+          }
+        }
+      }
+    }
+    else {
+      binItems(mapping, range.begin, range.end, bins);
+    }
+
+    const int used_bins = mapping.num_bins;
+    BVHSplit best;
+    for (int axis = 0; axis < 3; axis++) {
+      if (!mapping.axes[axis]) {
+        continue;
+      }
+      /* right_cost[b] is the cost of the items in bins b and above */
+      Scalar right_cost[num_bins];
+      BVHBin right;
+      for (int b = used_bins - 1; b > 0; b--) {
+        right.add(bins[axis][b]);
+        right_cost[b] = right.bounds.surfaceArea() * right.count;
+      }
+      BVHBin left;
+      for (int b = 1; b < used_bins; b++) {
+        left.add(bins[axis][b - 1]);
+        if (left.count == 0 || left.count == range.size()) {
+          continue;
+        }
+        const Scalar cost = left.bounds.surfaceArea() * left.count + right_cost[b];
+        if (cost < best.cost) {
+          best.axis = axis;
+          best.bin = b;
+          best.cost = cost;
+        }
+      }
+    }
+    if (best.axis != -1) {
+      for (int b = 0; b < used_bins; b++) {
+        (b < best.bin ? best.left : best.right).add(bins[best.axis][b]);
+      }
+    }
+    return best;
+  }
+
+  void setLeaf(const BVHBuildRange &range)
+  {
+    BVHBuildNode &node = build_nodes[range.node];
+    node.left = -1;
+    node.first = range.begin;
+    node.count = range.size();
+  }
+
+  /* Bounds of the items [begin, end) */
+  void rangeBounds(BVHBuildRange &range, bool parallel) const
+  {
+    auto accumulate = [&](int begin, int end, AABB &bounds, AABB &centroid_bounds) {
+      for (int i = begin; i < end; i++) {
+        bounds.extend(item_bounds[items[i]]);
+        centroid_bounds.extend(centroids[items[i]]);
+      }
+    };
+    range.bounds = AABB();
+    range.centroid_bounds = AABB();
+    if (!parallel) {
+      accumulate(range.begin, range.end, range.bounds, range.centroid_bounds);
+      return;
+    }
+    ThreadPool &pool = ThreadPool::global();
+    const int num_chunks = pool.numThreads() * 4;
+    const int chunk_len = (range.size() + num_chunks - 1) / num_chunks;
+    vector<AABB> bounds(num_chunks), centroid_bounds(num_chunks);
+    pool.parallelFor(num_chunks, [&](int chunk) {
+      const int begin = range.begin + chunk * chunk_len;
+      accumulate(begin, min(range.end, begin + chunk_len), bounds[chunk], centroid_bounds[chunk]);
+    });
+    for (int chunk = 0; chunk < num_chunks; chunk++) {
+      range.bounds.extend(bounds[chunk]);
+      range.centroid_bounds.extend(centroid_bounds[chunk]);
+    }
+  }
+
+  /* Splits range into r_left and r_right, or makes it a leaf and
+   * returns false */
+  bool splitRange(const BVHBuildRange &range,
+                  BVHBuildRange &r_left,
+                  BVHBuildRange &r_right,
+                  bool parallel)
+  {
+    build_nodes[range.node].bounds = range.bounds;
+    const int size = range.size();
+    if (size <= 1) {
+      setLeaf(range);
+      return false;
+    }
+    const BinMapping mapping(range);
+    const BVHSplit split = findSplit(range, mapping, parallel);
+    int mid;
+    if (split.axis == -1) {
+      /* all centroids are the same, split in the middle unless the
+       * items fit into a leaf */
+      if (size <= BVH::max_leaf_size) {
+        setLeaf(range);
+        return false;
+      }
+      mid = range.begin + size / 2;
+      r_left.begin = range.begin;
+      r_left.end = mid;
+      r_right.begin = mid;
+      r_right.end = range.end;
+      rangeBounds(r_left, parallel);
+      rangeBounds(r_right, parallel);
+    }
+    else {
+      /* a node visit costs as much as an item test */
+      const Scalar area = range.bounds.surfaceArea();
+      const Scalar split_cost = area > 0 ? 1 + split.cost / area : size;
+      if (size <= BVH::max_leaf_size && size <= split_cost) {
+        setLeaf(range);
+        return false;
+      }
+      auto is_left = [&](int item) {
+        return mapping.bin(centroids[item], split.axis) < split.bin;
+      };
+      mid = partition(items.begin() + range.begin, items.begin() + range.end, is_left) -
+            items.begin();
+      r_left.begin = range.begin;
+      r_left.end = mid;
+      r_left.bounds = split.left.bounds;
+      r_left.centroid_bounds = split.left.centroid_bounds;
+      r_right.begin = mid;
+      r_right.end = range.end;
+      r_right.bounds = split.right.bounds;
+      r_right.centroid_bounds = split.right.centroid_bounds;
+    }
+    const int left = num_build_nodes.fetch_add(2);
+    build_nodes[range.node].left = left;
+    r_left.node = left;
+    r_right.node = left + 1;
+    return true;
+  }
+
+  void buildSerial(const BVHBuildRange &range)
+  {
+    BVHBuildRange left, right;
+    if (splitRange(range, left, right, false)) {
+      buildSerial(left);
+      buildSerial(right);
+    }
+  }
+
+  /* Appends the 4 wide node for build node b and its subtree to nodes
+   * in depth first order, returns its index */
+  int collapse(int b, vector<BVHNode> &nodes) const
+  {
+    const int index = nodes.size();
+    nodes.emplace_back();
+
+    /* open the inner child with the largest surface area until there
+     * are 4 children */
+    int children[4];
+    int num_children = 0;
+    if (build_nodes[b].left == -1) {
+      children[num_children++] = b;
+    }
+    else {
+      children[num_children++] = build_nodes[b].left;
+      children[num_children++] = build_nodes[b].left + 1;
+    }
+    while (num_children < 4) {
+      int open = -1;
+      Scalar open_area = -1;
+      for (int k = 0; k < num_children; k++) {
+        const BVHBuildNode &child = build_nodes[children[k]];
+        if (child.left != -1 && child.bounds.surfaceArea() > open_area) {
+          open = k;
+          open_area = child.bounds.surfaceArea();
+        }
+      }
+      if (open == -1) {
+        break;
+      }
+      const int left = build_nodes[children[open]].left;
+      children[open] = left;
+      children[num_children++] = left + 1;
+    }
+
+    BVHNode node;
+    for (int k = 0; k < 4; k++) {
+      node.setBounds(k, AABB());
+      node.child[k] = 0;
+      node.count[k] = -1;
+    }
+    for (int k = 0; k < num_children; k++) {
+      const BVHBuildNode &child = build_nodes[children[k]];
+      node.setBounds(k, child.bounds);
+      if (child.left == -1) {
+        node.child[k] = child.first;
+        node.count[k] = child.count;
+      }
+      else {
+        node.child[k] = collapse(children[k], nodes);
+        node.count[k] = 0;
+      }
+    }
+    nodes[index] = node;
+    return index;
+  }
+
+ public:
+  BVHBuilder(const vector<AABB> &item_bounds, vector<int> &items)
+      : item_bounds(item_bounds), items(items), num_build_nodes(0)
+  {
+  }
+
+  void build(vector<BVHNode> &nodes)
+  {
+    const int num_items = item_bounds.size();
+    ThreadPool &pool = ThreadPool::global();
+    items.resize(num_items);
+    centroids.resize(num_items);
+    pool.parallelForRange(0, num_items, 16384, [&](int begin, int end) {
+      for (int i = begin; i < end; i++) {
+        items[i] = i;
+        centroids[i] = item_bounds[i].center();
+      }
+    });
+    build_nodes.resize(2 * num_items - 1);
+    num_build_nodes = 1;
+
+    /* split the top of the tree with parallel binning until there are
+     * enough subtrees to keep every thread busy */
+    BVHBuildRange root;
+    root.node = 0;
+    root.begin = 0;
+    root.end = num_items;
+    rangeBounds(root, num_items >= parallel_bin_size);
+    const int num_subtrees = pool.numThreads() > 1 ? 4 * pool.numThreads() : 1;
+    vector<BVHBuildRange> pending(1, root), subtrees;
+    while (!pending.empty()) {
+      const BVHBuildRange range = pending.back();
+      pending.pop_back();
+      if (range.size() < parallel_bin_size ||
+          pending.size() + subtrees.size() + 1 >= num_subtrees) {
+        subtrees.push_back(range);
+        continue;
+      }
+      BVHBuildRange left, right;
+      if (splitRange(range, left, right, true)) {
+        pending.push_back(left);
+        pending.push_back(right);
+      }
+    }
+    pool.parallelFor(subtrees.size(), [&](int i) { buildSerial(subtrees[i]); });
+
+    nodes.clear();
+    nodes.reserve(num_build_nodes / 2 + 1);
+    collapse(0, nodes);
+  }
+};
+
+void BVH::build(const vector<AABB> &bounds)
+{
+  clear();
+  if (bounds.empty()) {
+    return;
+  }
+  BVHBuilder(bounds, items).build(nodes);
+  updateLevels();
+}
+
+void BVH::updateLevels()
+{
+  /* parents come before their children */
+  vector<int> depths(nodes.size(), 0);
+  int max_depth = 0;
+  for (int i = 0; i < nodes.size(); i++) {
+    for (int k = 0; k < 4; k++) {
+      if (nodes[i].isInner(k)) {
+        depths[nodes[i].child[k]] = depths[i] + 1;
+        max_depth = max(max_depth, depths[i] + 1);
+      }
+    }
+  }
+  level_offs.assign(max_depth + 2, 0);
+  for (int depth : depths) {
+    level_offs[depth + 1]++;
+  }
+  for (int d = 0; d <= max_depth; d++) {
+    level_offs[d + 1] += level_offs[d];
+  }
+  level_nodes.resize(nodes.size());
+  vector<int> fill(level_offs.begin(), level_offs.end() - 1);
+  for (int i = 0; i < nodes.size(); i++) {
+    level_nodes[fill[depths[i]]++] = i;
+  }
+}
+
+void BVH::refit(const vector<AABB> &item_bounds)
+{
+  assert(item_bounds.size() == items.size());
+  const int num_levels = level_offs.size() - 1;
+  for (int d = num_levels - 1; d >= 0; d--) {
+    ThreadPool::global().parallelForRange(
+        level_offs[d], level_offs[d + 1], 256, [&](int begin, int end) {
+          for (int i = begin; i < end; i++) {
+            BVHNode &node = nodes[level_nodes[i]];
+            for (int k = 0; k < 4; k++) {
+              if (node.isLeaf(k)) {
+                AABB box;
+                for (int j = node.child[k]; j < node.child[k] + node.count[k]; j++) {
+                  box.extend(item_bounds[j]);
+                }
+                node.setBounds(k, box);
+              }
+              else if (node.isInner(k)) {
+                /* the unused slots of the child have empty bounds and
+                 * drop out of the min and max */
+                const BVHNode &child = nodes[node.child[k]];
+                for (int axis = 0; axis < 3; axis++) {
+                  const float *lower = child.lower[axis], *upper = child.upper[axis];
+                  node.lower[axis][k] = min(min(lower[0], lower[1]), min(lower[2], lower[3]));
+                  node.upper[axis][k] = max(max(upper[0], upper[1]), max(upper[2], upper[3]));
+                }
+              }
+            }
+          }
+        });
+  }
+}
+
+void BVH::clear()
+{
+  nodes.clear();
+  items.clear();
+  level_nodes.clear();
+  level_offs.clear();
+}
+
+AABB BVH::bounds() const
+{
+  AABB box;
+  if (!nodes.empty()) {
+    for (int k = 0; k < 4; k++) {
+      if (nodes[0].count[k] >= 0) {
+        box.extend(nodes[0].bounds(k));
+      }
+    }
+  }
+  return box;
+}
+
+Scalar BVH::sahCost() const
+{
+  const Scalar root_area = bounds().surfaceArea();
+  if (root_area <= 0) {
+    return items.size();
+  }
+  Scalar cost = 1; /* the root is always visited */
+  for (const BVHNode &node : nodes) {
+    for (int k = 0; k < 4; k++) {
+      if (node.count[k] >= 0) {
+        cost += node.bounds(k).surfaceArea() / root_area * (node.isLeaf(k) ? node.count[k] : 1);
+      }
+    }
+  }
+  return cost;
+}
+
+size_t BVH::memoryBytes() const
+{
+  return sizeof(BVHNode) * nodes.capacity() +
+         sizeof(int) * (items.capacity() + level_nodes.capacity() + level_offs.capacity());
+}
+
+void meshFaceBounds(const Mesh &mesh, vector<AABB> &r_bounds)
+{
+  r_bounds.resize(mesh.faces.size());
+  ThreadPool::global().parallelForRange(0, mesh.faces.size(), 4096, [&](int begin, int end) {
+    for (int f = begin; f < end; f++) {
+      const Face *face = mesh.faces[f];
+      AABB box;
+      for (int j = 0; j < 3; j++) {
+        box.extend(face->v[j]->node->x());
+      }
+      r_bounds[f] = box;
+    }
+  });
+}
@@ -0,0 +1,198 @@
+#ifndef BVH_HPP
+#define BVH_HPP
+
+#include <cassert>
+#include <cstdint>
+#include <limits>
+#include <vector>
+
+#include "math.hpp"
+
+using namespace std;
+
+class Mesh;
+
+/* Axis aligned bounding box, empty when lower > upper */
+struct AABB {
+  Vec3 lower;
+  Vec3 upper;
+
+  AABB()
+      : lower(Vec3::Constant(numeric_limits<Scalar>::infinity())),
+        upper(Vec3::Constant(-numeric_limits<Scalar>::infinity()))
+  {
+  }
+
+  AABB(const Vec3 &lower, const Vec3 &upper) : lower(lower), upper(upper)
+  {
+  }
+
+  bool empty() const
+  {
+    return lower[0] > upper[0] || lower[1] > upper[1] || lower[2] > upper[2];
+  }
+
+  void extend(const Vec3 &x)
+  {
+    lower = lower.cwiseMin(x);
+    upper = upper.cwiseMax(x);
+  }
+
+  void extend(const AABB &box)
+  {
+    lower = lower.cwiseMin(box.lower);
+    upper = upper.cwiseMax(box.upper);
+  }
+
+  Vec3 center() const
+  {
+    return (lower + upper) / 2;
+  }
+
+  /* 0 for an empty box */
+  Scalar surfaceArea() const
+  {
+    if (empty()) {
+      return 0;
+    }
+    Vec3 d = upper - lower;
+    return 2 * (d[0] * d[1] + d[1] * d[2] + d[2] * d[0]);
+  }
+};
+
+/* Node of a 4 wide BVH. The bounds of the 4 children are stored as
+ * floats by axis so that one SIMD instruction tests all of them, they
+ * are rounded outwards and so never smaller than the boxes they were
+ * built from. A node fills two 64 byte cache lines. */
+struct alignas(64) BVHNode {
+  float lower[3][4]; /* [axis][child] */
+  float upper[3][4];
+  int32_t child[4]; /* index of an inner child in BVH::nodes, or the
+                     * first item of a leaf child in BVH::items */
+  int32_t count[4]; /* 0 for an inner child, number of items of a leaf
+                     * child, -1 for an unused slot (which has empty
+                     * bounds) */
+
+  bool isLeaf(int k) const
+  {
+    return count[k] > 0;
+  }
+  bool isInner(int k) const
+  {
+    return count[k] == 0;
+  }
+
+  AABB bounds(int k) const
+  {
+    return AABB(Vec3(lower[0][k], lower[1][k], lower[2][k]),
+                Vec3(upper[0][k], upper[1][k], upper[2][k]));
+  }
+  void setBounds(int k, const AABB &box);
+};
+
+/* Bounding volume hierarchy over boxes, the items, for example the
+ * faces of a Mesh.
+ *
+ * build() makes a binary tree with the surface area heuristic, binning
+ * the centroids of the items to find the splits. The top of the tree
+ * is split with the binning spread over ThreadPool::global() until
+ * there are enough subtrees for every thread, the subtrees are then
+ * built in parallel. The binary tree is collapsed into 4 wide nodes,
+ * always opening the child with the largest surface area, which are
+ * stored in depth first order: the root is nodes[0] and inner children
+ * come after their parent. The result doesn't depend on the number of
+ * threads.
+ *
+ * refit() keeps the tree and recomputes the bounds of every node from
+ * new boxes of all items, level by level from the deepest up with the
+ * nodes of a level in parallel. It is much cheaper than build() but the
+ * tree gets worse as the items move away from where they were at the
+ * build, which sahCost() measures. */
+class BVH {
+ private:
+  /* nodes by depth, the nodes of depth d are
+   * level_nodes[level_offs[d] .. level_offs[d + 1] - 1] */
+  vector<int> level_nodes;
+  vector<int> level_offs;
+
+  void updateLevels();
+
+ public:
+  vector<BVHNode> nodes;
+  vector<int> items; /* item indices, every leaf references a range */
+
+  /* Most items in a leaf unless the items can't be split */
+  static const int max_leaf_size = 4;
+
+  /* Replaces the hierarchy with one over the items with the given
+   * bounds, item i is bounds[i] */
+  void build(const vector<AABB> &bounds);
+  /* Updates the bounds of the nodes to new bounds of the items of the
+   * last build(). Unlike for build(), item_bounds[i] is the box of
+   * items[i], so that every leaf reads its boxes sequentially. */
+  void refit(const vector<AABB> &item_bounds);
+  void clear();
+
+  bool empty() const
+  {
+    return nodes.empty();
+  }
+
+  /* Number of levels of nodes, 1 for just the root */
+  int numLevels() const
+  {
+    return level_offs.empty() ? 0 : level_offs.size() - 1;
+  }
+
+  /* Bounds of all items */
+  AABB bounds() const;
+  /* Expected cost of a query by the surface area heuristic, in units
+   * of item tests with node visits costing the same as an item test */
+  Scalar sahCost() const;
+  size_t memoryBytes() const;
+};
+
+/* Stack of a depth first traversal of bvh that pops a node and pushes
+ * up to 4 of its inner children. A level can then hold at most 3
+ * entries besides the node being visited, so 3 * numLevels() + 1
+ * entries are enough. They are stored in the object for the usual
+ * depths and on the heap beyond. */
+template<typename T> class BVHStack {
+ private:
+  static const int local_capacity = 256;
+  T local[local_capacity];
+  vector<T> heap;
+  T *entries;
+  int capacity;
+  int size = 0;
+
+ public:
+  explicit BVHStack(const BVH &bvh) : entries(local), capacity(3 * bvh.numLevels() + 1)
+  {
+    if (capacity > local_capacity) {
+      heap.resize(capacity);
+      entries = heap.data();
+    }
+  }
+  BVHStack(const BVHStack &) = delete;
+  BVHStack &operator=(const BVHStack &) = delete;
+
+  bool empty() const
+  {
+    return size == 0;
+  }
+  void push(const T &entry)
+  {
+    assert(size < capacity);
+    entries[size++] = entry;
+  }
+  T pop()
+  {
+    return entries[--size];
+  }
+};
+
+/* Bounds of the faces of mesh, in the order of Mesh::faces */
+void meshFaceBounds(const Mesh &mesh, vector<AABB> &r_bounds);
+
+#endif
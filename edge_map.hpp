@@ -0,0 +1,189 @@
+#ifndef EDGE_MAP_HPP
+#define EDGE_MAP_HPP
+
+#include <cstdint>
+#include <vector>
+
+using namespace std;
+
+class Node;
+class Edge;
+
+/* Open addressing hash map from an unordered pair of nodes to the Edge
+ * between them. Lookup, insertion and removal are expected O(1),
+ * independent of the valence of the nodes. */
+class EdgeMap {
+ private:
+  struct Slot {
+    const Node *n0; /* NULL for an empty slot */
+    const Node *n1; /* n0 < n1, NULL together with n0 == NULL and
+                     * edge != NULL marks a removed slot */
+    Edge *edge;
+  };
+
+  vector<Slot> slots; /* size is 0 or a power of 2 */
+  size_t num_items;
+  size_t num_removed;
+
+  static uint64_t hash(const Node *n0, const Node *n1)
+  {
+    /* splitmix64 finalizer over both pointers */
+    uint64_t h = (uint64_t)(uintptr_t)n0 * 0x9e3779b97f4a7c15ull ^ (uint64_t)(uintptr_t)n1;
+    h = (h ^ (h >> 30)) * 0xbf58476d1ce4e5b9ull;
+    h = (h ^ (h >> 27)) * 0x94d049bb133111ebull;
+    return h ^ (h >> 31);
+  }
+
+  static void order(const Node *&n0, const Node *&n1)
+  {
+    if (n1 < n0) {
+      const Node *t = n0;
+      n0 = n1;
+      n1 = t;
+    }
+  }
+
+  /* slot holding the pair or NULL */
+  Slot *findSlot(const Node *n0, const Node *n1) const
+  {
+    if (slots.empty()) {
+      return NULL;
+    }
+    size_t mask = slots.size() - 1;
+    for (size_t i = hash(n0, n1) & mask;; i = (i + 1) & mask) {
+      const Slot &slot = slots[i];
+      if (slot.n0 == n0 && slot.n1 == n1) {
+        return (Slot *)&slot;
+      }
+      if (slot.n0 == NULL && slot.edge == NULL) {
+        return NULL;
+      }
+    }
+  }
+
+  void rehash(size_t num_slots)
+  {
+    vector<Slot> old;
+    old.swap(slots);
+    slots.assign(num_slots, Slot{NULL, NULL, NULL});
+    num_removed = 0;
+    size_t mask = num_slots - 1;
+    for (size_t j = 0; j < old.size(); j++) {
+      if (old[j].n0) {
+        size_t i = hash(old[j].n0, old[j].n1) & mask;
+        while (slots[i].n0) {
+          i = (i + 1) & mask;
+        }
+        slots[i] = old[j];
+      }
+    }
+  }
+
+ public:
+  EdgeMap() : num_items(0), num_removed(0)
+  {
+  }
+
+  size_t size() const
+  {
+    return num_items;
+  }
+
+  /* Bytes held by the table */
+  size_t capacityBytes() const
+  {
+    return sizeof(Slot) * slots.capacity();
+  }
+
+  /* Makes room for n pairs without rehashing */
+  void reserve(size_t n)
+  {
+    size_t num_slots = 16;
+    while (num_slots < 2 * n) {
+      num_slots *= 2;
+    }
+    if (num_slots > slots.size()) {
+      rehash(num_slots);
+    }
+  }
+
+  Edge *find(const Node *n0, const Node *n1) const
+  {
+    order(n0, n1);
+    Slot *slot = findSlot(n0, n1);
+    return slot ? slot->edge : NULL;
+  }
+
+  /* Maps the pair to edge, returns false and keeps the existing edge
+   * if the pair is already mapped */
+  bool insert(const Node *n0, const Node *n1, Edge *edge)
+  {
+    order(n0, n1);
+    if (findSlot(n0, n1)) {
+      return false;
+    }
+    /* keep the load factor, removed slots included, at most 1/2 */
+    if (2 * (num_items + num_removed + 1) > slots.size()) {
+      /* rehashing drops the removed slots, grow only if needed */
+      size_t num_slots = slots.empty() ? 16 : slots.size();
+      while (num_slots < 4 * (num_items + 1)) {
+        num_slots *= 2;
+      }
+      rehash(num_slots);
+    }
+    size_t mask = slots.size() - 1;
+    size_t i = hash(n0, n1) & mask;
+    while (slots[i].n0) {
+      i = (i + 1) & mask;
+    }
+    if (slots[i].edge) {
+      num_removed--;
+    }
+    slots[i] = Slot{n0, n1, edge};
+    num_items++;
+    return true;
+  }
+
+  /* Maps the pair to edge like insert(), but may run concurrently with
+   * other calls of insertConcurrent(). The map must have no removed
+   * slots, reserve() must have made room for every pair and the pair
+   * must not be mapped yet. */
+  void insertConcurrent(const Node *n0, const Node *n1, Edge *edge)
+  {
+    order(n0, n1);
+    size_t mask = slots.size() - 1;
+    for (size_t i = hash(n0, n1) & mask;; i = (i + 1) & mask) {
+      const Node *empty = NULL;
+      if (__atomic_compare_exchange_n(
+              &slots[i].n0, &empty, n0, false, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+        slots[i].n1 = n1;
+        slots[i].edge = edge;
+        break;
+      }
+    }
+    __atomic_fetch_add(&num_items, 1, __ATOMIC_RELAXED);
+  }
+
+  /* Removes the pair if it is mapped to edge */
+  void erase(const Node *n0, const Node *n1, const Edge *edge)
+  {
+    order(n0, n1);
+    Slot *slot = findSlot(n0, n1);
+    if (slot && slot->edge == edge) {
+      slot->n0 = NULL;
+      slot->n1 = NULL;
+      num_items--;
+      num_removed++;
+    }
+  }
+
+  void clear()
+  {
+    slots.clear();
+    slots.shrink_to_fit();
+    num_items = 0;
+    num_removed = 0;
+  }
+};
+
+#endif
@@ -0,0 +1,180 @@
+#ifndef ELEMENT_POOL_HPP
+#define ELEMENT_POOL_HPP
+
+#include <algorithm>
+#include <new>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+using namespace std;
+
+/* Typed slab allocator for mesh elements.
+ *
+ * Elements are placed in large slabs, so elements allocated one after
+ * the other (or together with allocUninitialized()) sit next to each
+ * other in memory. Elements given back with free() are recycled.
+ *
+ * The pool does not track which slots are alive, the owner destroys
+ * the elements it still references with destroy() and then releases
+ * every slab at once with clear().
+ *
+ * Defining MESH_POOL_DISABLE turns the pool into plain new/delete per
+ * element, useful with memory checkers and to compare against. */
+template<typename T> class ElementPool {
+ private:
+  struct Slab {
+    T *elems;
+    int len;
+    int used;
+  };
+
+  vector<Slab> slabs;
+  vector<T *> free_list;
+  int min_slab_len;
+  size_t num_allocations; /* calls to the underlying allocator */
+
+  Slab &slabWithSpace(int n)
+  {
+    if (slabs.empty() || slabs.back().len - slabs.back().used < n) {
+      /* grow geometrically so that the number of slabs stays small */
+      int len = max(n, max(min_slab_len, slabs.empty() ? 0 : 2 * slabs.back().len));
+      Slab slab;
+      slab.elems = (T *)::operator new(sizeof(T) * (size_t)len);
+      slab.len = len;
+      slab.used = 0;
+      slabs.push_back(slab);
+      num_allocations++;
+    }
+    return slabs.back();
+  }
+
+ public:
+  explicit ElementPool(int min_slab_len = 1024) : min_slab_len(min_slab_len), num_allocations(0)
+  {
+  }
+
+  ElementPool(const ElementPool &) = delete;
+  ElementPool &operator=(const ElementPool &) = delete;
+
+  ~ElementPool()
+  {
+    clear();
+  }
+
+  /* true if destroy() has to be called for every element before
+   * clear(), false when skipping it can't leak anything */
+  static constexpr bool destroyNeeded()
+  {
+#ifdef MESH_POOL_DISABLE
+    return true;
+#else
+    return !is_trivially_destructible<T>::value;
+#endif
+  }
+
+  /* Makes sure that the next n allocations come from one slab */
+  void reserve(int n)
+  {
+#ifndef MESH_POOL_DISABLE
+    if (n > (int)free_list.size()) {
+      slabWithSpace(n - free_list.size());
+    }
+#endif
+  }
+
+  template<typename... Args> T *alloc(Args &&...args)
+  {
+#ifdef MESH_POOL_DISABLE
+    num_allocations++;
+    return new T(std::forward<Args>(args)...);
+#else
+    T *elem;
+    if (!free_list.empty()) {
+      elem = free_list.back();
+      free_list.pop_back();
+    }
+    else {
+      Slab &slab = slabWithSpace(1);
+      elem = slab.elems + slab.used++;
+    }
+    return new (elem) T(std::forward<Args>(args)...);
+#endif
+  }
+
+  /* Stores n consecutive, not yet constructed, elements in r_elems.
+   * This allows the caller to construct them in parallel with
+   * placement new, which it must do before using the pool again. */
+  void allocUninitialized(int n, T **r_elems)
+  {
+#ifdef MESH_POOL_DISABLE
+    for (int i = 0; i < n; i++) {
+      r_elems[i] = (T *)::operator new(sizeof(T));
+    }
+    num_allocations += n;
+#else
+    Slab &slab = slabWithSpace(n);
+    for (int i = 0; i < n; i++) {
+      r_elems[i] = slab.elems + slab.used + i;
+    }
+    slab.used += n;
+#endif
+  }
+
+  /* Destroys elem and keeps its memory for reuse */
+  void free(T *elem)
+  {
+#ifdef MESH_POOL_DISABLE
+    destroy(elem);
+#else
+    elem->~T();
+    free_list.push_back(elem);
+#endif
+  }
+
+  /* Destroys elem without reusing its memory, for use right before
+   * clear() */
+  void destroy(T *elem)
+  {
+#ifdef MESH_POOL_DISABLE
+    elem->~T();
+    ::operator delete(elem);
+    num_allocations--;
+#else
+    elem->~T();
+#endif
+  }
+
+  /* Releases all slabs at once, elements still alive are not
+   * destroyed, see destroyNeeded() */
+  void clear()
+  {
+    for (int i = 0; i < slabs.size(); i++) {
+      ::operator delete(slabs[i].elems);
+    }
+#ifndef MESH_POOL_DISABLE
+    num_allocations = 0;
+#endif
+    slabs.clear();
+    free_list.clear();
+    free_list.shrink_to_fit();
+  }
+
+  /* Number of live allocations made from the system allocator */
+  size_t numAllocations() const
+  {
+    return num_allocations;
+  }
+
+  /* Bytes held in slabs, including slots not (or no longer) in use */
+  size_t capacityBytes() const
+  {
+    size_t bytes = 0;
+    for (int i = 0; i < slabs.size(); i++) {
+      bytes += sizeof(T) * (size_t)slabs[i].len;
+    }
+    return bytes;
+  }
+};
+
+#endif
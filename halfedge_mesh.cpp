@@ -0,0 +1,208 @@
+#include "halfedge_mesh.hpp"
+#include "gpu_immediate.hpp"
+#include "mesh.hpp"
+#include "normal_kernels.hpp"
+#include "obj_io.hpp"
+#include "thread_pool.hpp"
+
+void HalfEdgeMesh::fromMesh(const Mesh &mesh)
+{
+  pos = mesh.pos;
+  scale = mesh.scale;
+  shader = mesh.shader;
+
+  const int num_nodes = mesh.nodes.size();
+  const int num_uvs = mesh.verts.size();
+  const int num_edges = mesh.edges.size();
+  const int num_faces = mesh.faces.size();
+  positions.resize(num_nodes);
+  normals.resize(num_nodes);
+  uvs.resize(num_uvs);
+  half_node.resize(3 * num_faces);
+  half_uv.resize(3 * num_faces);
+  half_edge.resize(3 * num_faces);
+  edge_nodes.resize(2 * num_edges);
+  face_normals.resize(num_faces);
+
+  ThreadPool &pool = ThreadPool::global();
+  pool.parallelForRange(0, num_nodes, 4096, [&](int begin, int end) {
+    for (int i = begin; i < end; i++) {
+      positions[i] = mesh.nodes[i]->x();
+      normals[i] = mesh.nodes[i]->n();
+    }
+  });
+  pool.parallelForRange(0, num_uvs, 4096, [&](int begin, int end) {
+    for (int i = begin; i < end; i++) {
+      uvs[i] = mesh.verts[i]->uv;
+    }
+  });
+  pool.parallelForRange(0, num_edges, 4096, [&](int begin, int end) {
+    for (int i = begin; i < end; i++) {
+      edge_nodes[2 * i] = mesh.edges[i]->n[0]->index;
+      edge_nodes[2 * i + 1] = mesh.edges[i]->n[1]->index;
+    }
+  });
+  pool.parallelForRange(0, num_faces, 4096, [&](int begin, int end) {
+    for (int f = begin; f < end; f++) {
+      const Face *face = mesh.faces[f];
+      for (int i = 0; i < 3; i++) {
+        half_node[3 * f + i] = face->v[i]->node->index;
+        half_uv[3 * f + i] = face->v[i]->index;
+        /* adj_e[j] is opposite of v[j] */
+        half_edge[3 * f + i] = face->adj_e[PREV(i)]->index;
+      }
+      face_normals[f] = face->n;
+    }
+  });
+
+  /* the two half edges of an edge are twins, edges with any other
+   * number of half edges have none */
+  vector<uint32_t> first(num_edges, INVALID), second(num_edges, INVALID);
+  vector<uint8_t> count(num_edges, 0);
+  for (uint32_t h = 0; h < half_edge.size(); h++) {
+    uint32_t e = half_edge[h];
+    if (count[e] == 0) {
+      first[e] = h;
+    }
+    else if (count[e] == 1) {
+      second[e] = h;
+    }
+    count[e] = min(count[e] + 1, 3);
+  }
+  half_twin.resize(half_edge.size());
+  pool.parallelForRange(0, half_edge.size(), 16384, [&](int begin, int end) {
+    for (int h = begin; h < end; h++) {
+      uint32_t e = half_edge[h];
+      if (count[e] != 2) {
+        half_twin[h] = INVALID;
+      }
+      else {
+        half_twin[h] = first[e] == h ? second[e] : first[e];
+      }
+    }
+  });
+}
+
+void HalfEdgeMesh::toMesh(Mesh &mesh) const
+{
+  MeshArrays arrays;
+  arrays.positions = positions;
+  arrays.normals = normals;
+  arrays.uvs = uvs;
+  arrays.tris.assign(half_node.begin(), half_node.end());
+  arrays.tri_uvs.assign(half_uv.begin(), half_uv.end());
+  /* listing every edge keeps their order and orientation, the sides of
+   * the triangles map to them */
+  arrays.edges.assign(edge_nodes.begin(), edge_nodes.end());
+  mesh.buildFromArrays(arrays);
+  for (int f = 0; f < mesh.faces.size(); f++) {
+    mesh.faces[f]->n = face_normals[f];
+  }
+  mesh.pos = pos;
+  mesh.scale = scale;
+  mesh.shader = shader;
+}
+
+void HalfEdgeMesh::clear()
+{
+  positions.clear();
+  normals.clear();
+  uvs.clear();
+  half_node.clear();
+  half_uv.clear();
+  half_twin.clear();
+  half_edge.clear();
+  edge_nodes.clear();
+  face_normals.clear();
+}
+
+size_t HalfEdgeMesh::memoryBytes() const
+{
+  return sizeof(Vec3) * (positions.capacity() + normals.capacity() + face_normals.capacity()) +
+         sizeof(Vec2) * uvs.capacity() +
+         sizeof(uint32_t) * (half_node.capacity() + half_uv.capacity() + half_twin.capacity() +
+                             half_edge.capacity() + edge_nodes.capacity());
+}
+
+void HalfEdgeMesh::updateFaceNormals()
+{
+  const int num_faces = numFaces();
+  face_normals.resize(num_faces);
+  if (num_faces == 0) {
+    return;
+  }
+  /* the half edge nodes of a face are its corners */
+  ThreadPool::global().parallelForRange(0, num_faces, 4096, [&](int begin, int end) {
+    computeFaceNormals(positions[0].data(),
+                       (const int *)&half_node[3 * begin],
+                       end - begin,
+                       face_normals[begin].data());
+  });
+}
+
+void HalfEdgeMesh::shadeSmooth(NormalWeighting weighting)
+{
+  /* every corner adds to the normal of its node */
+  normals.assign(numNodes(), Vec3(0.0, 0.0, 0.0));
+  for (uint32_t h = 0; h < half_node.size(); h++) {
+    normals[half_node[h]] += cornerNormal(positions[half_node[h]],
+                                          positions[targetNode(h)],
+                                          positions[half_node[prev(h)]],
+                                          weighting);
+  }
+  for (int i = 0; i < normals.size(); i++) {
+    normals[i] = normals[i].normalized();
+  }
+}
+
+void HalfEdgeMesh::saveObj(const string &filename, bool parallel) const
+{
+  const int section_len[OBJ_NUM_SECTIONS] = {numNodes(), numUVs(), numNodes(), numFaces()};
+  auto format = [&](ObjSection section, int begin, int end, ObjTextBuffer &buffer) {
+    for (int i = begin; i < end; i++) {
+      switch (section) {
+        case OBJ_SECTION_V:
+          buffer.appendRecord("v", 1, positions[i].data(), 3);
+          break;
+        case OBJ_SECTION_VT:
+          buffer.appendRecord("vt", 2, uvs[i].data(), 2);
+          break;
+        case OBJ_SECTION_VN:
+          buffer.appendRecord("vn", 2, normals[i].data(), 3);
+          break;
+        case OBJ_SECTION_F:
+          buffer.append('f');
+          for (int h = 3 * i; h < 3 * i + 3; h++) {
+            buffer.appendCorner(half_node[h], half_uv[h], half_node[h]);
+          }
+          buffer.append('\n');
+          break;
+        default:
+          break;
+      }
+    }
+  };
+  if (!writeObjSections(filename, section_len, format, parallel)) {
+    cout << "error: could not write " << filename << endl;
+  }
+}
+
+void HalfEdgeMesh::draw()
+{
+  this->setShaderModelMatrix();
+  GPUVertFormat *format = immVertexFormat();
+  uint pos_attr = format->addAttribute("in_pos", GPU_COMP_F32, 3, GPU_FETCH_FLOAT);
+  uint normal_attr = format->addAttribute("in_normal", GPU_COMP_F32, 3, GPU_FETCH_FLOAT);
+
+  const int num_halfs = half_node.size();
+  immBegin(GPU_PRIM_TRIS, num_halfs, this->shader);
+
+  for (int h = 0; h < num_halfs; h++) {
+    const Vec3 &x = positions[half_node[h]];
+    const Vec3 &n = normals[half_node[h]];
+    immAttr3f(normal_attr, n[0], n[1], n[2]);
+    immVertex3f(pos_attr, x[0], x[1], x[2]);
+  }
+
+  immEnd();
+}
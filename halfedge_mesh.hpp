@@ -0,0 +1,121 @@
+#ifndef HALFEDGE_MESH_HPP
+#define HALFEDGE_MESH_HPP
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "math.hpp"
+#include "mesh.hpp"
+#include "primitives.hpp"
+
+using namespace std;
+
+/* Compact, index based alternative to the pointer based Mesh.
+ *
+ * Everything is stored in flat arrays of 32 bit indices, there are no
+ * per element allocations. Faces are triangles, half edge h goes from
+ * corner h % 3 to corner NEXT(h % 3) of face h / 3, so the next and
+ * face of a half edge are implicit (see next() and face()). The
+ * half edges store their origin node, the uv (Vert of Mesh) of that
+ * corner, their twin on the adjacent face and the edge they are part
+ * of.
+ *
+ * Converting from a Mesh and back keeps the order and the attributes
+ * of all nodes, verts, edges (including edges without faces) and
+ * faces, the adjacency vectors of the Mesh elements are rebuilt in
+ * index order. */
+class HalfEdgeMesh : public Primitive {
+ public:
+  static constexpr uint32_t INVALID = 0xffffffff;
+
+  /* per node */
+  vector<Vec3> positions;
+  vector<Vec3> normals;
+  /* per uv, the Vert of Mesh */
+  vector<Vec2> uvs;
+  /* per half edge, 3 per face */
+  vector<uint32_t> half_node; /* origin node */
+  vector<uint32_t> half_uv;   /* uv of the origin corner */
+  vector<uint32_t> half_twin; /* opposite half edge, INVALID on
+                               * boundary and non manifold edges */
+  vector<uint32_t> half_edge; /* edge the half edge is part of */
+  /* per edge */
+  vector<uint32_t> edge_nodes; /* 2 per edge */
+  /* per face */
+  vector<Vec3> face_normals;
+
+  HalfEdgeMesh()
+  {
+  }
+
+  HalfEdgeMesh(Shader *shader) : Primitive(shader)
+  {
+  }
+
+  explicit HalfEdgeMesh(const Mesh &mesh)
+  {
+    fromMesh(mesh);
+  }
+
+  int numNodes() const
+  {
+    return positions.size();
+  }
+
+  int numUVs() const
+  {
+    return uvs.size();
+  }
+
+  int numEdges() const
+  {
+    return edge_nodes.size() / 2;
+  }
+
+  int numFaces() const
+  {
+    return half_node.size() / 3;
+  }
+
+  static uint32_t next(uint32_t h)
+  {
+    return h % 3 == 2 ? h - 2 : h + 1;
+  }
+
+  static uint32_t prev(uint32_t h)
+  {
+    return h % 3 == 0 ? h + 2 : h - 1;
+  }
+
+  static uint32_t face(uint32_t h)
+  {
+    return h / 3;
+  }
+
+  /* node at the end of half edge h */
+  uint32_t targetNode(uint32_t h) const
+  {
+    return half_node[next(h)];
+  }
+
+  /* Replaces the contents with mesh */
+  void fromMesh(const Mesh &mesh);
+  /* Replaces the contents of mesh */
+  void toMesh(Mesh &mesh) const;
+
+  void clear();
+  /* Bytes used by the arrays */
+  size_t memoryBytes() const;
+
+  void updateFaceNormals();
+  /* Smooth normals of the nodes, weighted like Mesh::shadeSmooth() */
+  void shadeSmooth(NormalWeighting weighting = NORMAL_WEIGHT_MAX);
+
+  /* Same output as Mesh::saveObj() */
+  void saveObj(const string &filename, bool parallel = true) const;
+
+  void draw();
+};
+
+#endif
@@ -29,8 +29,26 @@ bool first_mouse = true;
 float delta_time = 0.0f;
 float last_frame = 0.0f;
 
-int main()
+static void printUsage(const char *program)
 {
+  cout << "usage: " << program << " [--memory-stats]" << endl;
+  cout << "  --memory-stats  print the memory used by the mesh after loading it" << endl;
+}
+
+int main(int argc, char **argv)
+{
+  bool print_memory_stats = false;
+  for (int i = 1; i < argc; i++) {
+    string arg = argv[i];
+    if (arg == "--memory-stats") {
+      print_memory_stats = true;
+    }
+    else {
+      printUsage(argv[0]);
+      return arg == "--help" || arg == "-h" ? 0 : 1;
+    }
+  }
+
   // glfw: initialize and configure
   glfwInit();
   glfwWindowHint(GLFW_CONTEXT_VERSION_MAJOR, 3);
@@ -88,6 +106,14 @@ int main()
             Vec3(0.0, 0.0, 0.0),
             Vec3(1.0, 1.0, 1.0),
             &directional_light_shader);
+  if (print_memory_stats) {
+    mesh.memoryStats().print(cout);
+  }
+
+  /* left click picks the face under the cursor, which is outlined
+   * until the next click */
+  bool left_was_pressed = false;
+  const Face *picked_face = NULL;
 
   // render loop
   unsigned int frame_count = 0;
@@ -115,6 +141,16 @@ int main()
 
     // input
     processInput(window);
+    bool left_pressed = glfwGetMouseButton(window, GLFW_MOUSE_BUTTON_LEFT) == GLFW_PRESS;
+    if (left_pressed && !left_was_pressed) {
+      RayHit hit;
+      Vec3 direction = glmVec3ToVec3(camera.getRaycastDirection(last_x, last_y));
+      picked_face = NULL;
+      if (mesh.rayCast(glmVec3ToVec3(camera.position), direction, hit)) {
+        picked_face = hit.face;
+      }
+    }
+    left_was_pressed = left_pressed;
 
     // render
     glClearColor(0.2f, 0.3f, 0.3f, 1.0f);
@@ -144,6 +180,9 @@ int main()
     /* Mesh drawing */
     mesh.draw();
     mesh.drawWireframe(projection, view, Vec4(0.7, 0.7, 0.7, 1.0));
+    if (picked_face) {
+      mesh.drawFaceOutline(projection, view, picked_face, Vec4(1.0, 0.6, 0.0, 1.0));
+    }
 
     // glfw: swap buffers and poll IO events (keys pressed/released, mouse moved etc.)
     glfwSwapBuffers(window);
@@ -7,7 +7,14 @@
 #include <Eigen/Dense>
 #include <Eigen/Geometry>
 
+/* Precision of positions, normals and uvs. double by default, building
+ * with MESH_USE_FLOAT (make precision=single) halves their memory for
+ * rendering workloads that don't need the precision of simulations */
+#ifdef MESH_USE_FLOAT
+typedef float Scalar;
+#else
 typedef double Scalar;
+#endif
 typedef Eigen::Matrix<Scalar, 2, 1> Vec2;
 typedef Eigen::Matrix<Scalar, 3, 1> Vec3;
 typedef Eigen::Matrix<Scalar, 4, 1> Vec4;
@@ -17,9 +24,10 @@ template<int m> inline Scalar norm2(const Eigen::Matrix<Scalar, m, 1> &v)
   return v.dot(v);
 }
 
-inline Vec3 normal(Vec3 &a0, Vec3 &b0, Vec3 &c0)
+/* Normal of the triangle a0 b0 c0, not normalized */
+inline Vec3 normal(const Vec3 &a0, const Vec3 &b0, const Vec3 &c0)
 {
-  return b0 - a0.cross(c0 - a0);
+  return (b0 - a0).cross(c0 - a0);
 }
 
 inline glm::vec3 vec3ToGlmVec3(const Vec3 &v)
@@ -27,6 +35,11 @@ inline glm::vec3 vec3ToGlmVec3(const Vec3 &v)
   return glm::vec3(v[0], v[1], v[2]);
 }
 
+inline Vec3 glmVec3ToVec3(const glm::vec3 &v)
+{
+  return Vec3(v[0], v[1], v[2]);
+}
+
 inline Vec3 glmVec4ToVec3(const glm::vec4 &v)
 {
   return Vec3(v[0], v[1], v[2]);
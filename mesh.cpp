@@ -1,4 +1,9 @@
 #include "mesh.hpp"
+#include "normal_kernels.hpp"
+#include "obj_io.hpp"
+#include "thread_pool.hpp"
+
+#include <unordered_map>
 
 bool Vert::isOnSeamOrBoundary()
 {
@@ -58,8 +63,6 @@ Vert *Edge::getOtherVertOfFace(int face_side)
   return NULL;
 }
 
-static void connectVertWithNode(Vert *vert, Node *node);
-
 bool Edge::isOnSeamOrBoundary()
 {
   return !adj_f[0] || !adj_f[1] || getVert(0, 0) != getVert(1, 0) ||
@@ -72,8 +75,51 @@ bool Face::isOnSeamOrBoundary()
          adj_e[2]->isOnSeamOrBoundary();
 }
 
+Vert *Mesh::newVert(const Vec2 &uv)
+{
+  return vert_pool.alloc(uv);
+}
+
+Node *Mesh::newNode(const Vec3 &x, const Vec3 &n)
+{
+  return node_pool.alloc(&node_buffers, node_buffers.alloc(x, n));
+}
+
+Edge *Mesh::newEdge(Node *n0, Node *n1)
+{
+  return edge_pool.alloc(n0, n1);
+}
+
+Face *Mesh::newFace(Vert *v0, Vert *v1, Vert *v2)
+{
+  return face_pool.alloc(v0, v1, v2);
+}
+
+void Mesh::deleteElement(Vert *vert)
+{
+  vert_pool.free(vert);
+}
+
+void Mesh::deleteElement(Node *node)
+{
+  node_buffers.free(node->slot);
+  node_pool.free(node);
+}
+
+void Mesh::deleteElement(Edge *edge)
+{
+  edge_pool.free(edge);
+}
+
+void Mesh::deleteElement(Face *face)
+{
+  face_pool.free(face);
+}
+
 void Mesh::add(Vert *vert)
 {
+  corner_tables.valid = false;
+  face_bvh.valid = false;
   verts.push_back(vert);
   vert->node = NULL;
   vert->adj_f.clear();
@@ -82,6 +128,8 @@ void Mesh::add(Vert *vert)
 
 void Mesh::add(Node *node)
 {
+  corner_tables.valid = false;
+  face_bvh.valid = false;
   nodes.push_back(node);
   node->adj_e.clear();
   for (int i = 0; i < node->verts.size(); i++) {
@@ -92,34 +140,47 @@ void Mesh::add(Node *node)
 
 void Mesh::add(Edge *edge)
 {
+  face_bvh.valid = false;
   edges.push_back(edge);
   edge->adj_f[0] = NULL;
   edge->adj_f[1] = NULL;
-  include(edge, edge->n[0]->adj_e);
-  include(edge, edge->n[1]->adj_e);
+  edge_map.insert(edge->n[0], edge->n[1], edge);
+  edge->n[0]->adj_e.push_back(edge);
+  if (edge->n[1] != edge->n[0]) {
+    edge->n[1]->adj_e.push_back(edge);
+  }
   edge->index = edges.size() - 1;
 }
 
-static void add_edges_if_needed(Mesh &mesh, const Face *face)
+/* Creates the edges of face that don't exist yet and sets face->adj_e */
+static void add_edges_if_needed(Mesh &mesh, Face *face)
 {
   for (int i = 0; i < 3; i++) {
     Node *n0 = face->v[i]->node, *n1 = face->v[NEXT(i)]->node;
-    if (getEdge(n0, n1) == NULL) {
-      mesh.add(new Edge(n0, n1));
+    Edge *edge = mesh.getEdge(n0, n1);
+    if (edge == NULL) {
+      edge = mesh.newEdge(n0, n1);
+      mesh.add(edge);
     }
+    /* adj_e[j] is the edge opposite of v[j] */
+    face->adj_e[PREV(i)] = edge;
   }
 }
 
 void Mesh::add(Face *face)
 {
+  corner_tables.valid = false;
+  face_bvh.valid = false;
   faces.push_back(face);
   add_edges_if_needed(*this, face);
   for (int i = 0; i < 3; i++) {
     Vert *v0 = face->v[NEXT(i)];
-    Vert *v1 = face->v[PREV(i)];
-    include(face, v0->adj_f);
-    Edge *e = getEdge(v0->node, v1->node);
-    face->adj_e[i] = e;
+    /* a degenerate face can reference the same vert more than once,
+     * only the first reference adds the face */
+    if (find(v0, face->v) == NEXT(i)) {
+      v0->adj_f.push_back(face);
+    }
+    Edge *e = face->adj_e[i];
     int side = e->n[0] == v0->node ? 0 : 1;
     e->adj_f[side] = face;
   }
@@ -128,30 +189,52 @@ void Mesh::add(Face *face)
 
 void Mesh::remove(Vert *vert)
 {
+  corner_tables.valid = false;
+  face_bvh.valid = false;
   assert(vert->adj_f.empty()); /* ensure that adjacent faces don't
                                   exist */
-  exclude(vert, verts);
+  removeByIndex(vert, verts);
 }
 
 void Mesh::remove(Node *node)
 {
+  corner_tables.valid = false;
+  face_bvh.valid = false;
   assert(node->adj_e.empty()); /* ensure that adjacent edges don't
                                   exist */
-  exclude(node, nodes);
+  removeByIndex(node, nodes);
+  if (node->slot < dirty_index.size() && dirty_index[node->slot] != -1) {
+    /* swap with the last dirty node like removeByIndex() */
+    const int i = dirty_index[node->slot];
+    Node *last = dirty_nodes.back();
+    dirty_nodes[i] = last;
+    dirty_index[last->slot] = i;
+    dirty_nodes.pop_back();
+    dirty_index[node->slot] = -1;
+  }
 }
 
 void Mesh::remove(Edge *edge)
 {
+  face_bvh.valid = false;
   assert(!edge->adj_f[0] && !edge->adj_f[1]); /* ensure that adjacent
                                                  faces don't exist */
-  exclude(edge, edges);
+  removeByIndex(edge, edges);
   exclude(edge, edge->n[0]->adj_e);
   exclude(edge, edge->n[1]->adj_e);
+  edge_map.erase(edge->n[0], edge->n[1], edge);
+  /* there can be more than one edge between the same nodes */
+  Edge *other = ::getEdge(edge->n[0], edge->n[1]);
+  if (other) {
+    edge_map.insert(other->n[0], other->n[1], other);
+  }
 }
 
 void Mesh::remove(Face *face)
 {
-  exclude(face, faces);
+  corner_tables.valid = false;
+  face_bvh.valid = false;
+  removeByIndex(face, faces);
   for (int i = 0; i < 3; i++) {
     Vert *v0 = face->v[NEXT(i)];
     exclude(face, v0->adj_f);
@@ -161,198 +244,824 @@ void Mesh::remove(Face *face)
   }
 }
 
-void Mesh::setIndices()
+static void appendTri(int i0, int i1, int i2, vector<int> &r_tris)
+{
+  r_tris.push_back(i0);
+  r_tris.push_back(i1);
+  r_tris.push_back(i2);
+}
+
+/* Splits the quad x along its shorter diagonal, unless the triangles
+ * of that split don't face the same way as the quad, which happens when
+ * the quad is concave and the diagonal runs outside of it */
+static void triangulateQuad(const vector<Vec3> &x, vector<int> &r_tris)
 {
-  for (int i = 0; i < verts.size(); i++) {
-    verts[i]->index = i;
+  const Vec3 d02 = x[2] - x[0], d13 = x[3] - x[1];
+  const Vec3 n = d02.cross(d13);
+  bool split_02 = norm2(d02) <= norm2(d13);
+  const bool valid_02 = normal(x[0], x[1], x[2]).dot(n) > 0.0 &&
+                        normal(x[0], x[2], x[3]).dot(n) > 0.0;
+  const bool valid_13 = normal(x[1], x[2], x[3]).dot(n) > 0.0 &&
+                        normal(x[1], x[3], x[0]).dot(n) > 0.0;
+  if (valid_02 != valid_13) {
+    split_02 = valid_02;
   }
-  for (int i = 0; i < faces.size(); i++) {
-    faces[i]->index = i;
+  if (split_02) {
+    appendTri(0, 1, 2, r_tris);
+    appendTri(0, 2, 3, r_tris);
   }
-  for (int i = 0; i < nodes.size(); i++) {
-    nodes[i]->index = i;
+  else {
+    appendTri(1, 2, 3, r_tris);
+    appendTri(1, 3, 0, r_tris);
+  }
+}
+
+/* Twice the signed area of the 2D triangle a b c */
+static inline double orient2D(const Vec2 &a, const Vec2 &b, const Vec2 &c)
+{
+  return (b[0] - a[0]) * (c[1] - a[1]) - (b[1] - a[1]) * (c[0] - a[0]);
+}
+
+/* Triangulates the polygon x by ear clipping in the plane of its
+ * (Newell) normal, which also handles concave polygons. O(n^3) in the
+ * worst case, where each clip tests O(n) corners against O(n) reflex
+ * corners, but close to linear for the mostly convex polygons of
+ * typical files. */
+static void triangulateEarClipping(const vector<Vec3> &x, vector<int> &r_tris)
+{
+  const int n = x.size();
+  Vec3 area_normal(0.0, 0.0, 0.0);
+  for (int i = 0; i < n; i++) {
+    area_normal += x[i].cross(x[(i + 1) % n]);
   }
-  for (int i = 0; i < edges.size(); i++) {
-    edges[i]->index = i;
+  /* project along the dominant axis of the normal, keeping the winding
+   * counterclockwise in 2D */
+  int axis = 0;
+  for (int k = 1; k < 3; k++) {
+    if (fabs(area_normal[k]) > fabs(area_normal[axis])) {
+      axis = k;
+    }
+  }
+  const int u = (axis + 1) % 3, v = (axis + 2) % 3;
+  const double sign = area_normal[axis] < 0.0 ? -1.0 : 1.0;
+  vector<Vec2> p(n);
+  for (int i = 0; i < n; i++) {
+    p[i] = Vec2(x[i][u], sign * x[i][v]);
+  }
+
+  vector<int> prev(n), next(n);
+  for (int i = 0; i < n; i++) {
+    prev[i] = (i + n - 1) % n;
+    next[i] = (i + 1) % n;
+  }
+  auto isReflex = [&](int i) { return orient2D(p[prev[i]], p[i], p[next[i]]) <= 0.0; };
+  vector<bool> reflex(n);
+  for (int i = 0; i < n; i++) {
+    reflex[i] = isReflex(i);
+  }
+  /* a convex corner is an ear if no reflex corner lies in its triangle,
+   * only reflex corners can be inside it */
+  auto isEar = [&](int i) {
+    if (reflex[i]) {
+      return false;
+    }
+    const int i0 = prev[i], i2 = next[i];
+    for (int j = next[i2]; j != i0; j = next[j]) {
+      if (reflex[j] && p[j] != p[i0] && p[j] != p[i] && p[j] != p[i2] &&
+          orient2D(p[i0], p[i], p[j]) >= 0.0 && orient2D(p[i], p[i2], p[j]) >= 0.0 &&
+          orient2D(p[i2], p[i0], p[j]) >= 0.0) {
+        return false;
+      }
+    }
+    return true;
+  };
+
+  int i = 0;
+  for (int remaining = n; remaining > 3; remaining--) {
+    /* degenerate and self intersecting polygons can run out of ears,
+     * then the corner the search started at is clipped */
+    int ear = i;
+    for (int tries = 0; tries < remaining; tries++, i = next[i]) {
+      if (isEar(i)) {
+        ear = i;
+        break;
+      }
+    }
+    const int i0 = prev[ear], i2 = next[ear];
+    appendTri(i0, ear, i2, r_tris);
+    next[i0] = i2;
+    prev[i2] = i0;
+    reflex[i0] = isReflex(i0);
+    reflex[i2] = isReflex(i2);
+    i = i2;
+  }
+  appendTri(prev[i], i, next[i], r_tris);
+}
+
+/* Triangulates the polygon with the corner positions x, appends the
+ * corner numbers of the new triangles to r_tris */
+static void triangulate(const vector<Vec3> &x, vector<int> &r_tris)
+{
+  switch (x.size()) {
+    case 3:
+      appendTri(0, 1, 2, r_tris);
+      break;
+    case 4:
+      triangulateQuad(x, r_tris);
+      break;
+    default:
+      triangulateEarClipping(x, r_tris);
+      break;
   }
 }
 
-static void getValidLine(istream &in, string &line)
+/* Atomic updates of ints shared by the tasks of a parallel loop, the
+ * GCC builtins work on plain vectors where std::atomic_ref would need
+ * C++20. Relaxed ordering is enough as parallelFor() synchronizes with
+ * its tasks before it returns. */
+static inline int atomicFetchAdd(int &r_value, int add)
 {
-  do {
-    getline(in, line);
-  } while (in && (line.length() == 0 || line[0] == '#'));
+  return __atomic_fetch_add(&r_value, add, __ATOMIC_RELAXED);
 }
 
-static void connectVertWithNode(Vert *vert, Node *node)
+static inline void atomicMin(int &r_value, int value)
 {
-  vert->node = node;
-  include(vert, node->verts);
+  int old = __atomic_load_n(&r_value, __ATOMIC_RELAXED);
+  while (value < old &&
+         !__atomic_compare_exchange_n(
+             &r_value, &old, value, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+  }
 }
 
-static double angle(const Vec3 &x0, const Vec3 &x1, const Vec3 &x2)
+static inline void atomicMax(int &r_value, int value)
 {
-  Vec3 e1 = (x1 - x0).normalized();
-  Vec3 e2 = (x2 - x0).normalized();
-  return acos(clamp(e1.dot(e2), -1., 1.));
+  int old = __atomic_load_n(&r_value, __ATOMIC_RELAXED);
+  while (value > old &&
+         !__atomic_compare_exchange_n(
+             &r_value, &old, value, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+  }
 }
 
-static vector<Face *> triangulate(const vector<Vert *> &verts)
+/* Replaces the values by their exclusive prefix sums, returns the sum
+ * of all values */
+static int parallelPrefixSum(vector<int> &values)
 {
-  int n = verts.size();
-  double best_min_angle = 0;
-  int best_root = -1;
-  for (int i = 0; i < n; i++) {
-    double min_angle = infinity;
-    const Vert *vert0 = verts[i];
-    for (int j = 2; j < n; j++) {
-      const Vert *vert1 = verts[(i + j - 1) % n], *vert2 = verts[(i + j) % n];
-      min_angle = min(min_angle,
-                      angle(vert0->node->x, vert1->node->x, vert2->node->x),
-                      angle(vert1->node->x, vert2->node->x, vert0->node->x),
-                      angle(vert2->node->x, vert0->node->x, vert1->node->x));
+  ThreadPool &pool = ThreadPool::global();
+  const int len = values.size();
+  const int num_chunks = max(1, min(pool.numThreads() * 4, len / 16384));
+  const int chunk_len = (len + num_chunks - 1) / num_chunks;
+  vector<int> sums(num_chunks + 1, 0);
+  pool.parallelFor(num_chunks, [&](int chunk) {
+    const int begin = chunk * chunk_len, end = min(begin + chunk_len, len);
+    int sum = 0;
+    for (int i = begin; i < end; i++) {
+      sum += values[i];
+    }
+    sums[chunk + 1] = sum;
+  });
+  for (int chunk = 0; chunk < num_chunks; chunk++) {
+    sums[chunk + 1] += sums[chunk];
+  }
+  pool.parallelFor(num_chunks, [&](int chunk) {
+    const int begin = chunk * chunk_len, end = min(begin + chunk_len, len);
+    int sum = sums[chunk];
+    for (int i = begin; i < end; i++) {
+      const int value = values[i];
+      values[i] = sum;
+      sum += value;
+    }
+  });
+  return sums[num_chunks];
+}
+
+/* Groups the entries [0, num_entries) by key(entry) in [0, num_keys),
+ * entries with the key -1 are left out. The entries with key k are
+ * r_entries[r_offs[k]] .. r_entries[r_offs[k + 1] - 1] in increasing
+ * order, so the result doesn't depend on the number of threads. */
+template<typename KeyFunc>
+static void parallelGroup(int num_entries,
+                          int num_keys,
+                          const KeyFunc &key,
+                          vector<int> &r_offs,
+                          vector<int> &r_entries)
+{
+  ThreadPool &pool = ThreadPool::global();
+  /* a single thread needs no atomics and fills every group in
+   * increasing order already */
+  const bool serial = pool.numThreads() == 1;
+  r_offs.assign(num_keys + 1, 0);
+  pool.parallelForRange(0, num_entries, 16384, [&](int begin, int end) {
+    for (int i = begin; i < end; i++) {
+      const int k = key(i);
+      if (k != -1) {
+        serial ? r_offs[k]++ : atomicFetchAdd(r_offs[k], 1);
+      }
     }
-    if (min_angle > best_min_angle) {
-      best_min_angle = min_angle;
-      best_root = i;
+  });
+  r_entries.resize(parallelPrefixSum(r_offs));
+  vector<int> fill(r_offs.begin(), r_offs.end() - 1);
+  pool.parallelForRange(0, num_entries, 16384, [&](int begin, int end) {
+    for (int i = begin; i < end; i++) {
+      const int k = key(i);
+      if (k != -1) {
+        r_entries[serial ? fill[k]++ : atomicFetchAdd(fill[k], 1)] = i;
+      }
     }
+  });
+  if (!serial) {
+    pool.parallelForRange(0, num_keys, 4096, [&](int begin, int end) {
+      for (int k = begin; k < end; k++) {
+        sort(r_entries.begin() + r_offs[k], r_entries.begin() + r_offs[k + 1]);
+      }
+    });
   }
-  int i = best_root;
-  Vert *vert0 = verts[i];
-  vector<Face *> tris;
-  for (int j = 2; j < n; j++) {
-    Vert *vert1 = verts[(i + j - 1) % n], *vert2 = verts[(i + j) % n];
-    tris.push_back(new Face(vert0, vert1, vert2));
+}
+
+static bool indicesInRange(const vector<int> &indices, int len)
+{
+  for (int i = 0; i < indices.size(); i++) {
+    if (indices[i] < 0 || indices[i] >= len) {
+      return false;
+    }
   }
-  return tris;
+  return true;
 }
 
-void Mesh::loadObj(const string &file)
+bool Mesh::buildFromArrays(const MeshArrays &arrays)
 {
-  /* TODO(Ish): need to delete the existing mesh structure before
-   * loading obj */
-  fstream fin(file.c_str(), ios::in);
-  if (!fin) {
-    cout << "error: No file found at " << file << endl;
-    return;
+  deleteMesh();
+
+  const int num_nodes = arrays.positions.size();
+  const int num_tris = arrays.tris.size() / 3;
+  const bool has_tri_uvs = !arrays.tri_uvs.empty() || arrays.tris.empty();
+  const int num_verts = has_tri_uvs ? arrays.uvs.size() : num_nodes;
+  if (arrays.tris.size() % 3 != 0 || arrays.edges.size() % 2 != 0 ||
+      (!arrays.normals.empty() && arrays.normals.size() != num_nodes) ||
+      (has_tri_uvs && arrays.tri_uvs.size() != arrays.tris.size()) ||
+      (!has_tri_uvs && !arrays.uvs.empty() && arrays.uvs.size() != num_nodes) ||
+      !indicesInRange(arrays.tris, num_nodes) || !indicesInRange(arrays.edges, num_nodes) ||
+      !indicesInRange(arrays.tri_uvs, num_verts)) {
+    cout << "error: mesh arrays are inconsistent or have indices out of range" << endl;
+    return false;
+  }
+  const vector<int> &tri_verts = has_tri_uvs ? arrays.tri_uvs : arrays.tris;
+  const int num_corners = tri_verts.size();
+
+  /* a vert belongs to the node of the first corner that uses it, the
+   * first corner that uses it with another node is reported */
+  ThreadPool &pool = ThreadPool::global();
+  vector<int> first_corner(num_verts, num_corners);
+  pool.parallelForRange(0, num_corners, 16384, [&](int begin, int end) {
+    for (int c = begin; c < end; c++) {
+      atomicMin(first_corner[tri_verts[c]], c);
+    }
+  });
+  if (has_tri_uvs) {
+    int bad_corner = num_corners;
+    pool.parallelForRange(0, num_corners, 16384, [&](int begin, int end) {
+      for (int c = begin; c < end; c++) {
+        if (arrays.tris[c] != arrays.tris[first_corner[tri_verts[c]]]) {
+          atomicMin(bad_corner, c);
+        }
+      }
+    });
+    if (bad_corner != num_corners) {
+      cout << "error: mesh arrays use uv " << tri_verts[bad_corner]
+           << " with more than one position" << endl;
+      return false;
+    }
   }
 
-  vector<Vec3> normals;
-  while (fin) {
-    string line;
-    getValidLine(fin, line);
-    stringstream linestream(line);
-    string keyword;
-    linestream >> keyword;
-    if (keyword == "vt") {
+  nodes.resize(num_nodes);
+  verts.resize(num_verts);
+  faces.resize(num_tris);
+  node_pool.allocUninitialized(num_nodes, nodes.data());
+  vert_pool.allocUninitialized(num_verts, verts.data());
+  face_pool.allocUninitialized(num_tris, faces.data());
+  node_buffers.x = arrays.positions;
+  if (arrays.normals.empty()) {
+    node_buffers.n.assign(num_nodes, Vec3(0.0, 0.0, 0.0));
+  }
+  else {
+    node_buffers.n = arrays.normals;
+  }
+  pool.parallelForRange(0, num_nodes, 4096, [&](int begin, int end) {
+    for (int i = begin; i < end; i++) {
+      Node *node = new (nodes[i]) Node(&node_buffers, i);
+      node->index = i;
+    }
+  });
+  pool.parallelForRange(0, num_verts, 4096, [&](int begin, int end) {
+    for (int i = begin; i < end; i++) {
       Vec2 uv;
-      linestream >> uv[0] >> uv[1];
-      this->add(new Vert(uv));
+      if (!arrays.uvs.empty()) {
+        uv = arrays.uvs[i];
+      }
+      else {
+        uv = Vec2(arrays.positions[i][0], arrays.positions[i][1]);
+      }
+      Vert *vert = new (verts[i]) Vert(uv);
+      vert->node = first_corner[i] < num_corners ? nodes[arrays.tris[first_corner[i]]] : NULL;
+      vert->index = i;
+    }
+  });
+
+  /* the verts of a node in the order of their first corners */
+  vector<int> offs, group;
+  parallelGroup(
+      num_corners,
+      num_nodes,
+      [&](int c) { return first_corner[tri_verts[c]] == c ? arrays.tris[c] : -1; },
+      offs,
+      group);
+  pool.parallelForRange(0, num_nodes, 4096, [&](int begin, int end) {
+    for (int i = begin; i < end; i++) {
+      nodes[i]->verts.reserve(offs[i + 1] - offs[i]);
+      for (int k = offs[i]; k < offs[i + 1]; k++) {
+        nodes[i]->verts.push_back(verts[tri_verts[group[k]]]);
+      }
     }
-    else if (keyword == "v") {
-      Vec3 x;
-      linestream >> x[0] >> x[1] >> x[2];
-      this->add(new Node(x, Vec3(0.0, 0.0, 0.0)));
+  });
+  vector<int>().swap(first_corner);
+
+  /* the extra edges and the triangle sides are half edges, the half
+   * edges between the same pair of nodes make up one edge. They are
+   * grouped by their smaller node and then sorted by their larger
+   * node. */
+  const int num_extra = arrays.edges.size() / 2;
+  const int num_half = num_extra + 3 * num_tris;
+  auto half_nodes = [&](int h, int &r_n0, int &r_n1) {
+    if (h < num_extra) {
+      r_n0 = arrays.edges[2 * h];
+      r_n1 = arrays.edges[2 * h + 1];
     }
-    else if (keyword == "vn") {
-      Vec3 n;
-      linestream >> n[0] >> n[1] >> n[2];
-      normals.push_back(n);
+    else {
+      int c = h - num_extra;
+      r_n0 = arrays.tris[c];
+      r_n1 = arrays.tris[c - c % 3 + NEXT(c % 3)];
     }
-    else if (keyword == "e") {
+  };
+  vector<int> lo(num_half), hi(num_half);
+  pool.parallelForRange(0, num_half, 16384, [&](int begin, int end) {
+    for (int h = begin; h < end; h++) {
       int n0, n1;
-      linestream >> n0 >> n1;
-      this->add(new Edge(this->nodes[n0 - 1], this->nodes[n1 - 1]));
-    }
-    else if (keyword == "f") {
-      vector<Vert *> verts;
-      vector<Node *> nodes;
-      string w;
-      while (linestream >> w) {
-        stringstream wstream(w);
-        int v, n, vn; /* vt, v, vn */
-        char c, c2;
-        wstream >> n >> c >> v >> c2 >> vn;
-        nodes.push_back(this->nodes[n - 1]);
-        this->nodes[n - 1]->n = normals[vn - 1];
-        if (wstream) {
-          verts.push_back(this->verts[v - 1]);
+      half_nodes(h, n0, n1);
+      lo[h] = min(n0, n1);
+      hi[h] = max(n0, n1);
+    }
+  });
+  parallelGroup(num_half, num_nodes, [&](int h) { return lo[h]; }, offs, group);
+  vector<int>().swap(lo);
+
+  /* runs of equal pairs are the edges, sorted by (larger node, half
+   * edge) so that every run starts with its lowest half edge. Edges are
+   * numbered in the order of their first half edge, which is the order
+   * in which adding the faces one at a time creates them. */
+  vector<int> half_edge(num_half); /* first half edge of its run, then its edge */
+  vector<int> edge_index(num_half);
+  pool.parallelForRange(0, num_nodes, 1024, [&](int begin, int end) {
+    for (int i = begin; i < end; i++) {
+      auto first = group.begin() + offs[i], last = group.begin() + offs[i + 1];
+      sort(first, last, [&](int a, int b) { return hi[a] < hi[b] || (hi[a] == hi[b] && a < b); });
+      for (auto run = first; run != last;) {
+        auto run_end = run + 1;
+        while (run_end != last && hi[*run_end] == hi[*run]) {
+          run_end++;
         }
-        else if (!nodes.back()->verts.empty()) {
-          verts.push_back(nodes.back()->verts[0]);
+        for (auto it = run; it != run_end; it++) {
+          half_edge[*it] = *run;
+          edge_index[*it] = it == run;
+        }
+        run = run_end;
+      }
+    }
+  });
+  const int num_edges = parallelPrefixSum(edge_index);
+  vector<int> edge_first(num_edges);
+  pool.parallelForRange(0, num_half, 16384, [&](int begin, int end) {
+    for (int h = begin; h < end; h++) {
+      const int first = half_edge[h];
+      if (first == h) {
+        edge_first[edge_index[h]] = h;
+      }
+      half_edge[h] = edge_index[first];
+    }
+  });
+  vector<int>().swap(hi);
+  vector<int>().swap(edge_index);
+
+  edges.resize(num_edges);
+  edge_pool.allocUninitialized(num_edges, edges.data());
+  pool.parallelForRange(0, num_edges, 4096, [&](int begin, int end) {
+    for (int i = begin; i < end; i++) {
+      int n0, n1;
+      half_nodes(edge_first[i], n0, n1);
+      Edge *edge = new (edges[i]) Edge(nodes[n0], nodes[n1]);
+      edge->adj_f[0] = NULL;
+      edge->adj_f[1] = NULL;
+      edge->index = i;
+    }
+  });
+
+  /* the edges of a node in edge order, a loop is adjacent to its node
+   * once */
+  parallelGroup(
+      2 * num_edges,
+      num_nodes,
+      [&](int k) {
+        int n[2];
+        half_nodes(edge_first[k / 2], n[0], n[1]);
+        return k % 2 == 1 && n[1] == n[0] ? -1 : n[k % 2];
+      },
+      offs,
+      group);
+  edge_map.reserve(num_edges);
+  pool.parallelForRange(0, num_nodes, 4096, [&](int begin, int end) {
+    for (int i = begin; i < end; i++) {
+      nodes[i]->adj_e.reserve(offs[i + 1] - offs[i]);
+      for (int k = offs[i]; k < offs[i + 1]; k++) {
+        nodes[i]->adj_e.push_back(edges[group[k] / 2]);
+      }
+    }
+  });
+  pool.parallelForRange(0, num_edges, 4096, [&](int begin, int end) {
+    for (int i = begin; i < end; i++) {
+      edge_map.insertConcurrent(edges[i]->n[0], edges[i]->n[1], edges[i]);
+    }
+  });
+
+  pool.parallelForRange(0, num_tris, 4096, [&](int begin, int end) {
+    for (int f = begin; f < end; f++) {
+      Face *face = new (faces[f])
+          Face(verts[tri_verts[3 * f]], verts[tri_verts[3 * f + 1]], verts[tri_verts[3 * f + 2]]);
+      for (int i = 0; i < 3; i++) {
+        face->adj_e[PREV(i)] = edges[half_edge[num_extra + 3 * f + i]];
+      }
+      face->index = f;
+    }
+  });
+
+  /* same as in add(Face *), a face is adjacent to each of its verts
+   * once and the last face added to a side of an edge wins */
+  parallelGroup(
+      num_corners,
+      num_verts,
+      [&](int c) {
+        const int *tri = &tri_verts[c - c % 3];
+        for (int i = 0; i < c % 3; i++) {
+          if (tri[i] == tri_verts[c]) {
+            return -1;
+          }
+        }
+        return tri_verts[c];
+      },
+      offs,
+      group);
+  pool.parallelForRange(0, num_verts, 4096, [&](int begin, int end) {
+    for (int i = begin; i < end; i++) {
+      verts[i]->adj_f.reserve(offs[i + 1] - offs[i]);
+      for (int k = offs[i]; k < offs[i + 1]; k++) {
+        verts[i]->adj_f.push_back(faces[group[k] / 3]);
+      }
+    }
+  });
+  vector<int> side_corner(2 * num_edges, -1); /* last corner 3 * f + i per edge side */
+  pool.parallelForRange(0, num_tris, 4096, [&](int begin, int end) {
+    for (int f = begin; f < end; f++) {
+      for (int i = 0; i < 3; i++) {
+        Edge *e = faces[f]->adj_e[i];
+        int side = e->n[0] == faces[f]->v[NEXT(i)]->node ? 0 : 1;
+        atomicMax(side_corner[2 * e->index + side], 3 * f + i);
+      }
+    }
+  });
+  pool.parallelForRange(0, num_edges, 4096, [&](int begin, int end) {
+    for (int i = begin; i < end; i++) {
+      for (int side = 0; side < 2; side++) {
+        const int c = side_corner[2 * i + side];
+        edges[i]->adj_f[side] = c != -1 ? faces[c / 3] : NULL;
+      }
+    }
+  });
+  return true;
+}
+
+Scalar Mesh::weld_distance = 0.0;
+
+void Mesh::loadObj(const string &file)
+{
+  deleteMesh();
+  if (cache_enabled && loadCache(file)) {
+    return;
+  }
+
+  ObjData data;
+  if (!readObj(file, data)) {
+    return;
+  }
+  if (weld_distance > 0.0) {
+    ObjWeldStats welded = weldObj(data, weld_distance);
+    if (welded.positions != 0 || welded.uvs != 0 || welded.faces != 0) {
+      cout << "welded " << welded.positions << " positions and " << welded.uvs << " uvs of "
+           << file << ", removed " << welded.faces << " collapsed faces" << endl;
+    }
+  }
+
+  /* triangulate into flat arrays and build the elements at once, on
+   * the thread pool with the same result as reading the faces one at
+   * a time */
+  ThreadPool &pool = ThreadPool::global();
+  MeshArrays arrays;
+  const vector<ObjCorner> &corners = data.corners;
+  const int num_positions = data.positions.size();
+  const int num_file_uvs = data.uvs.size();
+  const int num_faces = data.numFaces();
+  const int num_corners = corners.size();
+  const int num_tris = num_corners - 2 * num_faces;
+
+  /* the first corner of every `v` and `vt`, and the last corner that
+   * gives a `v` a normal, which wins */
+  vector<int> first_v(num_positions, num_corners), first_vt(num_file_uvs, num_corners);
+  vector<int> last_vn(data.normals.empty() ? 0 : num_positions, -1);
+  pool.parallelForRange(0, num_corners, 16384, [&](int begin, int end) {
+    for (int c = begin; c < end; c++) {
+      atomicMin(first_v[corners[c].v], c);
+      if (corners[c].vt != -1) {
+        atomicMin(first_vt[corners[c].vt], c);
+      }
+      if (corners[c].vn != -1) {
+        atomicMax(last_vn[corners[c].v], c);
+      }
+    }
+  });
+  if (!data.normals.empty()) {
+    arrays.normals.resize(num_positions);
+    pool.parallelForRange(0, num_positions, 16384, [&](int begin, int end) {
+      for (int i = begin; i < end; i++) {
+        if (last_vn[i] != -1) {
+          arrays.normals[i] = data.normals[corners[last_vn[i]].vn];
+        }
+        else {
+          arrays.normals[i] = Vec3(0.0, 0.0, 0.0);
+        }
+      }
+    });
+  }
+
+  /* corners without `vt` use the vert of the first corner of their
+   * node, or a new vert with the x and y of the node as uv when that
+   * corner is in the same face. A vert belongs to a single node, a `vt`
+   * used with more than one `v` (which Blender writes for equal uvs)
+   * belongs to the `v` it is first used with and gets a copy for every
+   * other `v`. New verts are appended in the order of the corners that
+   * create them. */
+  enum { UV_FROM_NODE = -1, UV_NEW = -2, UV_COPY = -3, UV_SPLIT = -4 };
+  vector<int> corner_uv(num_corners);
+  vector<int> is_split(num_corners);
+  pool.parallelForRange(0, num_faces, 4096, [&](int begin, int end) {
+    for (int f = begin; f < end; f++) {
+      for (int c = data.face_offsets[f]; c < data.face_offsets[f + 1]; c++) {
+        const ObjCorner &corner = corners[c];
+        if (corner.vt != -1) {
+          corner_uv[c] = corners[first_vt[corner.vt]].v == corner.v ? corner.vt : UV_SPLIT;
         }
         else {
-          verts.push_back(new Vert(Vec2(nodes.back()->x[0], nodes.back()->x[1])));
-          this->add(verts.back());
+          corner_uv[c] = first_v[corner.v] >= data.face_offsets[f] ? UV_NEW : UV_FROM_NODE;
         }
+        is_split[c] = corner_uv[c] == UV_SPLIT;
       }
-      for (int v = 0; v < verts.size(); v++) {
-        connectVertWithNode(verts[v], nodes[v]);
+    }
+  });
+  const int num_split = parallelPrefixSum(is_split);
+  vector<int> split_corners(num_split);
+  pool.parallelForRange(0, num_corners, 16384, [&](int begin, int end) {
+    for (int c = begin; c < end; c++) {
+      if (corner_uv[c] == UV_SPLIT) {
+        split_corners[is_split[c]] = c;
       }
-      vector<Face *> faces = triangulate(verts);
-      for (int f = 0; f < faces.size(); f++) {
-        this->add(faces[f]);
+    }
+  });
+  vector<int>().swap(is_split);
+  /* the first corner of every (`v`, `vt`) pair makes the copy, the
+   * splits are few so a serial pass over them is enough */
+  vector<int> split_first(num_split);
+  unordered_map<uint64_t, int> split_uvs;
+  for (int k = 0; k < num_split; k++) {
+    const ObjCorner &corner = corners[split_corners[k]];
+    auto [it, inserted] = split_uvs.emplace(uint64_t(corner.v) << 32 | corner.vt,
+                                            split_corners[k]);
+    if (inserted) {
+      corner_uv[split_corners[k]] = UV_COPY;
+    }
+    split_first[k] = it->second;
+  }
+
+  vector<int> new_uv(num_corners);
+  pool.parallelForRange(0, num_corners, 16384, [&](int begin, int end) {
+    for (int c = begin; c < end; c++) {
+      new_uv[c] = corner_uv[c] == UV_NEW || corner_uv[c] == UV_COPY;
+    }
+  });
+  data.uvs.resize(num_file_uvs + parallelPrefixSum(new_uv));
+  pool.parallelForRange(0, num_corners, 16384, [&](int begin, int end) {
+    for (int c = begin; c < end; c++) {
+      const int uv = num_file_uvs + new_uv[c];
+      if (corner_uv[c] == UV_NEW) {
+        const Vec3 &x = data.positions[corners[c].v];
+        data.uvs[uv] = Vec2(x[0], x[1]);
+        corner_uv[c] = uv;
+      }
+      else if (corner_uv[c] == UV_COPY) {
+        data.uvs[uv] = data.uvs[corners[c].vt];
+        corner_uv[c] = uv;
+      }
+    }
+  });
+  vector<int>().swap(new_uv);
+  pool.parallelForRange(0, num_split, 4096, [&](int begin, int end) {
+    for (int k = begin; k < end; k++) {
+      if (split_first[k] != split_corners[k]) {
+        corner_uv[split_corners[k]] = corner_uv[split_first[k]];
       }
     }
+  });
+  pool.parallelForRange(0, num_corners, 16384, [&](int begin, int end) {
+    for (int c = begin; c < end; c++) {
+      if (corner_uv[c] == UV_FROM_NODE) {
+        corner_uv[c] = corner_uv[first_v[corners[c].v]];
+      }
+    }
+  });
+
+  /* a face with n corners makes n - 2 triangles */
+  arrays.tris.resize(3 * num_tris);
+  arrays.tri_uvs.resize(3 * num_tris);
+  pool.parallelForRange(0, num_faces, 1024, [&](int begin, int end) {
+    vector<Vec3> x;
+    vector<int> tris;
+    for (int f = begin; f < end; f++) {
+      const int first = data.face_offsets[f];
+      const int len = data.face_offsets[f + 1] - first;
+      x.clear();
+      for (int c = 0; c < len; c++) {
+        x.push_back(data.positions[corners[first + c].v]);
+      }
+      tris.clear();
+      triangulate(x, tris);
+      const int offset = 3 * (first - 2 * f);
+      for (int i = 0; i < tris.size(); i++) {
+        arrays.tris[offset + i] = corners[first + tris[i]].v;
+        arrays.tri_uvs[offset + i] = corner_uv[first + tris[i]];
+      }
+    }
+  });
+  vector<int>().swap(corner_uv);
+  arrays.positions = std::move(data.positions);
+  arrays.uvs = std::move(data.uvs);
+  arrays.edges = std::move(data.edges);
+  data.clear();
+  buildFromArrays(arrays);
+
+  if (cache_enabled && !saveCache(file)) {
+    cout << "warning: could not write mesh cache " << cacheFilename(file) << endl;
   }
-  normals.clear();
 }
 
-void Mesh::saveObj(const string &filename)
+void Mesh::saveObj(const string &filename, bool parallel)
 {
-  /* TODO(ish): setIndices() here might be useless, some basic
-   * testing, the indices remain the same between loading a mesh and
-   * immediately doing this, might change when the mesh is modified */
-  setIndices();
-  fstream fout(filename.c_str(), ios::out);
-  for (int i = 0; i < nodes.size(); i++) {
-    const Node *node = nodes[i];
-    fout << "v " << node->x[0] << " " << node->x[1] << " " << node->x[2] << endl;
+  const int section_len[OBJ_NUM_SECTIONS] = {
+      (int)nodes.size(), (int)verts.size(), (int)nodes.size(), (int)faces.size()};
+  auto format = [&](ObjSection section, int begin, int end, ObjTextBuffer &buffer) {
+    for (int i = begin; i < end; i++) {
+      switch (section) {
+        case OBJ_SECTION_V:
+          buffer.appendRecord("v", 1, nodes[i]->x().data(), 3);
+          break;
+        case OBJ_SECTION_VT:
+          buffer.appendRecord("vt", 2, verts[i]->uv.data(), 2);
+          break;
+        case OBJ_SECTION_VN:
+          buffer.appendRecord("vn", 2, nodes[i]->n().data(), 3);
+          break;
+        case OBJ_SECTION_F: {
+          const Face *face = faces[i];
+          buffer.append('f');
+          for (int j = 0; j < 3; j++) {
+            const Vert *vert = face->v[j];
+            buffer.appendCorner(vert->node->index, vert->index, vert->node->index);
+          }
+          buffer.append('\n');
+          break;
+        }
+        default:
+          break;
+      }
+    }
+  };
+  if (!writeObjSections(filename, section_len, format, parallel)) {
+    cout << "error: could not write " << filename << endl;
   }
-  for (int i = 0; i < verts.size(); i++) {
-    const Vert *vert = verts[i];
-    fout << "vt " << vert->uv[0] << " " << vert->uv[1] << endl;
+}
+
+void slotCorners(const vector<int> &corner_slots,
+                 int num_slots,
+                 vector<int> &r_slot_offs,
+                 vector<int> &r_slot_corners)
+{
+  r_slot_offs.assign(num_slots + 1, 0);
+  for (int c = 0; c < corner_slots.size(); c++) {
+    r_slot_offs[corner_slots[c] + 1]++;
   }
-  for (int i = 0; i < nodes.size(); i++) {
-    const Node *node = nodes[i];
-    fout << "vn " << node->n[0] << " " << node->n[1] << " " << node->n[2] << endl;
+  for (int i = 0; i < num_slots; i++) {
+    r_slot_offs[i + 1] += r_slot_offs[i];
   }
-  for (int i = 0; i < faces.size(); i++) {
-    const Face *face = faces[i];
-    fout << "f " << face->v[0]->node->index + 1 << "/" << face->v[0]->index + 1 << "/"
-         << face->v[0]->node->index + 1 << " " << face->v[1]->node->index + 1 << "/"
-         << face->v[1]->index + 1 << "/" << face->v[0]->node->index + 1 << " "
-         << face->v[2]->node->index + 1 << "/" << face->v[2]->index + 1 << "/"
-         << face->v[0]->node->index + 1 << endl;
+  r_slot_corners.resize(corner_slots.size());
+  vector<int> fill(r_slot_offs.begin(), r_slot_offs.end() - 1);
+  for (int c = 0; c < corner_slots.size(); c++) {
+    r_slot_corners[fill[corner_slots[c]]++] = c;
   }
 }
 
-void Mesh::shadeSmooth()
+Vec3 cornerNormal(const Vec3 &x, const Vec3 &x_next, const Vec3 &x_prev, NormalWeighting weighting)
 {
-  for (int i = 0; i < nodes.size(); i++) {
-    Node *node = nodes[i];
-
-    /* TODO(ish): There is a faster way to do this, right now there are
-       duplicate faces for which the normals are calculated */
-    Vec3 n(0.0, 0.0, 0.0);
-    for (int v = 0; v < node->verts.size(); v++) {
-      const Vert *vert = node->verts[v];
-      for (int f = 0; f < vert->adj_f.size(); f++) {
-        const Face *face = vert->adj_f[f];
+  Vec3 e1 = x_next - x;
+  Vec3 e2 = x_prev - x;
+  Vec3 n = e1.cross(e2);
+  switch (weighting) {
+    case NORMAL_WEIGHT_UNIFORM:
+      return n.normalized();
+    case NORMAL_WEIGHT_AREA:
+      return n;
+    case NORMAL_WEIGHT_ANGLE:
+      return n.normalized() * atan2(n.norm(), e1.dot(e2));
+    case NORMAL_WEIGHT_MAX:
+    default:
+      return n / (2 * norm2(e1) * norm2(e2));
+  }
+}
 
-        int j = find(vert, face->v);
-        int j1 = (j + 1) % 3;
-        int j2 = (j + 2) % 3;
+void Mesh::updateCornerTables()
+{
+  CornerTables &tables = corner_tables;
+  if (tables.valid) {
+    return;
+  }
+  const int num_faces = faces.size();
+  const int num_slots = node_buffers.x.size();
+  tables.corner_slots.resize(3 * num_faces);
+  tables.node_slots.resize(nodes.size());
+  ThreadPool &pool = ThreadPool::global();
+  pool.parallelForRange(0, num_faces, 4096, [&](int begin, int end) {
+    for (int f = begin; f < end; f++) {
+      for (int j = 0; j < 3; j++) {
+        tables.corner_slots[3 * f + j] = faces[f]->v[j]->node->slot;
+      }
+    }
+  });
+  pool.parallelForRange(0, nodes.size(), 4096, [&](int begin, int end) {
+    for (int i = begin; i < end; i++) {
+      tables.node_slots[i] = nodes[i]->slot;
+    }
+  });
 
-        Vec3 e1 = face->v[j1]->node->x - vert->node->x;
-        Vec3 e2 = face->v[j2]->node->x - vert->node->x;
+  slotCorners(tables.corner_slots, num_slots, tables.slot_offs, tables.slot_corners);
+  tables.valid = true;
+}
 
-        n += e1.cross(e2) / (2 * norm2(e1) * norm2(e2));
+void Mesh::shadeSmooth()
+{
+  /* every face corner contributes once to the normal of its node. The
+   * contributions are computed in parallel, streaming over the faces,
+   * and then summed per node in face order, so the result doesn't
+   * depend on the number of threads. */
+  updateCornerTables();
+  const CornerTables &tables = corner_tables;
+  const Vec3 *x = node_buffers.x.data();
+  const int *corner_slots = tables.corner_slots.data();
+  ThreadPool &pool = ThreadPool::global();
+  const int num_faces = faces.size();
+  vector<Vec3> contribs(3 * num_faces);
+  pool.parallelForRange(0, num_faces, 4096, [&](int begin, int end) {
+    for (int c = 3 * begin; c < 3 * end; c += 3) {
+      const Vec3 &x0 = x[corner_slots[c]];
+      const Vec3 &x1 = x[corner_slots[c + 1]];
+      const Vec3 &x2 = x[corner_slots[c + 2]];
+      contribs[c] = cornerNormal(x0, x1, x2, normal_weighting);
+      contribs[c + 1] = cornerNormal(x1, x2, x0, normal_weighting);
+      contribs[c + 2] = cornerNormal(x2, x0, x1, normal_weighting);
+    }
+  });
+
+  pool.parallelForRange(0, nodes.size(), 4096, [&](int begin, int end) {
+    for (int i = begin; i < end; i++) {
+      const int slot = tables.node_slots[i];
+      Vec3 n(0.0, 0.0, 0.0);
+      for (int k = tables.slot_offs[slot]; k < tables.slot_offs[slot + 1]; k++) {
+        n += contribs[tables.slot_corners[k]];
       }
+      node_buffers.n[slot] = n.normalized();
     }
-
-    node->n = n.normalized();
-  }
+  });
 }
 
 void Mesh::draw()
@@ -367,17 +1076,17 @@ void Mesh::draw()
   immBegin(GPU_PRIM_TRIS, face_len * 3, this->shader);
 
   for (int i = 0; i < face_len; i++) {
-    auto &x1 = this->faces[i]->v[0]->node->x;
+    auto &x1 = this->faces[i]->v[0]->node->x();
     auto &uv1 = this->faces[i]->v[0]->uv;
-    auto &n1 = this->faces[i]->v[0]->node->n;
+    auto &n1 = this->faces[i]->v[0]->node->n();
 
-    auto &x2 = this->faces[i]->v[1]->node->x;
+    auto &x2 = this->faces[i]->v[1]->node->x();
     auto &uv2 = this->faces[i]->v[1]->uv;
-    auto &n2 = this->faces[i]->v[1]->node->n;
+    auto &n2 = this->faces[i]->v[1]->node->n();
 
-    auto &x3 = this->faces[i]->v[2]->node->x;
+    auto &x3 = this->faces[i]->v[2]->node->x();
     auto &uv3 = this->faces[i]->v[2]->uv;
-    auto &n3 = this->faces[i]->v[2]->node->n;
+    auto &n3 = this->faces[i]->v[2]->node->n();
 
     /* immAttr2f(uv_attr, uv1[0], uv1[1]); */
     immAttr3f(normal_attr, n1[0], n1[1], n1[2]);
@@ -419,11 +1128,11 @@ void Mesh::drawWireframe(glm::mat4 projection, glm::mat4 view, Vec4 color)
 
   for (int i = 0; i < edge_len; i++) {
     immAttr4f(col, color[0], color[1], color[2], color[3]);
-    Vec3 &x1 = edges[i]->n[0]->x;
+    Vec3 &x1 = edges[i]->n[0]->x();
     immVertex3f(pos, x1[0], x1[1], x1[2]);
 
     immAttr4f(col, color[0], color[1], color[2], color[3]);
-    Vec3 &x2 = edges[i]->n[1]->x;
+    Vec3 &x2 = edges[i]->n[1]->x();
     immVertex3f(pos, x2[0], x2[1], x2[2]);
   }
 
@@ -476,6 +1185,43 @@ void Mesh::drawUVs(glm::mat4 projection, glm::mat4 view, Vec3 pos, Vec3 scale, V
   immEnd();
 }
 
+void Mesh::drawFaceOutline(glm::mat4 projection, glm::mat4 view, const Face *face, Vec4 color)
+{
+  glEnable(GL_LINE_SMOOTH);
+  glLineWidth(3.0);
+
+  GPUVertFormat *format = immVertexFormat();
+  uint pos = format->addAttribute("pos", GPU_COMP_F32, 3, GPU_FETCH_FLOAT);
+  uint col = format->addAttribute("color", GPU_COMP_F32, 4, GPU_FETCH_FLOAT);
+
+  static Shader smooth_shader("shaders/shader_3D_smooth_color.vert",
+                              "shaders/shader_3D_smooth_color.frag");
+  glm::mat4 model = glm::mat4(1.0);
+  model = glm::translate(model, vec3ToGlmVec3(this->pos));
+  model = glm::scale(model, vec3ToGlmVec3(this->scale));
+  smooth_shader.use();
+  smooth_shader.setMat4("projection", projection);
+  smooth_shader.setMat4("view", view);
+  smooth_shader.setMat4("model", model);
+
+  /* the outline lies on the face, so it would fight with it for depth */
+  glDisable(GL_DEPTH_TEST);
+  immBegin(GPU_PRIM_LINES, 6, &smooth_shader);
+
+  for (int j = 0; j < 3; j++) {
+    immAttr4f(col, color[0], color[1], color[2], color[3]);
+    Vec3 &x1 = face->v[j]->node->x();
+    immVertex3f(pos, x1[0], x1[1], x1[2]);
+
+    immAttr4f(col, color[0], color[1], color[2], color[3]);
+    Vec3 &x2 = face->v[NEXT(j)]->node->x();
+    immVertex3f(pos, x2[0], x2[1], x2[2]);
+  }
+
+  immEnd();
+  glEnable(GL_DEPTH_TEST);
+}
+
 void Mesh::drawFaceNormals(glm::mat4 projection, glm::mat4 view, Vec4 color, double length)
 {
   int faces_len = faces.size();
@@ -500,12 +1246,13 @@ void Mesh::drawFaceNormals(glm::mat4 projection, glm::mat4 view, Vec4 color, dou
   immBegin(GPU_PRIM_LINES, faces_len * 2, &smooth_shader);
 
   for (int i = 0; i < faces_len; i++) {
+    const Face *face = faces[i];
     immAttr4f(col, color[0], color[1], color[2], color[3]);
-    Vec3 x1 = (faces[i]->v[0]->node->x + faces[i]->v[1]->node->x + faces[i]->v[2]->node->x) / 3.0;
+    Vec3 x1 = (face->v[0]->node->x() + face->v[1]->node->x() + face->v[2]->node->x()) / 3.0;
     immVertex3f(pos, x1[0], x1[1], x1[2]);
 
     immAttr4f(col, color[0], color[1], color[2], color[3]);
-    Vec3 x2 = x1 + (length * faces[i]->n);
+    Vec3 x2 = x1 + (length * face->n);
     immVertex3f(pos, x2[0], x2[1], x2[2]);
   }
 
@@ -517,14 +1264,14 @@ void Mesh::applyTransformation()
   if (pos == Vec3(0, 0, 0) && scale == Vec3(1, 1, 1)) {
   }
   else {
-    glm::mat4 model = glm::mat4(1.0);
-    model = glm::translate(model, vec3ToGlmVec3(pos));
-    model = glm::scale(model, vec3ToGlmVec3(scale));
-    const int num_nodes = nodes.size();
-    for (int i = 0; i < num_nodes; i++) {
-      Node *node = nodes[i];
-      node->x = glmVec4ToVec3(model * glm::vec4(vec3ToGlmVec3(node->x), 1.0));
+    /* the model matrix only translates and scales, apply it directly
+     * to the positions */
+    Vec3 *x = node_buffers.x.data();
+    const int num_slots = node_buffers.x.size();
+    for (int i = 0; i < num_slots; i++) {
+      x[i] = x[i].cwiseProduct(scale) + pos;
     }
+    face_bvh.moved = true;
   }
 }
 
@@ -533,45 +1280,296 @@ void Mesh::unapplyTransformation()
   if (pos == Vec3(0, 0, 0) && scale == Vec3(1, 1, 1)) {
   }
   else {
-    glm::mat4 model_inv = glm::mat4(1.0);
-    model_inv = glm::translate(model_inv, vec3ToGlmVec3(pos));
-    model_inv = glm::scale(model_inv, vec3ToGlmVec3(scale));
-    model_inv = glm::inverse(model_inv);
-    const int num_nodes = nodes.size();
-    for (int i = 0; i < num_nodes; i++) {
-      Node *node = nodes[i];
-      node->x = glmVec4ToVec3(model_inv * glm::vec4(vec3ToGlmVec3(node->x), 1.0));
+    Vec3 *x = node_buffers.x.data();
+    const int num_slots = node_buffers.x.size();
+    for (int i = 0; i < num_slots; i++) {
+      x[i] = (x[i] - pos).cwiseQuotient(scale);
     }
+    face_bvh.moved = true;
+  }
+}
+
+/* Sets the normals of faces[0 .. num_faces - 1]. The slots of their
+ * corners are gathered, the kernel then reads the positions straight
+ * from the node buffers. */
+static void setFaceNormals(const NodeBuffers &buffers, Face *const *faces, int num_faces)
+{
+  static_assert(sizeof(Vec3) == 3 * sizeof(Scalar), "node buffers must be flat Scalar arrays");
+  if (num_faces == 0) {
+    return;
+  }
+  vector<int> corners(3 * num_faces);
+  vector<Scalar> normals(3 * num_faces);
+  for (int i = 0; i < num_faces; i++) {
+    for (int j = 0; j < 3; j++) {
+      corners[3 * i + j] = faces[i]->v[j]->node->slot;
+    }
+  }
+  computeFaceNormals(buffers.x[0].data(), corners.data(), num_faces, normals.data());
+  for (int i = 0; i < num_faces; i++) {
+    faces[i]->n = Vec3(normals[3 * i], normals[3 * i + 1], normals[3 * i + 2]);
   }
 }
 
 void Mesh::updateFaceNormals()
 {
-  int faces_size = faces.size();
+  updateCornerTables();
+  if (faces.empty()) {
+    return;
+  }
+  const Scalar *x = node_buffers.x[0].data();
+  ThreadPool::global().parallelForRange(0, faces.size(), 4096, [&](int begin, int end) {
+    const int num_tris = end - begin;
+    vector<Scalar> normals(3 * num_tris);
+    computeFaceNormals(x, &corner_tables.corner_slots[3 * begin], num_tris, normals.data());
+    for (int i = 0; i < num_tris; i++) {
+      faces[begin + i]->n = Vec3(normals[3 * i], normals[3 * i + 1], normals[3 * i + 2]);
+    }
+  });
+}
 
-  for (int i = 0; i < faces_size; i++) {
-    Vec3 &x0 = faces[i]->v[0]->node->x;
-    Vec3 &x1 = faces[i]->v[1]->node->x;
-    Vec3 &x2 = faces[i]->v[2]->node->x;
+void Mesh::markDirty(Node *node)
+{
+  if (node->slot >= dirty_index.size()) {
+    dirty_index.resize(node_buffers.x.size(), -1);
+  }
+  face_bvh.moved = true;
+  if (dirty_index[node->slot] == -1) {
+    dirty_index[node->slot] = dirty_nodes.size();
+    dirty_nodes.push_back(node);
+  }
+}
 
-    faces[i]->n = normal(x0, x1, x2).normalized();
+void Mesh::setPosition(Node *node, const Vec3 &x)
+{
+  node->x() = x;
+  markDirty(node);
+}
+
+void Mesh::clearDirty()
+{
+  for (int i = 0; i < dirty_nodes.size(); i++) {
+    dirty_index[dirty_nodes[i]->slot] = -1;
   }
+  dirty_nodes.clear();
+}
+
+void Mesh::refreshNormals()
+{
+  if (dirty_nodes.empty()) {
+    return;
+  }
+  /* past some point updating everything is cheaper */
+  if (4 * dirty_nodes.size() > nodes.size()) {
+    updateFaceNormals();
+    shadeSmooth();
+    clearDirty();
+    return;
+  }
+
+  vector<Face *> dirty_faces;
+  for (const Node *node : dirty_nodes) {
+    for (const Vert *vert : node->verts) {
+      dirty_faces.insert(dirty_faces.end(), vert->adj_f.begin(), vert->adj_f.end());
+    }
+  }
+  sort(dirty_faces.begin(), dirty_faces.end());
+  dirty_faces.erase(unique(dirty_faces.begin(), dirty_faces.end()), dirty_faces.end());
+  setFaceNormals(node_buffers, dirty_faces.data(), dirty_faces.size());
+
+  /* the smooth normals of all nodes of these faces change */
+  vector<Node *> ring;
+  for (const Face *face : dirty_faces) {
+    for (int j = 0; j < 3; j++) {
+      ring.push_back(face->v[j]->node);
+    }
+  }
+  sort(ring.begin(), ring.end());
+  ring.erase(unique(ring.begin(), ring.end()), ring.end());
+  vector<pair<unsigned int, int>> corners; /* (face index, corner) */
+  for (Node *node : ring) {
+    corners.clear();
+    for (const Vert *vert : node->verts) {
+      for (const Face *face : vert->adj_f) {
+        for (int j = 0; j < 3; j++) {
+          if (face->v[j] == vert) {
+            corners.push_back(make_pair(face->index, j));
+          }
+        }
+      }
+    }
+    /* same order and contributions as shadeSmooth() */
+    sort(corners.begin(), corners.end());
+    Vec3 n(0.0, 0.0, 0.0);
+    for (const pair<unsigned int, int> &corner : corners) {
+      const Face *face = faces[corner.first];
+      const int j = corner.second;
+      n += cornerNormal(face->v[j]->node->x(),
+                        face->v[NEXT(j)]->node->x(),
+                        face->v[PREV(j)]->node->x(),
+                        normal_weighting);
+    }
+    node->n() = n.normalized();
+  }
+  clearDirty();
+}
+
+/* Adds the storage of an adjacency vector to stats */
+template<typename T>
+static void countAdjacency(const vector<T> &adj, MeshMemoryStats::Elements &stats)
+{
+  stats.adj_size += adj.size();
+  stats.adj_capacity += adj.capacity();
+  stats.adj_allocations += adj.capacity() != 0;
+}
+
+template<typename T>
+static void countElements(const vector<T *> &elems,
+                          const ElementPool<T> &pool,
+                          MeshMemoryStats::Elements &stats)
+{
+  stats.count = elems.size();
+  stats.element_size = sizeof(T);
+  stats.pool_bytes = pool.capacityBytes();
+  stats.pool_allocations = pool.numAllocations();
+}
+
+MeshMemoryStats Mesh::memoryStats() const
+{
+  MeshMemoryStats stats;
+  countElements(verts, vert_pool, stats.verts);
+  countElements(nodes, node_pool, stats.nodes);
+  countElements(edges, edge_pool, stats.edges);
+  countElements(faces, face_pool, stats.faces);
+  for (const Vert *vert : verts) {
+    countAdjacency(vert->adj_f, stats.verts);
+  }
+  for (const Node *node : nodes) {
+    countAdjacency(node->verts, stats.nodes);
+    countAdjacency(node->adj_e, stats.nodes);
+  }
+  stats.face_primitive_bytes = sizeof(Primitive) * faces.size();
+  stats.node_buffer_bytes = node_buffers.capacityBytes();
+  stats.element_vector_bytes = sizeof(void *) * (verts.capacity() + nodes.capacity() +
+                                                 edges.capacity() + faces.capacity());
+  stats.edge_map_bytes = edge_map.capacityBytes();
+  stats.normal_cache_bytes = sizeof(Node *) * dirty_nodes.capacity() +
+                             sizeof(int) * dirty_index.capacity() +
+                             sizeof(int) * (corner_tables.corner_slots.capacity() +
+                                            corner_tables.node_slots.capacity() +
+                                            corner_tables.slot_offs.capacity() +
+                                            corner_tables.slot_corners.capacity());
+  const FaceBVH &d = face_bvh;
+  stats.face_bvh_bytes = d.bvh.memoryBytes() +
+                         sizeof(Vec3) * (d.x.capacity() + d.face_normals.capacity() +
+                                         d.edge_normals.capacity() + d.node_normals.capacity()) +
+                         sizeof(int) * (d.corners.capacity() + d.corner_edges.capacity() +
+                                        d.edge_items.capacity() + d.slot_offs.capacity() +
+                                        d.slot_corners.capacity());
+  const size_t capacities[] = {verts.capacity(),
+                               nodes.capacity(),
+                               edges.capacity(),
+                               faces.capacity(),
+                               node_buffers.x.capacity(),
+                               node_buffers.n.capacity(),
+                               dirty_nodes.capacity(),
+                               dirty_index.capacity(),
+                               corner_tables.corner_slots.capacity(),
+                               corner_tables.node_slots.capacity(),
+                               corner_tables.slot_offs.capacity(),
+                               corner_tables.slot_corners.capacity(),
+                               edge_map.capacityBytes(),
+                               d.bvh.nodes.capacity(),
+                               d.bvh.items.capacity(),
+                               d.x.capacity(),
+                               d.corners.capacity(),
+                               d.corner_edges.capacity(),
+                               d.edge_items.capacity(),
+                               d.slot_offs.capacity(),
+                               d.slot_corners.capacity(),
+                               d.face_normals.capacity(),
+                               d.edge_normals.capacity(),
+                               d.node_normals.capacity()};
+  for (size_t capacity : capacities) {
+    stats.other_allocations += capacity != 0;
+  }
+  return stats;
+}
+
+size_t MeshMemoryStats::totalBytes() const
+{
+  /* face_primitive_bytes is part of the face pool */
+  return verts.pool_bytes + verts.adjBytes() + nodes.pool_bytes + nodes.adjBytes() +
+         edges.pool_bytes + faces.pool_bytes + node_buffer_bytes + element_vector_bytes +
+         edge_map_bytes + normal_cache_bytes + face_bvh_bytes;
+}
+
+size_t MeshMemoryStats::numAllocations() const
+{
+  return verts.pool_allocations + verts.adj_allocations + nodes.pool_allocations +
+         nodes.adj_allocations + edges.pool_allocations + faces.pool_allocations +
+         other_allocations;
+}
+
+void MeshMemoryStats::print(ostream &out) const
+{
+  const char *names[4] = {"verts", "nodes", "edges", "faces"};
+  const Elements *elements[4] = {&verts, &nodes, &edges, &faces};
+  out << "mesh memory:" << endl;
+  for (int i = 0; i < 4; i++) {
+    const Elements &e = *elements[i];
+    out << "  " << names[i] << ": " << e.count << " x " << e.element_size << " bytes, pool "
+        << e.pool_bytes << " bytes in " << e.pool_allocations << " allocations";
+    if (e.adj_capacity != 0) {
+      out << ", adjacency " << e.adjBytes() << " bytes (" << e.adj_size << " of "
+          << e.adj_capacity << " pointers used) in " << e.adj_allocations << " allocations";
+    }
+    out << endl;
+  }
+  out << "  Primitive base of faces: " << face_primitive_bytes << " bytes" << endl;
+  out << "  node buffers: " << node_buffer_bytes << " bytes" << endl;
+  out << "  element vectors: " << element_vector_bytes << " bytes" << endl;
+  out << "  edge map: " << edge_map_bytes << " bytes" << endl;
+  out << "  normal caches: " << normal_cache_bytes << " bytes" << endl;
+  out << "  face BVH: " << face_bvh_bytes << " bytes" << endl;
+  out << "  total: " << totalBytes() << " bytes in " << numAllocations() << " allocations"
+      << endl;
 }
 
 void Mesh::deleteMesh()
 {
-  for (int i = 0; i < verts.size(); i++) {
-    delete verts[i];
+  /* the pools release their slabs at once, elements only need to be
+   * visited when they own memory of their own */
+  if (vert_pool.destroyNeeded()) {
+    for (int i = 0; i < verts.size(); i++) {
+      vert_pool.destroy(verts[i]);
+    }
   }
-  for (int i = 0; i < nodes.size(); i++) {
-    delete nodes[i];
+  if (node_pool.destroyNeeded()) {
+    for (int i = 0; i < nodes.size(); i++) {
+      node_pool.destroy(nodes[i]);
+    }
   }
-  for (int i = 0; i < edges.size(); i++) {
-    delete edges[i];
+  if (edge_pool.destroyNeeded()) {
+    for (int i = 0; i < edges.size(); i++) {
+      edge_pool.destroy(edges[i]);
+    }
   }
-  for (int i = 0; i < faces.size(); i++) {
-    delete faces[i];
+  if (face_pool.destroyNeeded()) {
+    for (int i = 0; i < faces.size(); i++) {
+      face_pool.destroy(faces[i]);
+    }
   }
+  vert_pool.clear();
+  node_pool.clear();
+  edge_pool.clear();
+  face_pool.clear();
+  edge_map.clear();
+  node_buffers.clear();
+  dirty_nodes.clear();
+  dirty_index.clear();
+  corner_tables = CornerTables();
+  face_bvh = FaceBVH();
 
   verts.clear();
   verts.shrink_to_fit();
@@ -8,7 +8,11 @@
 #include <iostream>
 #include <sstream>
 #include <limits>
+#include <algorithm>
 
+#include "bvh.hpp"
+#include "edge_map.hpp"
+#include "element_pool.hpp"
 #include "gpu_immediate.hpp"
 #include "math.hpp"
 #include "primitives.hpp"
@@ -46,6 +50,85 @@ class Vert {
   bool isOnSeamOrBoundary();
 };
 
+/* World space positions and normals of the nodes of a mesh in
+ * contiguous arrays, indexed by Node::slot. Kernels stream over them.
+ * The components of a node are interleaved, 3 Scalars per slot, which
+ * is the layout of a GPU vertex buffer, rather than one array per
+ * component, so that Node::x() and Node::n() can return a Vec3.
+ * Mesh::draw() still goes through the immediate mode and doesn't upload
+ * them as they are.
+ *
+ * alloc() can grow the arrays, which invalidates every reference and
+ * pointer into them, including those returned by Node::x() and
+ * Node::n(). */
+class NodeBuffers {
+ private:
+  vector<int> free_slots;
+
+ public:
+  vector<Vec3> x;
+  vector<Vec3> n;
+
+  /* Returns the slot of a new node */
+  int alloc(const Vec3 &x, const Vec3 &n)
+  {
+    if (!free_slots.empty()) {
+      int slot = free_slots.back();
+      free_slots.pop_back();
+      this->x[slot] = x;
+      this->n[slot] = n;
+      return slot;
+    }
+    this->x.push_back(x);
+    this->n.push_back(n);
+    return this->x.size() - 1;
+  }
+
+  void free(int slot)
+  {
+    free_slots.push_back(slot);
+  }
+
+  /* Permutes the data of a set of distinct slots: the data of slots[i]
+   * moves to the i-th smallest of them, which replaces slots[i]. Slots
+   * outside the set and the free slots are left as they are. */
+  void reorder(vector<int> &slots)
+  {
+    vector<Vec3> old_x(slots.size()), old_n(slots.size());
+    for (int i = 0; i < slots.size(); i++) {
+      old_x[i] = x[slots[i]];
+      old_n[i] = n[slots[i]];
+    }
+    sort(slots.begin(), slots.end());
+    for (int i = 0; i < slots.size(); i++) {
+      x[slots[i]] = old_x[i];
+      n[slots[i]] = old_n[i];
+    }
+  }
+
+  /* Bytes held by the buffers */
+  size_t capacityBytes() const
+  {
+    return sizeof(Vec3) * (x.capacity() + n.capacity()) + sizeof(int) * free_slots.capacity();
+  }
+
+  /* Makes room for n slots */
+  void reserve(int n)
+  {
+    this->x.reserve(n);
+    this->n.reserve(n);
+  }
+
+  void clear()
+  {
+    x.clear();
+    x.shrink_to_fit();
+    n.clear();
+    n.shrink_to_fit();
+    free_slots.clear();
+  }
+};
+
 /* Stores the World Space coordinates */
 class Node {
  public:
@@ -55,17 +138,36 @@ class Node {
   vector<Edge *> adj_e; /* reference to adjacent edges of the
                          * node */
   int index;            /* position in Mesh.nodes */
-  Vec3 x;               /* world space position of node */
-  Vec3 n;               /* world space normal */
+  NodeBuffers *buffers; /* buffers holding position and normal */
+  int slot;             /* position in buffers, unlike index it
+                         * doesn't change when nodes are removed */
+
+  Node() : index(-1), buffers(NULL), slot(-1)
+  {
+  }
+  Node(NodeBuffers *buffers, int slot) : index(-1), buffers(buffers), slot(slot)
+  {
+  }
 
-  Node() : index(-1)
+  /* world space position of node, the reference is invalidated when
+   * Mesh::newNode() grows the buffers */
+  Vec3 &x()
   {
+    return buffers->x[slot];
   }
-  Node(const Vec3 &x) : x(x)
+  const Vec3 &x() const
   {
+    return buffers->x[slot];
   }
-  Node(const Vec3 &x, const Vec3 &n) : x(x), n(n)
+
+  /* world space normal, invalidated like x() */
+  Vec3 &n()
   {
+    return buffers->n[slot];
+  }
+  const Vec3 &n() const
+  {
+    return buffers->n[slot];
   }
 
   /* Get Vert on the opposite side of this Node for the Edge created by this Node
@@ -131,11 +233,181 @@ class Face : public Primitive {
   bool isOnSeamOrBoundary();
 };
 
+/* Flat description of a triangle mesh for Mesh::buildFromArrays(),
+ * all indices are 0 based */
+struct MeshArrays {
+  vector<Vec3> positions; /* one per node */
+  vector<Vec3> normals;   /* one per node, or empty for zero normals */
+  vector<Vec2> uvs;       /* one per vert, see tri_uvs */
+  vector<int> tris;       /* 3 position indices per triangle */
+  vector<int> tri_uvs;    /* 3 uv indices per triangle, every uv must be
+                           * used with a single position. When empty
+                           * there is one vert per node, with the uv
+                           * uvs[node] if uvs is not empty and the x
+                           * and y of the node otherwise */
+  vector<int> edges;      /* pairs of position indices of edges to add
+                           * in addition to the edges of the triangles */
+};
+
+/* Memory used by a Mesh, see Mesh::memoryStats() */
+struct MeshMemoryStats {
+  struct Elements {
+    size_t count = 0;         /* elements in the mesh */
+    size_t element_size = 0;  /* sizeof() of one element */
+    size_t pool_bytes = 0;    /* slabs of the element pool, including
+                               * free slots */
+    size_t adj_size = 0;      /* pointers in the adjacency vectors of
+                               * the elements */
+    size_t adj_capacity = 0;  /* pointers they have room for */
+    size_t adj_allocations = 0; /* adjacency vectors holding memory */
+    size_t pool_allocations = 0;
+
+    size_t adjBytes() const
+    {
+      return sizeof(void *) * adj_capacity;
+    }
+  };
+
+  Elements verts;  /* adjacency is Vert::adj_f */
+  Elements nodes;  /* adjacency is Node::verts and Node::adj_e */
+  Elements edges;  /* no adjacency vectors */
+  Elements faces;  /* no adjacency vectors */
+  size_t face_primitive_bytes = 0; /* part of the faces spent on their
+                                    * Primitive base */
+  size_t node_buffer_bytes = 0;    /* positions and normals */
+  size_t element_vector_bytes = 0; /* Mesh::verts, nodes, edges and faces */
+  size_t edge_map_bytes = 0;
+  size_t normal_cache_bytes = 0;   /* corner tables and dirty tracking */
+  size_t face_bvh_bytes = 0;       /* BVH of intersectionTest() and its
+                                    * per face tables */
+  size_t other_allocations = 0;    /* vectors of the mesh holding memory */
+
+  size_t totalBytes() const;
+  size_t numAllocations() const;
+  void print(ostream &out) const;
+};
+
+/* Result of Mesh::rayCast() */
+struct RayHit {
+  Face *face = NULL; /* NULL when the ray missed */
+  /* barycentric coordinates of the hit, the weights of face->v[1] and
+   * v[2], v[0] has 1 - u - v */
+  Scalar u = 0;
+  Scalar v = 0;
+  /* along the ray, in units of the length of its direction */
+  Scalar distance = numeric_limits<Scalar>::infinity();
+};
+
+/* Candidate pairs of the self collision broad phase, see
+ * Mesh::selfCollisionCandidates() */
+struct SelfCollisionCandidates {
+  vector<pair<Node *, Face *>> vertex_face;
+  vector<pair<Edge *, Edge *>> edge_edge;
+
+  void clear()
+  {
+    vertex_face.clear();
+    edge_edge.clear();
+  }
+};
+
+/* How the normals of the faces around a node are weighted in its
+ * smooth normal, see Mesh::shadeSmooth() */
+enum NormalWeighting {
+  NORMAL_WEIGHT_UNIFORM, /* every face the same */
+  NORMAL_WEIGHT_AREA,    /* by face area */
+  NORMAL_WEIGHT_ANGLE,   /* by the angle of the face at the node */
+  NORMAL_WEIGHT_MAX,     /* by face area over the squared lengths of the
+                          * two edges at the node (Max 1999), the
+                          * default */
+};
+
+/* Contribution of the face corner at x, with x_next and x_prev the
+ * following corners, to the smooth normal of its node */
+Vec3 cornerNormal(const Vec3 &x,
+                  const Vec3 &x_next,
+                  const Vec3 &x_prev,
+                  NormalWeighting weighting);
+
+/* Corners grouped by node slot with a counting sort: the corners c
+ * with corner_slots[c] == s are r_slot_corners[r_slot_offs[s] ..
+ * r_slot_offs[s + 1] - 1], in increasing order */
+void slotCorners(const vector<int> &corner_slots,
+                 int num_slots,
+                 vector<int> &r_slot_offs,
+                 vector<int> &r_slot_corners);
+
 /* Stores the overall Mesh data */
 class Mesh : public Primitive {
  private:
-  void setIndices();
+  ElementPool<Vert> vert_pool;
+  ElementPool<Node> node_pool;
+  ElementPool<Edge> edge_pool;
+  ElementPool<Face> face_pool;
+  NodeBuffers node_buffers;
+  vector<Node *> dirty_nodes; /* see markDirty() */
+  vector<int> dirty_index;    /* position in dirty_nodes by Node::slot,
+                               * -1 for clean nodes */
+  NormalWeighting normal_weighting = NORMAL_WEIGHT_MAX;
+  Scalar bvh_rebuild_threshold = 1.5;
+
+  /* Flat index tables for the normal computations, built on first use
+   * and kept until the topology changes */
+  struct CornerTables {
+    bool valid = false;
+    vector<int> corner_slots; /* node slot of every face corner */
+    vector<int> node_slots;   /* slot of every node in nodes */
+    vector<int> slot_offs;    /* slot_corners[slot_offs[s] ..
+                               * slot_offs[s + 1] - 1] are the corners
+                               * of the node in slot s, in face order */
+    vector<int> slot_corners;
+  } corner_tables;
+  EdgeMap edge_map; /* every edge by its nodes, kept up to date by add()
+                     * and remove() */
+
+  /* World space faces for intersectionTest() and rayCast(), built on
+   * first use and rebuilt when the topology changes. When only nodes
+   * move or pos or scale change the BVH is refit instead, unless that
+   * makes it worse than bvh_rebuild_threshold times its cost after
+   * the last build. The per face arrays are in the order of bvh.items
+   * so that a leaf reads them sequentially. */
+  struct FaceBVH {
+    bool valid = false;
+    bool moved = false;        /* nodes moved since the last update */
+    Scalar build_cost = 0;     /* BVH::sahCost() after the last build */
+    Scalar cost = 0;           /* BVH::sahCost() now */
+    Vec3 pos = Vec3::Zero();   /* transformation of x */
+    Vec3 scale = Vec3::Zero();
+    BVH bvh;                   /* over the faces */
+    vector<Vec3> x;            /* world space position by node slot */
+    /* topology in the order of the items, kept while refitting */
+    vector<int> corners;       /* node slots of the faces, 3 per item */
+    vector<int> corner_edges;  /* edge index opposite of each corner */
+    vector<int> edge_items;    /* items of the faces of every edge, 2
+                                * per edge index, -1 for none */
+    vector<int> slot_offs;     /* slot_corners[slot_offs[s] ..
+                                * slot_offs[s + 1] - 1] are the corners
+                                * of slot s */
+    vector<int> slot_corners;
+    /* pseudo normals */
+    vector<Vec3> face_normals; /* unit normal, 1 per item */
+    vector<Vec3> edge_normals; /* by edge index */
+    vector<Vec3> node_normals; /* angle weighted, by slot */
+  } face_bvh;
+
   void deleteMesh();
+  void clearDirty();
+  void updateCornerTables();
+  void updateFaceBVH();
+  Scalar signedDistance(const Vec3 &p, Vec3 &r_normal) const;
+  void castRayPacket(const Vec3 *origins,
+                     const Vec3 *directions,
+                     int num_rays,
+                     Scalar max_distance,
+                     bool any_hit,
+                     RayHit *r_hits) const;
+
+  friend class MeshEdit;
 
  public:
   Mesh()
@@ -193,11 +465,34 @@ class Mesh : public Primitive {
   {
   }
 
+  /* The index of every element is its position in these vectors,
+   * remove() moves the last element into the freed position */
   vector<Vert *> verts;
   vector<Node *> nodes;
   vector<Edge *> edges;
   vector<Face *> faces;
 
+  /* Positions and normals of the nodes, indexed by Node::slot */
+  const NodeBuffers &nodeBuffers() const
+  {
+    return node_buffers;
+  }
+
+  /* Elements are allocated from slabs owned by the mesh and are freed
+   * together with it. An element must only be added to the mesh that
+   * allocated it, deleteElement() gives the memory of an element that
+   * was removed from the mesh back for reuse. */
+  Vert *newVert(const Vec2 &uv);
+  /* can grow the node buffers, see NodeBuffers */
+  Node *newNode(const Vec3 &x, const Vec3 &n);
+  Edge *newEdge(Node *n0, Node *n1);
+  Face *newFace(Vert *v0, Vert *v1, Vert *v2);
+
+  void deleteElement(Vert *vert);
+  void deleteElement(Node *node);
+  void deleteElement(Edge *edge);
+  void deleteElement(Face *face);
+
   virtual void add(Vert *vert);
   virtual void add(Node *node);
   virtual void add(Edge *edge);
@@ -208,32 +503,186 @@ class Mesh : public Primitive {
   virtual void remove(Edge *edge);
   virtual void remove(Face *face);
 
+  /* Edge between n0 and n1 or NULL, expected O(1) */
+  Edge *getEdge(const Node *n0, const Node *n1) const
+  {
+    return edge_map.find(n0, n1);
+  }
+
+  /* Replaces the mesh with the one described by arrays. All elements
+   * and their adjacency are built at once on the thread pool, grouped
+   * with atomic counts and prefix sums, and come out the same for any
+   * number of threads. Returns false, leaving the mesh empty, if an
+   * index is out of range. */
+  bool buildFromArrays(const MeshArrays &arrays);
+
+  /* Positions of loaded OBJ files within this distance of each other
+   * are welded, see weldObj(). 0, the default, disables welding. */
+  static Scalar weld_distance;
   virtual void loadObj(const string &file);
-  void saveObj(const string &filename);
+  /* Formats the OBJ text in chunks, in parallel unless parallel is
+   * false, and writes it with a single write */
+  void saveObj(const string &filename, bool parallel = true);
+
+  /* Binary cache of the mesh loaded from obj_filename, stored next to
+   * it as cacheFilename(). loadObj() uses the cache when it is up to
+   * date with the OBJ file and weld_distance and otherwise writes it
+   * after parsing, unless cache_enabled is false. loadCache() only
+   * works on an empty mesh. */
+  static bool cache_enabled; /* true by default */
+  static string cacheFilename(const string &obj_filename);
+  bool loadCache(const string &obj_filename);
+  bool saveCache(const string &obj_filename);
+
+  void setNormalWeighting(NormalWeighting weighting)
+  {
+    normal_weighting = weighting;
+  }
+  NormalWeighting normalWeighting() const
+  {
+    return normal_weighting;
+  }
+  /* Has to be called after faces, verts or nodes were relinked without
+   * add() or remove(), the normal computations cache the topology */
+  void invalidateCornerTables()
+  {
+    corner_tables.valid = false;
+    face_bvh.valid = false;
+  }
 
+  /* Reorders the elements for locality, see mesh_layout.cpp. Faces are
+   * ordered for the post transform vertex cache with Tipsify, nodes,
+   * verts and edges by their first use in that order and the node
+   * buffers follow the nodes. Indices are renumbered and the slots of
+   * the nodes in the mesh are permuted among themselves, the elements
+   * themselves stay where they are. The slots of nodes that are not in
+   * the mesh, removed or not added yet, keep their data. */
+  void optimizeLayout(int cache_size = 16);
+  /* Average number of misses per face of a FIFO vertex cache of
+   * cache_size nodes drawing the faces in order (ACMR), between 0.5
+   * for large regular meshes and 3 */
+  double averageCacheMissRatio(int cache_size = 16) const;
+
+  /* Bytes and allocations used by the mesh, by element type. Walks
+   * all elements, so it is O(size of the mesh). */
+  MeshMemoryStats memoryStats() const;
+
+  /* Sets the normal of every node to the weighted sum of the normals
+   * of its faces, see setNormalWeighting() */
   void shadeSmooth();
 
   virtual void draw();
   void drawWireframe(glm::mat4 projection, glm::mat4 view, Vec4 color);
   void drawFaceNormals(glm::mat4 projection, glm::mat4 view, Vec4 color, double length);
+  /* Outline of face on top of everything, for example of a face picked
+   * with rayCast() */
+  void drawFaceOutline(glm::mat4 projection, glm::mat4 view, const Face *face, Vec4 color);
   void drawUVs(glm::mat4 projection, glm::mat4 view, Vec3 pos, Vec3 scale, Vec4 color);
 
-  virtual bool intersectionTest(const Vec3 &p, Vec3 &r_normal, double &r_distance)
+  /* Signed distance from the world space point p to the surface of
+   * the mesh, with pos and scale applied, see mesh_distance.cpp.
+   * r_distance is negative inside the mesh and r_normal is the unit
+   * vector from the closest point of the surface towards p, flipped
+   * inside so that it always points out of the mesh. Returns true when
+   * p is inside. A query is O(log n) on a BVH built on first use,
+   * nodes moved without markDirty() or setPosition() aren't noticed.
+   * Inside and outside are only meaningful for closed meshes. */
+  virtual bool intersectionTest(const Vec3 &p, Vec3 &r_normal, double &r_distance);
+  /* intersectionTest() of all points in parallel, r_normals and
+   * r_distances are resized to the number of points. Returns the
+   * number of points inside the mesh. */
+  int intersectionTest(const vector<Vec3> &points,
+                       vector<Vec3> &r_normals,
+                       vector<double> &r_distances);
+
+  /* How much worse than right after a build, by the surface area
+   * heuristic, the BVH of intersectionTest() and rayCast() may get from
+   * refitting it to moved nodes before it is rebuilt, 1.5 by default.
+   * Below 1 it is rebuilt on every change. */
+  void setBVHRebuildThreshold(Scalar threshold)
   {
-    return false;
+    bvh_rebuild_threshold = threshold;
+  }
+  Scalar bvhRebuildThreshold() const
+  {
+    return bvh_rebuild_threshold;
+  }
+  /* Cost of the BVH over its cost after the last build, 1 right after a
+   * build, 0 before the first query */
+  Scalar bvhDegradation() const
+  {
+    return face_bvh.build_cost > 0 ? face_bvh.cost / face_bvh.build_cost : 0;
   }
 
+  /* Closest face hit by the ray origin + t * direction for t in
+   * [0, max_distance], in world space like intersectionTest(). Faces
+   * are hit from both sides. Returns false and leaves r_hit without a
+   * face when the ray misses. */
+  bool rayCast(const Vec3 &origin,
+               const Vec3 &direction,
+               RayHit &r_hit,
+               Scalar max_distance = numeric_limits<Scalar>::infinity());
+  /* rayCast() of many rays, see mesh_raycast.cpp. Packets of
+   * ray_packet_size consecutive rays are traced together with SIMD
+   * tests in single precision and the packets run in parallel, so rays
+   * that are close in the arrays should be coherent, as the rays of
+   * neighbouring pixels are. r_hits is resized to the number of rays.
+   * Returns the number of hits. A packet fills one SIMD register, 8
+   * rays with AVX and 4 with SSE, a wider packet split over several
+   * registers is slower than single rays. */
+#ifdef __AVX__
+  static constexpr int ray_packet_size = 8;
+#else
+  static constexpr int ray_packet_size = 4;
+#endif
+  int rayCast(const vector<Vec3> &origins,
+              const vector<Vec3> &directions,
+              vector<RayHit> &r_hits,
+              Scalar max_distance = numeric_limits<Scalar>::infinity());
+  /* Ambient occlusion at every node from num_samples cosine weighted
+   * rays over the hemisphere of its angle weighted normal, traced in
+   * packets, r_occlusion[node->index] is the fraction of rays that hit
+   * the mesh within max_distance, ready for use as vertex colours
+   * after 1 - occlusion. */
+  void bakeAmbientOcclusion(vector<Scalar> &r_occlusion,
+                            int num_samples = 64,
+                            Scalar max_distance = numeric_limits<Scalar>::infinity());
+
+  /* Broad phase of self collisions, see mesh_collision.cpp. Finds the
+   * node face and edge edge pairs whose bounding boxes are within
+   * thickness of each other, in world space like intersectionTest() and
+   * on the same BVH. Elements that share a node are adjacent and never
+   * paired, every pair is reported once. The BVH is traversed in
+   * parallel and the result doesn't depend on the number of threads. */
+  void selfCollisionCandidates(Scalar thickness, SelfCollisionCandidates &r_candidates);
+
   virtual void applyTransformation();
   virtual void unapplyTransformation();
 
   void updateFaceNormals();
 
-  ~Mesh()
+  /* Incremental normal updates. Nodes that moved are marked with
+   * markDirty(), or moved with setPosition(), then refreshNormals()
+   * updates the normals of the faces around them and the smooth
+   * normals of the nodes of those faces, giving the same result as
+   * updateFaceNormals() followed by shadeSmooth(). The cost depends
+   * on the number of dirty nodes and not on the size of the mesh. */
+  void markDirty(Node *node);
+  void setPosition(Node *node, const Vec3 &x);
+  int numDirtyNodes() const
+  {
+    return dirty_nodes.size();
+  }
+  void refreshNormals();
+
+  virtual ~Mesh()
   {
     deleteMesh();
   }
 };
 
+/* Edge between n0 and n1 or NULL, scans the adjacent edges of n0, use
+ * Mesh::getEdge() when the mesh is at hand */
 inline Edge *getEdge(const Node *n0, const Node *n1)
 {
   for (int i = 0; i < (int)n0->adj_e.size(); i++) {
@@ -0,0 +1,429 @@
+/* Binary sidecar cache (.mbin) of a Mesh loaded from an OBJ file.
+ *
+ * The cache stores the element data together with every adjacency
+ * table so that loading it only has to allocate the elements and
+ * connect the pointers, no parsing and no edge lookups. The file is
+ * memory mapped and read in place. It is tied to its source file by
+ * the size and modification time of the source and the weld distance
+ * it was loaded with, any mismatch makes the cache stale. */
+
+#include "mesh.hpp"
+#include "thread_pool.hpp"
+
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define MESH_CACHE_VERSION 2
+#define MESH_CACHE_BYTE_ORDER 0x01020304u
+
+struct MeshCacheHeader {
+  char magic[4]; /* "MBIN" */
+  uint32_t version;
+  uint32_t byte_order;  /* MESH_CACHE_BYTE_ORDER as written by the host */
+  uint32_t scalar_size; /* sizeof(Scalar) */
+  uint64_t source_size;
+  int64_t source_mtime_sec;
+  int64_t source_mtime_nsec;
+  uint32_t num_nodes;
+  uint32_t num_verts;
+  uint32_t num_edges;
+  uint32_t num_faces;
+  uint32_t num_node_verts; /* total length of all Node.verts */
+  uint32_t num_node_adj_e; /* total length of all Node.adj_e */
+  uint32_t num_vert_adj_f; /* total length of all Vert.adj_f */
+  uint32_t pad;
+  double weld_distance; /* Mesh::weld_distance the OBJ was loaded with */
+};
+
+/* Byte offsets of the arrays that follow the header, every array is
+ * 8 byte aligned. Variable length adjacency lists are stored as
+ * offset (count + 1) and item arrays. Element references are indices,
+ * -1 for NULL. */
+struct MeshCacheLayout {
+  size_t node_x;          /* Scalar[3 * num_nodes] */
+  size_t node_n;          /* Scalar[3 * num_nodes] */
+  size_t node_verts_offs; /* int32[num_nodes + 1] */
+  size_t node_verts;      /* int32[num_node_verts] */
+  size_t node_adj_e_offs; /* int32[num_nodes + 1] */
+  size_t node_adj_e;      /* int32[num_node_adj_e] */
+  size_t vert_uv;         /* Scalar[2 * num_verts] */
+  size_t vert_node;       /* int32[num_verts] */
+  size_t vert_adj_f_offs; /* int32[num_verts + 1] */
+  size_t vert_adj_f;      /* int32[num_vert_adj_f] */
+  size_t edge_n;          /* int32[2 * num_edges] */
+  size_t edge_adj_f;      /* int32[2 * num_edges] */
+  size_t face_v;          /* int32[3 * num_faces] */
+  size_t face_adj_e;      /* int32[3 * num_faces] */
+  size_t size;            /* total file size */
+
+  MeshCacheLayout(const MeshCacheHeader &h)
+  {
+    size_t offset = sizeof(MeshCacheHeader);
+    node_x = section(offset, sizeof(Scalar) * 3 * h.num_nodes);
+    node_n = section(offset, sizeof(Scalar) * 3 * h.num_nodes);
+    node_verts_offs = section(offset, sizeof(int32_t) * (h.num_nodes + 1));
+    node_verts = section(offset, sizeof(int32_t) * h.num_node_verts);
+    node_adj_e_offs = section(offset, sizeof(int32_t) * (h.num_nodes + 1));
+    node_adj_e = section(offset, sizeof(int32_t) * h.num_node_adj_e);
+    vert_uv = section(offset, sizeof(Scalar) * 2 * h.num_verts);
+    vert_node = section(offset, sizeof(int32_t) * h.num_verts);
+    vert_adj_f_offs = section(offset, sizeof(int32_t) * (h.num_verts + 1));
+    vert_adj_f = section(offset, sizeof(int32_t) * h.num_vert_adj_f);
+    edge_n = section(offset, sizeof(int32_t) * 2 * h.num_edges);
+    edge_adj_f = section(offset, sizeof(int32_t) * 2 * h.num_edges);
+    face_v = section(offset, sizeof(int32_t) * 3 * h.num_faces);
+    face_adj_e = section(offset, sizeof(int32_t) * 3 * h.num_faces);
+    size = offset;
+  }
+
+ private:
+  static size_t section(size_t &offset, size_t len)
+  {
+    size_t start = offset;
+    offset = (offset + len + 7) & ~(size_t)7;
+    return start;
+  }
+};
+
+/* Read only memory mapping of a whole file */
+class MappedFile {
+ public:
+  const char *data;
+  size_t size;
+
+  MappedFile(const string &filename) : data(NULL), size(0)
+  {
+    int fd = open(filename.c_str(), O_RDONLY);
+    if (fd == -1) {
+      return;
+    }
+    struct stat st;
+    if (fstat(fd, &st) == 0 && st.st_size > 0) {
+      void *ptr = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+      if (ptr != MAP_FAILED) {
+        data = (const char *)ptr;
+        size = st.st_size;
+        madvise(ptr, size, MADV_SEQUENTIAL | MADV_WILLNEED);
+      }
+    }
+    close(fd);
+  }
+
+  ~MappedFile()
+  {
+    if (data) {
+      munmap((void *)data, size);
+    }
+  }
+
+  template<typename T> const T *at(size_t offset) const
+  {
+    return (const T *)(data + offset);
+  }
+};
+
+static bool statSource(const string &filename, MeshCacheHeader &r_header)
+{
+  struct stat st;
+  if (stat(filename.c_str(), &st) != 0) {
+    return false;
+  }
+  r_header.source_size = st.st_size;
+  r_header.source_mtime_sec = st.st_mtim.tv_sec;
+  r_header.source_mtime_nsec = st.st_mtim.tv_nsec;
+  return true;
+}
+
+/* true if every entry of the n indices is in [0, max) or is -1 when
+ * allow_null */
+static bool indicesValid(const int32_t *indices, size_t n, uint32_t max, bool allow_null)
+{
+  bool valid = true;
+  for (size_t i = 0; i < n; i++) {
+    int32_t index = indices[i];
+    valid &= (index >= 0 && (uint32_t)index < max) || (allow_null && index == -1);
+  }
+  return valid;
+}
+
+/* true if offs[0..n] is a non decreasing sequence from 0 to total */
+static bool offsetsValid(const int32_t *offs, uint32_t n, uint32_t total)
+{
+  if (offs[0] != 0 || (uint32_t)offs[n] != total) {
+    return false;
+  }
+  for (uint32_t i = 0; i < n; i++) {
+    if (offs[i] > offs[i + 1]) {
+      return false;
+    }
+  }
+  return true;
+}
+
+bool Mesh::cache_enabled = true;
+
+string Mesh::cacheFilename(const string &obj_filename)
+{
+  return obj_filename + ".mbin";
+}
+
+bool Mesh::loadCache(const string &obj_filename)
+{
+  if (!verts.empty() || !nodes.empty() || !edges.empty() || !faces.empty()) {
+    return false;
+  }
+
+  MeshCacheHeader source;
+  if (!statSource(obj_filename, source)) {
+    return false;
+  }
+  MappedFile file(cacheFilename(obj_filename));
+  if (!file.data || file.size < sizeof(MeshCacheHeader)) {
+    return false;
+  }
+  const MeshCacheHeader &h = *file.at<MeshCacheHeader>(0);
+  if (memcmp(h.magic, "MBIN", 4) != 0 || h.version != MESH_CACHE_VERSION ||
+      h.byte_order != MESH_CACHE_BYTE_ORDER || h.scalar_size != sizeof(Scalar) ||
+      h.source_size != source.source_size || h.source_mtime_sec != source.source_mtime_sec ||
+      h.source_mtime_nsec != source.source_mtime_nsec || h.weld_distance != weld_distance) {
+    return false;
+  }
+  const MeshCacheLayout layout(h);
+  if (file.size != layout.size) {
+    return false;
+  }
+
+  const Scalar *node_x = file.at<Scalar>(layout.node_x);
+  const Scalar *node_n = file.at<Scalar>(layout.node_n);
+  const int32_t *node_verts_offs = file.at<int32_t>(layout.node_verts_offs);
+  const int32_t *node_verts = file.at<int32_t>(layout.node_verts);
+  const int32_t *node_adj_e_offs = file.at<int32_t>(layout.node_adj_e_offs);
+  const int32_t *node_adj_e = file.at<int32_t>(layout.node_adj_e);
+  const Scalar *vert_uv = file.at<Scalar>(layout.vert_uv);
+  const int32_t *vert_node = file.at<int32_t>(layout.vert_node);
+  const int32_t *vert_adj_f_offs = file.at<int32_t>(layout.vert_adj_f_offs);
+  const int32_t *vert_adj_f = file.at<int32_t>(layout.vert_adj_f);
+  const int32_t *edge_n = file.at<int32_t>(layout.edge_n);
+  const int32_t *edge_adj_f = file.at<int32_t>(layout.edge_adj_f);
+  const int32_t *face_v = file.at<int32_t>(layout.face_v);
+  const int32_t *face_adj_e = file.at<int32_t>(layout.face_adj_e);
+
+  /* never trust the file to not point outside of the mesh */
+  if (!offsetsValid(node_verts_offs, h.num_nodes, h.num_node_verts) ||
+      !offsetsValid(node_adj_e_offs, h.num_nodes, h.num_node_adj_e) ||
+      !offsetsValid(vert_adj_f_offs, h.num_verts, h.num_vert_adj_f) ||
+      !indicesValid(node_verts, h.num_node_verts, h.num_verts, false) ||
+      !indicesValid(node_adj_e, h.num_node_adj_e, h.num_edges, false) ||
+      !indicesValid(vert_node, h.num_verts, h.num_nodes, true) ||
+      !indicesValid(vert_adj_f, h.num_vert_adj_f, h.num_faces, false) ||
+      !indicesValid(edge_n, 2 * h.num_edges, h.num_nodes, false) ||
+      !indicesValid(edge_adj_f, 2 * h.num_edges, h.num_faces, true) ||
+      !indicesValid(face_v, 3 * h.num_faces, h.num_verts, false) ||
+      !indicesValid(face_adj_e, 3 * h.num_faces, h.num_edges, false)) {
+    return false;
+  }
+
+  /* allocate every element first so that the pointers can be
+   * connected in a second pass, every task only writes to its own
+   * elements */
+  ThreadPool &pool = ThreadPool::global();
+  nodes.resize(h.num_nodes);
+  verts.resize(h.num_verts);
+  edges.resize(h.num_edges);
+  faces.resize(h.num_faces);
+  node_pool.allocUninitialized(h.num_nodes, nodes.data());
+  vert_pool.allocUninitialized(h.num_verts, verts.data());
+  edge_pool.allocUninitialized(h.num_edges, edges.data());
+  face_pool.allocUninitialized(h.num_faces, faces.data());
+  node_buffers.x.resize(h.num_nodes);
+  node_buffers.n.resize(h.num_nodes);
+  pool.parallelForRange(0, h.num_nodes, 4096, [&](int begin, int end) {
+    for (int i = begin; i < end; i++) {
+      node_buffers.x[i] = Vec3(node_x[3 * i], node_x[3 * i + 1], node_x[3 * i + 2]);
+      node_buffers.n[i] = Vec3(node_n[3 * i], node_n[3 * i + 1], node_n[3 * i + 2]);
+      new (nodes[i]) Node(&node_buffers, i);
+      nodes[i]->index = i;
+    }
+  });
+  pool.parallelForRange(0, h.num_verts, 4096, [&](int begin, int end) {
+    for (int i = begin; i < end; i++) {
+      new (verts[i]) Vert(Vec2(vert_uv[2 * i], vert_uv[2 * i + 1]));
+      verts[i]->index = i;
+    }
+  });
+  pool.parallelForRange(0, h.num_edges, 4096, [&](int begin, int end) {
+    for (int i = begin; i < end; i++) {
+      new (edges[i]) Edge();
+      edges[i]->index = i;
+    }
+  });
+  pool.parallelForRange(0, h.num_faces, 4096, [&](int begin, int end) {
+    for (int i = begin; i < end; i++) {
+      new (faces[i]) Face();
+      faces[i]->index = i;
+    }
+  });
+
+  pool.parallelForRange(0, h.num_nodes, 4096, [&](int begin, int end) {
+    for (int i = begin; i < end; i++) {
+      Node *node = nodes[i];
+      node->verts.resize(node_verts_offs[i + 1] - node_verts_offs[i]);
+      for (int j = 0; j < node->verts.size(); j++) {
+        node->verts[j] = verts[node_verts[node_verts_offs[i] + j]];
+      }
+      node->adj_e.resize(node_adj_e_offs[i + 1] - node_adj_e_offs[i]);
+      for (int j = 0; j < node->adj_e.size(); j++) {
+        node->adj_e[j] = edges[node_adj_e[node_adj_e_offs[i] + j]];
+      }
+    }
+  });
+  pool.parallelForRange(0, h.num_verts, 4096, [&](int begin, int end) {
+    for (int i = begin; i < end; i++) {
+      Vert *vert = verts[i];
+      vert->node = vert_node[i] == -1 ? NULL : nodes[vert_node[i]];
+      vert->adj_f.resize(vert_adj_f_offs[i + 1] - vert_adj_f_offs[i]);
+      for (int j = 0; j < vert->adj_f.size(); j++) {
+        vert->adj_f[j] = faces[vert_adj_f[vert_adj_f_offs[i] + j]];
+      }
+    }
+  });
+  pool.parallelForRange(0, h.num_edges, 4096, [&](int begin, int end) {
+    for (int i = begin; i < end; i++) {
+      Edge *edge = edges[i];
+      for (int j = 0; j < 2; j++) {
+        edge->n[j] = nodes[edge_n[2 * i + j]];
+        edge->adj_f[j] = edge_adj_f[2 * i + j] == -1 ? NULL : faces[edge_adj_f[2 * i + j]];
+      }
+    }
+  });
+  pool.parallelForRange(0, h.num_faces, 4096, [&](int begin, int end) {
+    for (int i = begin; i < end; i++) {
+      Face *face = faces[i];
+      for (int j = 0; j < 3; j++) {
+        face->v[j] = verts[face_v[3 * i + j]];
+        face->adj_e[j] = edges[face_adj_e[3 * i + j]];
+      }
+    }
+  });
+
+  edge_map.reserve(edges.size());
+  for (int i = 0; i < edges.size(); i++) {
+    edge_map.insert(edges[i]->n[0], edges[i]->n[1], edges[i]);
+  }
+
+  return true;
+}
+
+/* Writes the adjacency lists of elems as offset and item arrays */
+template<typename T, typename F>
+static void writeLists(const vector<T *> &elems, F list_of, int32_t *offs, int32_t *items)
+{
+  offs[0] = 0;
+  for (int i = 0; i < elems.size(); i++) {
+    const auto &list = list_of(elems[i]);
+    for (int j = 0; j < list.size(); j++) {
+      items[offs[i] + j] = list[j]->index;
+    }
+    offs[i + 1] = offs[i] + list.size();
+  }
+}
+
+bool Mesh::saveCache(const string &obj_filename)
+{
+  MeshCacheHeader h;
+  memset(&h, 0, sizeof(h));
+  if (!statSource(obj_filename, h)) {
+    return false;
+  }
+  memcpy(h.magic, "MBIN", 4);
+  h.version = MESH_CACHE_VERSION;
+  h.byte_order = MESH_CACHE_BYTE_ORDER;
+  h.scalar_size = sizeof(Scalar);
+  h.weld_distance = weld_distance;
+  h.num_nodes = nodes.size();
+  h.num_verts = verts.size();
+  h.num_edges = edges.size();
+  h.num_faces = faces.size();
+  for (int i = 0; i < nodes.size(); i++) {
+    h.num_node_verts += nodes[i]->verts.size();
+    h.num_node_adj_e += nodes[i]->adj_e.size();
+  }
+  for (int i = 0; i < verts.size(); i++) {
+    h.num_vert_adj_f += verts[i]->adj_f.size();
+  }
+  const MeshCacheLayout layout(h);
+
+  vector<char> buffer(layout.size, 0);
+  char *data = buffer.data();
+  memcpy(data, &h, sizeof(h));
+  Scalar *node_x = (Scalar *)(data + layout.node_x);
+  Scalar *node_n = (Scalar *)(data + layout.node_n);
+  for (int i = 0; i < nodes.size(); i++) {
+    for (int j = 0; j < 3; j++) {
+      node_x[3 * i + j] = nodes[i]->x()[j];
+      node_n[3 * i + j] = nodes[i]->n()[j];
+    }
+  }
+  writeLists(
+      nodes,
+      [](const Node *node) -> const vector<Vert *> & { return node->verts; },
+      (int32_t *)(data + layout.node_verts_offs),
+      (int32_t *)(data + layout.node_verts));
+  writeLists(
+      nodes,
+      [](const Node *node) -> const vector<Edge *> & { return node->adj_e; },
+      (int32_t *)(data + layout.node_adj_e_offs),
+      (int32_t *)(data + layout.node_adj_e));
+
+  Scalar *vert_uv = (Scalar *)(data + layout.vert_uv);
+  int32_t *vert_node = (int32_t *)(data + layout.vert_node);
+  for (int i = 0; i < verts.size(); i++) {
+    vert_uv[2 * i] = verts[i]->uv[0];
+    vert_uv[2 * i + 1] = verts[i]->uv[1];
+    vert_node[i] = verts[i]->node ? verts[i]->node->index : -1;
+  }
+  writeLists(
+      verts,
+      [](const Vert *vert) -> const vector<Face *> & { return vert->adj_f; },
+      (int32_t *)(data + layout.vert_adj_f_offs),
+      (int32_t *)(data + layout.vert_adj_f));
+
+  int32_t *edge_n = (int32_t *)(data + layout.edge_n);
+  int32_t *edge_adj_f = (int32_t *)(data + layout.edge_adj_f);
+  for (int i = 0; i < edges.size(); i++) {
+    for (int j = 0; j < 2; j++) {
+      edge_n[2 * i + j] = edges[i]->n[j]->index;
+      edge_adj_f[2 * i + j] = edges[i]->adj_f[j] ? edges[i]->adj_f[j]->index : -1;
+    }
+  }
+
+  int32_t *face_v = (int32_t *)(data + layout.face_v);
+  int32_t *face_adj_e = (int32_t *)(data + layout.face_adj_e);
+  for (int i = 0; i < faces.size(); i++) {
+    for (int j = 0; j < 3; j++) {
+      face_v[3 * i + j] = faces[i]->v[j]->index;
+      face_adj_e[3 * i + j] = faces[i]->adj_e[j]->index;
+    }
+  }
+
+  /* write to a temporary file first so that a concurrent or
+   * interrupted save never leaves a truncated cache behind */
+  string filename = cacheFilename(obj_filename);
+  string tmp_filename = filename + ".tmp";
+  FILE *fp = fopen(tmp_filename.c_str(), "wb");
+  if (!fp) {
+    return false;
+  }
+  bool ok = fwrite(data, 1, buffer.size(), fp) == buffer.size();
+  ok &= fclose(fp) == 0;
+  if (!ok || rename(tmp_filename.c_str(), filename.c_str()) != 0) {
+    ::remove(tmp_filename.c_str());
+    return false;
+  }
+  return true;
+}
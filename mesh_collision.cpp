@@ -0,0 +1,367 @@
+/* Broad phase of the self collisions of a Mesh, the candidate node face
+ * and edge edge pairs that a cloth solver then tests exactly.
+ *
+ * The BVH of intersectionTest() is traversed against itself: a node
+ * collides its children with each other and every child with itself,
+ * and a pair of overlapping children descends into the larger one
+ * until both are leaves. Pairs of faces are found rather than pairs of
+ * elements, so every node and edge is owned by one of its faces and
+ * only tested by that face. An element is inside the box of its owner,
+ * so a pair of elements within thickness always has a pair of owners
+ * within thickness and comes up exactly once.
+ *
+ * The top of the traversal is split into a fixed number of tasks that
+ * run in parallel, each with its own output which is appended in task
+ * order, so that the result is the same for any number of threads. */
+
+#include "mesh.hpp"
+#include "thread_pool.hpp"
+
+#include <cmath>
+
+/* The traversal is split into at least this many tasks, when the tree
+ * is big enough */
+static const int min_num_tasks = 256;
+
+/* Bits of SelfCollider::owned, corner j of an item owns its node with
+ * bit j and the edge opposite of it with bit 3 + j */
+static const uint8_t owns_node = 1;
+static const uint8_t owns_edge = 8;
+
+/* Part of the traversal, the pairs between the children of a node, a
+ * child with itself or two children, a child being slot k of a node */
+struct CollisionTask {
+  enum Type { SELF_NODE, SELF_CHILD, PAIR } type;
+  int node_a, k_a;
+  int node_b, k_b;
+};
+
+class SelfCollider {
+ public:
+  /* pairs of a task, corner of the node and item of the face for node
+   * face pairs and the corners opposite of the edges for edge edge
+   * pairs */
+  struct Output {
+    vector<pair<int, int>> vertex_face;
+    vector<pair<int, int>> edge_edge;
+  };
+
+  SelfCollider(const BVH &bvh,
+               const vector<Vec3> &x,
+               const vector<int> &corners,
+               const vector<AABB> &item_bounds,
+               const vector<uint8_t> &owned,
+               Scalar thickness)
+      : bvh(bvh),
+        x(x),
+        corners(corners),
+        item_bounds(item_bounds),
+        owned(owned),
+        thickness(thickness),
+        /* the node bounds are rounded outwards already, the thickness
+         * must not be rounded down */
+        node_thickness(nextafterf(float(thickness), numeric_limits<float>::infinity()))
+  {
+  }
+
+  /* Replaces every expandable task with its subtasks, returns false
+   * when there were none */
+  bool expand(vector<CollisionTask> &tasks) const;
+  void run(const CollisionTask &task, Output &r_output) const;
+
+ private:
+  const BVH &bvh;
+  const vector<Vec3> &x;
+  const vector<int> &corners;
+  const vector<AABB> &item_bounds;
+  const vector<uint8_t> &owned;
+  const Scalar thickness;
+  const float node_thickness;
+
+  bool overlap(int node_a, int k_a, int node_b, int k_b) const
+  {
+    const BVHNode &a = bvh.nodes[node_a], &b = bvh.nodes[node_b];
+    for (int axis = 0; axis < 3; axis++) {
+      if (a.lower[axis][k_a] - node_thickness > b.upper[axis][k_b] ||
+          b.lower[axis][k_b] - node_thickness > a.upper[axis][k_a]) {
+        return false;
+      }
+    }
+    return true;
+  }
+
+  bool overlap(const AABB &a, const AABB &b) const
+  {
+    for (int axis = 0; axis < 3; axis++) {
+      if (a.lower[axis] - thickness > b.upper[axis] || b.lower[axis] - thickness > a.upper[axis]) {
+        return false;
+      }
+    }
+    return true;
+  }
+
+  /* Which side of a pair of children to open, -1 when both are leaves */
+  int openSide(int node_a, int k_a, int node_b, int k_b) const
+  {
+    const BVHNode &a = bvh.nodes[node_a], &b = bvh.nodes[node_b];
+    if (a.isLeaf(k_a) && b.isLeaf(k_b)) {
+      return -1;
+    }
+    if (a.isLeaf(k_a)) {
+      return 1;
+    }
+    if (b.isLeaf(k_b)) {
+      return 0;
+    }
+    return a.bounds(k_a).surfaceArea() >= b.bounds(k_b).surfaceArea() ? 0 : 1;
+  }
+
+  void selfNode(int node, Output &r_output) const;
+  void selfChild(int node, int k, Output &r_output) const;
+  void pair(int node_a, int k_a, int node_b, int k_b, Output &r_output) const;
+  void items(int a, int b, Output &r_output) const;
+  void nodesAgainstItem(int a, int b, Output &r_output) const;
+};
+
+void SelfCollider::selfNode(int node, Output &r_output) const
+{
+  const BVHNode &n = bvh.nodes[node];
+  for (int k = 0; k < 4 && n.count[k] >= 0; k++) {
+    selfChild(node, k, r_output);
+    for (int l = k + 1; l < 4 && n.count[l] >= 0; l++) {
+      pair(node, k, node, l, r_output);
+    }
+  }
+}
+
+void SelfCollider::selfChild(int node, int k, Output &r_output) const
+{
+  const BVHNode &n = bvh.nodes[node];
+  if (n.isInner(k)) {
+    selfNode(n.child[k], r_output);
+    return;
+  }
+  for (int i = n.child[k]; i < n.child[k] + n.count[k]; i++) {
+    for (int j = i + 1; j < n.child[k] + n.count[k]; j++) {
+      items(i, j, r_output);
+    }
+  }
+}
+
+void SelfCollider::pair(int node_a, int k_a, int node_b, int k_b, Output &r_output) const
+{
+  if (!overlap(node_a, k_a, node_b, k_b)) {
+    return;
+  }
+  const int side = openSide(node_a, k_a, node_b, k_b);
+  if (side < 0) {
+    const BVHNode &a = bvh.nodes[node_a], &b = bvh.nodes[node_b];
+    for (int i = a.child[k_a]; i < a.child[k_a] + a.count[k_a]; i++) {
+      for (int j = b.child[k_b]; j < b.child[k_b] + b.count[k_b]; j++) {
+        items(i, j, r_output);
+      }
+    }
+    return;
+  }
+  if (side == 1) {
+    swap(node_a, node_b);
+    swap(k_a, k_b);
+  }
+  const int child = bvh.nodes[node_a].child[k_a];
+  const BVHNode &c = bvh.nodes[child];
+  for (int k = 0; k < 4 && c.count[k] >= 0; k++) {
+    pair(child, k, node_b, k_b, r_output);
+  }
+}
+
+/* The nodes owned by item a against the face of item b */
+void SelfCollider::nodesAgainstItem(int a, int b, Output &r_output) const
+{
+  const AABB &box = item_bounds[b];
+  for (int j = 0; j < 3; j++) {
+    if (!(owned[a] & (owns_node << j))) {
+      continue;
+    }
+    const int slot = corners[3 * a + j];
+    if (slot == corners[3 * b] || slot == corners[3 * b + 1] || slot == corners[3 * b + 2]) {
+      continue;
+    }
+    if (overlap(AABB(x[slot], x[slot]), box)) {
+      r_output.vertex_face.emplace_back(3 * a + j, b);
+    }
+  }
+}
+
+void SelfCollider::items(int a, int b, Output &r_output) const
+{
+  if (!overlap(item_bounds[a], item_bounds[b])) {
+    return;
+  }
+  nodesAgainstItem(a, b, r_output);
+  nodesAgainstItem(b, a, r_output);
+
+  for (int i = 0; i < 3; i++) {
+    if (!(owned[a] & (owns_edge << i))) {
+      continue;
+    }
+    const int a0 = corners[3 * a + NEXT(i)], a1 = corners[3 * a + PREV(i)];
+    AABB edge_a(x[a0], x[a0]);
+    edge_a.extend(x[a1]);
+    for (int j = 0; j < 3; j++) {
+      if (!(owned[b] & (owns_edge << j))) {
+        continue;
+      }
+      const int b0 = corners[3 * b + NEXT(j)], b1 = corners[3 * b + PREV(j)];
+      if (a0 == b0 || a0 == b1 || a1 == b0 || a1 == b1) {
+        continue;
+      }
+      AABB edge_b(x[b0], x[b0]);
+      edge_b.extend(x[b1]);
+      if (overlap(edge_a, edge_b)) {
+        r_output.edge_edge.emplace_back(3 * a + i, 3 * b + j);
+      }
+    }
+  }
+}
+
+bool SelfCollider::expand(vector<CollisionTask> &tasks) const
+{
+  vector<CollisionTask> expanded;
+  bool changed = false;
+  for (const CollisionTask &task : tasks) {
+    const BVHNode &a = bvh.nodes[task.node_a];
+    switch (task.type) {
+      case CollisionTask::SELF_NODE:
+        for (int k = 0; k < 4 && a.count[k] >= 0; k++) {
+          expanded.push_back({CollisionTask::SELF_CHILD, task.node_a, k, 0, 0});
+          for (int l = k + 1; l < 4 && a.count[l] >= 0; l++) {
+            expanded.push_back({CollisionTask::PAIR, task.node_a, k, task.node_a, l});
+          }
+        }
+        changed = true;
+        break;
+      case CollisionTask::SELF_CHILD:
+        if (a.isInner(task.k_a)) {
+          expanded.push_back({CollisionTask::SELF_NODE, a.child[task.k_a], 0, 0, 0});
+          changed = true;
+        }
+        else {
+          expanded.push_back(task);
+        }
+        break;
+      case CollisionTask::PAIR: {
+        if (!overlap(task.node_a, task.k_a, task.node_b, task.k_b)) {
+          changed = true;
+          break;
+        }
+        const int side = openSide(task.node_a, task.k_a, task.node_b, task.k_b);
+        if (side < 0) {
+          expanded.push_back(task);
+          break;
+        }
+        const int open_node = side == 0 ? task.node_a : task.node_b;
+        const int open_k = side == 0 ? task.k_a : task.k_b;
+        const int child = bvh.nodes[open_node].child[open_k];
+        const BVHNode &c = bvh.nodes[child];
+        for (int k = 0; k < 4 && c.count[k] >= 0; k++) {
+          if (side == 0) {
+            expanded.push_back({CollisionTask::PAIR, child, k, task.node_b, task.k_b});
+          }
+          else {
+            expanded.push_back({CollisionTask::PAIR, task.node_a, task.k_a, child, k});
+          }
+        }
+        changed = true;
+        break;
+      }
+    }
+  }
+  tasks.swap(expanded);
+  return changed;
+}
+
+void SelfCollider::run(const CollisionTask &task, Output &r_output) const
+{
+  switch (task.type) {
+    case CollisionTask::SELF_NODE:
+      selfNode(task.node_a, r_output);
+      break;
+    case CollisionTask::SELF_CHILD:
+      selfChild(task.node_a, task.k_a, r_output);
+      break;
+    case CollisionTask::PAIR:
+      pair(task.node_a, task.k_a, task.node_b, task.k_b, r_output);
+      break;
+  }
+}
+
+void Mesh::selfCollisionCandidates(Scalar thickness, SelfCollisionCandidates &r_candidates)
+{
+  r_candidates.clear();
+  if (faces.empty()) {
+    return;
+  }
+  updateFaceBVH();
+  const FaceBVH &d = face_bvh;
+  ThreadPool &pool = ThreadPool::global();
+  const int num_items = faces.size();
+
+  /* a node is owned by its first corner, an edge by its first face */
+  vector<AABB> item_bounds(num_items);
+  vector<uint8_t> owned(num_items);
+  pool.parallelForRange(0, num_items, 4096, [&](int begin, int end) {
+    for (int k = begin; k < end; k++) {
+      AABB box;
+      uint8_t bits = 0;
+      for (int j = 0; j < 3; j++) {
+        const int corner = 3 * k + j;
+        const int slot = d.corners[corner];
+        box.extend(d.x[slot]);
+        if (d.slot_corners[d.slot_offs[slot]] == corner) {
+          bits |= owns_node << j;
+        }
+        const int e = d.corner_edges[corner];
+        const int item0 = d.edge_items[2 * e], item1 = d.edge_items[2 * e + 1];
+        const int owner = item0 < 0 ? item1 : item1 < 0 ? item0 : min(item0, item1);
+        if (owner == k) {
+          bits |= owns_edge << j;
+        }
+      }
+      item_bounds[k] = box;
+      owned[k] = bits;
+    }
+  });
+
+  const SelfCollider collider(d.bvh, d.x, d.corners, item_bounds, owned, thickness);
+  vector<CollisionTask> tasks = {{CollisionTask::SELF_NODE, 0, 0, 0, 0}};
+  while (tasks.size() < size_t(min_num_tasks) && collider.expand(tasks)) {
+  }
+
+  const int num_tasks = tasks.size();
+  vector<SelfCollider::Output> outputs(num_tasks);
+  pool.parallelFor(num_tasks, [&](int i) { collider.run(tasks[i], outputs[i]); });
+
+  /* the outputs are appended in task order, converting the corners and
+   * items to elements in parallel */
+  vector<size_t> vf_offs(num_tasks + 1, 0), ee_offs(num_tasks + 1, 0);
+  for (int i = 0; i < num_tasks; i++) {
+    vf_offs[i + 1] = vf_offs[i] + outputs[i].vertex_face.size();
+    ee_offs[i + 1] = ee_offs[i] + outputs[i].edge_edge.size();
+  }
+  r_candidates.vertex_face.resize(vf_offs[num_tasks]);
+  r_candidates.edge_edge.resize(ee_offs[num_tasks]);
+  auto corner_face = [&](int corner) { return faces[d.bvh.items[corner / 3]]; };
+  pool.parallelFor(num_tasks, [&](int i) {
+    size_t out = vf_offs[i];
+    for (const auto &[corner, item] : outputs[i].vertex_face) {
+      r_candidates.vertex_face[out++] = {corner_face(corner)->v[corner % 3]->node,
+                                         faces[d.bvh.items[item]]};
+    }
+    out = ee_offs[i];
+    for (const auto &[corner_a, corner_b] : outputs[i].edge_edge) {
+      r_candidates.edge_edge[out++] = {edges[d.corner_edges[corner_a]],
+                                       edges[d.corner_edges[corner_b]]};
+    }
+    outputs[i] = SelfCollider::Output();
+  });
+}
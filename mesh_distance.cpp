@@ -0,0 +1,345 @@
+/* Signed distance queries against the surface of a Mesh.
+ *
+ * The closest point is found on a BVH over the faces in world space,
+ * descending into the nearest children first and skipping every child
+ * whose box is farther away than the closest face found so far. The
+ * sign comes from the angle weighted pseudo normal of the feature the
+ * closest point lies on (Baerentzen and Aanaes 2005, "Signed Distance
+ * Computation Using the Angle Weighted Pseudonormal"): the normal of a
+ * face, the sum of the normals of the faces of an edge, or the normals
+ * of the faces around a node weighted by their angles at the node. This
+ * gives the correct sign on closed manifold meshes also when the
+ * closest point is on an edge or a node. */
+
+#include "mesh.hpp"
+#include "thread_pool.hpp"
+
+#include <algorithm>
+#include <atomic>
+
+/* Feature of a triangle a closest point lies on */
+enum TriangleFeature {
+  TRI_FEATURE_VERT = 0, /* + corner */
+  TRI_FEATURE_EDGE = 3, /* + corner opposite of the edge */
+  TRI_FEATURE_FACE = 6,
+};
+
+/* Closest point to p on the triangle a, b, c by the regions of
+ * Ericson, "Real-Time Collision Detection" 5.1.5 */
+static Vec3 closestPointOnTriangle(
+    const Vec3 &p, const Vec3 &a, const Vec3 &b, const Vec3 &c, int &r_feature)
+{
+  const Vec3 ab = b - a, ac = c - a, ap = p - a;
+  const Scalar d1 = ab.dot(ap), d2 = ac.dot(ap);
+  if (d1 <= 0 && d2 <= 0) {
+    r_feature = TRI_FEATURE_VERT + 0;
+    return a;
+  }
+  const Vec3 bp = p - b;
+  const Scalar d3 = ab.dot(bp), d4 = ac.dot(bp);
+  if (d3 >= 0 && d4 <= d3) {
+    r_feature = TRI_FEATURE_VERT + 1;
+    return b;
+  }
+  const Scalar vc = d1 * d4 - d3 * d2;
+  if (vc <= 0 && d1 >= 0 && d3 <= 0) {
+    r_feature = TRI_FEATURE_EDGE + 2;
+    return a + ab * (d1 / (d1 - d3));
+  }
+  const Vec3 cp = p - c;
+  const Scalar d5 = ab.dot(cp), d6 = ac.dot(cp);
+  if (d6 >= 0 && d5 <= d6) {
+    r_feature = TRI_FEATURE_VERT + 2;
+    return c;
+  }
+  const Scalar vb = d5 * d2 - d1 * d6;
+  if (vb <= 0 && d2 >= 0 && d6 <= 0) {
+    r_feature = TRI_FEATURE_EDGE + 1;
+    return a + ac * (d2 / (d2 - d6));
+  }
+  const Scalar va = d3 * d6 - d5 * d4;
+  if (va <= 0 && d4 - d3 >= 0 && d5 - d6 >= 0) {
+    r_feature = TRI_FEATURE_EDGE + 0;
+    return b + (c - b) * ((d4 - d3) / ((d4 - d3) + (d5 - d6)));
+  }
+  const Scalar sum = va + vb + vc;
+  if (sum <= 0) {
+    /* degenerate triangle that none of the regions above caught */
+    r_feature = TRI_FEATURE_VERT + 0;
+    return a;
+  }
+  r_feature = TRI_FEATURE_FACE;
+  return a + ab * (vb / sum) + ac * (vc / sum);
+}
+
+/* Squared distances from p to the 4 child boxes of node, infinite for
+ * unused children */
+static void childDistances(const BVHNode &node, const float p[3], float r_dist2[4])
+{
+  for (int k = 0; k < 4; k++) {
+    r_dist2[k] = 0.0f;
+  }
+  for (int axis = 0; axis < 3; axis++) {
+    for (int k = 0; k < 4; k++) {
+      const float d = max(max(node.lower[axis][k] - p[axis], p[axis] - node.upper[axis][k]),
+                          0.0f);
+      r_dist2[k] += d * d;
+    }
+  }
+}
+
+void Mesh::updateFaceBVH()
+{
+  FaceBVH &d = face_bvh;
+  if (d.valid && !d.moved && d.pos == pos && d.scale == scale) {
+    return;
+  }
+  d.moved = false;
+  d.pos = pos;
+  d.scale = scale;
+
+  ThreadPool &pool = ThreadPool::global();
+  const int num_faces = faces.size();
+  const int num_slots = node_buffers.x.size();
+  d.x.resize(num_slots);
+  pool.parallelForRange(0, num_slots, 4096, [&](int begin, int end) {
+    for (int i = begin; i < end; i++) {
+      d.x[i] = node_buffers.x[i].cwiseProduct(scale) + pos;
+    }
+  });
+
+  /* while the BVH is valid the topology is the same as at its build,
+   * the tree is refit unless that makes it too much worse. Nodes made
+   * with newNode() but not added yet change the slots without
+   * invalidating it. */
+  if (d.slot_offs.size() != num_slots + 1 || d.edge_items.size() != 2 * edges.size() ||
+      d.corners.size() != 3 * num_faces) {
+    d.valid = false;
+  }
+  bool rebuild = !d.valid;
+  if (d.valid) {
+    vector<AABB> item_bounds(num_faces);
+    pool.parallelForRange(0, num_faces, 4096, [&](int begin, int end) {
+      for (int k = begin; k < end; k++) {
+        AABB box;
+        for (int j = 0; j < 3; j++) {
+          box.extend(d.x[d.corners[3 * k + j]]);
+        }
+        item_bounds[k] = box;
+      }
+    });
+    d.bvh.refit(item_bounds);
+    d.cost = d.bvh.sahCost();
+    rebuild = d.cost > bvh_rebuild_threshold * d.build_cost;
+  }
+  if (rebuild) {
+    vector<AABB> bounds(num_faces);
+    pool.parallelForRange(0, num_faces, 4096, [&](int begin, int end) {
+      for (int f = begin; f < end; f++) {
+        AABB box;
+        for (int j = 0; j < 3; j++) {
+          box.extend(d.x[faces[f]->v[j]->node->slot]);
+        }
+        bounds[f] = box;
+      }
+    });
+    d.bvh.build(bounds);
+    d.build_cost = d.bvh.sahCost();
+    d.cost = d.build_cost;
+
+    /* topology in the order of the items */
+    vector<int> face_items(num_faces);
+    d.corners.resize(3 * num_faces);
+    d.corner_edges.resize(3 * num_faces);
+    pool.parallelForRange(0, num_faces, 4096, [&](int begin, int end) {
+      for (int k = begin; k < end; k++) {
+        const Face *face = faces[d.bvh.items[k]];
+        face_items[d.bvh.items[k]] = k;
+        for (int j = 0; j < 3; j++) {
+          d.corners[3 * k + j] = face->v[j]->node->slot;
+          d.corner_edges[3 * k + j] = face->adj_e[j]->index;
+        }
+      }
+    });
+    /* the faces of an edge are its adj_f, so that edges on uv seams get
+     * the faces of both sides */
+    d.edge_items.resize(2 * edges.size());
+    pool.parallelForRange(0, edges.size(), 4096, [&](int begin, int end) {
+      for (int e = begin; e < end; e++) {
+        for (int side = 0; side < 2; side++) {
+          const Face *face = edges[e]->adj_f[side];
+          d.edge_items[2 * e + side] = face ? face_items[face->index] : -1;
+        }
+      }
+    });
+    slotCorners(d.corners, num_slots, d.slot_offs, d.slot_corners);
+  }
+  d.valid = true;
+
+  /* pseudo normals, the corners contribute their face normal weighted by
+   * their angle to the normal of their node */
+  vector<Vec3> corner_normals(3 * num_faces);
+  d.face_normals.resize(num_faces);
+  pool.parallelForRange(0, num_faces, 4096, [&](int begin, int end) {
+    for (int k = begin; k < end; k++) {
+      const Vec3 *x[3] = {
+          &d.x[d.corners[3 * k]], &d.x[d.corners[3 * k + 1]], &d.x[d.corners[3 * k + 2]]};
+      const Vec3 n = (*x[1] - *x[0]).cross(*x[2] - *x[0]);
+      const Scalar length = n.norm();
+      const Vec3 face_normal = length > 0 ? Vec3(n / length) : Vec3::Zero();
+      d.face_normals[k] = face_normal;
+      for (int j = 0; j < 3; j++) {
+        const Vec3 e0 = *x[NEXT(j)] - *x[j], e1 = *x[PREV(j)] - *x[j];
+        corner_normals[3 * k + j] = atan2(e0.cross(e1).norm(), e0.dot(e1)) * face_normal;
+      }
+    }
+  });
+  d.node_normals.resize(num_slots);
+  pool.parallelForRange(0, num_slots, 4096, [&](int begin, int end) {
+    for (int slot = begin; slot < end; slot++) {
+      Vec3 sum = Vec3::Zero();
+      for (int i = d.slot_offs[slot]; i < d.slot_offs[slot + 1]; i++) {
+        sum += corner_normals[d.slot_corners[i]];
+      }
+      d.node_normals[slot] = sum;
+    }
+  });
+  d.edge_normals.resize(edges.size());
+  pool.parallelForRange(0, edges.size(), 4096, [&](int begin, int end) {
+    for (int e = begin; e < end; e++) {
+      Vec3 sum = Vec3::Zero();
+      for (int side = 0; side < 2; side++) {
+        const int item = d.edge_items[2 * e + side];
+        if (item >= 0) {
+          sum += d.face_normals[item];
+        }
+      }
+      d.edge_normals[e] = sum;
+    }
+  });
+}
+
+/* The BVH must be up to date */
+Scalar Mesh::signedDistance(const Vec3 &p, Vec3 &r_normal) const
+{
+  const FaceBVH &d = face_bvh;
+  const float pf[3] = {(float)p[0], (float)p[1], (float)p[2]};
+  Scalar best_dist2 = numeric_limits<Scalar>::infinity();
+  Vec3 best_point = p;
+  int best_item = -1, best_feature = TRI_FEATURE_FACE;
+
+  auto testLeaf = [&](int first, int count) {
+    for (int k = first; k < first + count; k++) {
+      const int *corners = &d.corners[3 * k];
+      int feature;
+      const Vec3 point = closestPointOnTriangle(
+          p, d.x[corners[0]], d.x[corners[1]], d.x[corners[2]], feature);
+      const Scalar dist2 = (point - p).squaredNorm();
+      if (dist2 < best_dist2) {
+        best_dist2 = dist2;
+        best_point = point;
+        best_item = k;
+        best_feature = feature;
+      }
+    }
+  };
+
+  struct Entry {
+    int node;
+    float dist2;
+  };
+  BVHStack<Entry> stack(d.bvh);
+  stack.push({0, 0.0f});
+  while (!stack.empty()) {
+    const Entry entry = stack.pop();
+    if (entry.dist2 >= best_dist2) {
+      continue;
+    }
+    const BVHNode &node = d.bvh.nodes[entry.node];
+    float dist2[4];
+    childDistances(node, pf, dist2);
+    int order[4], num_children = 0;
+    for (int k = 0; k < 4; k++) {
+      if (node.count[k] >= 0 && dist2[k] < best_dist2) {
+        /* insertion sort by distance */
+        int i = num_children++;
+        for (; i > 0 && dist2[order[i - 1]] > dist2[k]; i--) {
+          order[i] = order[i - 1];
+        }
+        order[i] = k;
+      }
+    }
+    /* leaves first to shrink best_dist2, then the inner children with
+     * the nearest on top of the stack */
+    for (int i = 0; i < num_children; i++) {
+      const int k = order[i];
+      if (node.isLeaf(k) && dist2[k] < best_dist2) {
+        testLeaf(node.child[k], node.count[k]);
+      }
+    }
+    for (int i = num_children - 1; i >= 0; i--) {
+      const int k = order[i];
+      if (node.isInner(k) && dist2[k] < best_dist2) {
+        stack.push({node.child[k], dist2[k]});
+      }
+    }
+  }
+
+  Vec3 pseudo_normal;
+  if (best_feature == TRI_FEATURE_FACE) {
+    pseudo_normal = d.face_normals[best_item];
+  }
+  else if (best_feature >= TRI_FEATURE_EDGE) {
+    const int corner = 3 * best_item + best_feature - TRI_FEATURE_EDGE;
+    pseudo_normal = d.edge_normals[d.corner_edges[corner]];
+  }
+  else {
+    pseudo_normal = d.node_normals[d.corners[3 * best_item + best_feature]];
+  }
+  const Vec3 dir = p - best_point;
+  const Scalar sign = dir.dot(pseudo_normal) < 0 ? -1 : 1;
+  const Scalar distance = sqrt(best_dist2);
+  if (distance > 0) {
+    r_normal = dir * (sign / distance);
+  }
+  else {
+    const Scalar length = pseudo_normal.norm();
+    r_normal = length > 0 ? Vec3(pseudo_normal / length) : d.face_normals[best_item];
+  }
+  return sign * distance;
+}
+
+bool Mesh::intersectionTest(const Vec3 &p, Vec3 &r_normal, double &r_distance)
+{
+  if (faces.empty()) {
+    r_distance = numeric_limits<double>::infinity();
+    return false;
+  }
+  updateFaceBVH();
+  r_distance = signedDistance(p, r_normal);
+  return r_distance < 0;
+}
+
+int Mesh::intersectionTest(const vector<Vec3> &points,
+                           vector<Vec3> &r_normals,
+                           vector<double> &r_distances)
+{
+  const int num_points = points.size();
+  r_normals.resize(num_points);
+  r_distances.resize(num_points);
+  if (faces.empty()) {
+    r_distances.assign(num_points, numeric_limits<double>::infinity());
+    return 0;
+  }
+  updateFaceBVH();
+  atomic<int> num_inside(0);
+  ThreadPool::global().parallelForRange(0, num_points, 256, [&](int begin, int end) {
+    int count = 0;
+    for (int i = begin; i < end; i++) {
+      r_distances[i] = signedDistance(points[i], r_normals[i]);
+      count += r_distances[i] < 0;
+    }
+    num_inside += count;
+  });
+  return num_inside;
+}
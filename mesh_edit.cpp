@@ -0,0 +1,156 @@
+#include "mesh_edit.hpp"
+
+#include <algorithm>
+#include <cassert>
+
+/* Removes all of removed from elems in a single pass and marks them
+ * with index -1. The holes below the new size are filled with the
+ * remaining elements from the end, like removeByIndex() does one at a
+ * time, so every element moves at most once. */
+template<typename T> static void removeAll(const vector<T *> &removed, vector<T *> &elems)
+{
+  vector<int> holes;
+  holes.reserve(removed.size());
+  for (T *elem : removed) {
+    assert(elem->index >= 0 && elem->index < elems.size() && elems[elem->index] == elem);
+    holes.push_back(elem->index);
+    elem->index = -1;
+  }
+  sort(holes.begin(), holes.end());
+  const int new_size = elems.size() - holes.size();
+  int end = elems.size();
+  for (int hole : holes) {
+    if (hole >= new_size) {
+      break;
+    }
+    while (elems[end - 1]->index == -1) {
+      end--;
+    }
+    elems[hole] = elems[end - 1];
+    elems[hole]->index = hole;
+    end--;
+  }
+  elems.resize(new_size);
+}
+
+/* Drops the elements removed by removeAll() from adj */
+template<typename T> static void filterRemoved(vector<T *> &adj)
+{
+  adj.erase(remove_if(adj.begin(), adj.end(), [](const T *elem) { return elem->index == -1; }),
+            adj.end());
+}
+
+void MeshEdit::applyRemovals()
+{
+  removeAll(removed_faces, mesh.faces);
+  for (Face *face : removed_faces) {
+    for (int i = 0; i < 3; i++) {
+      Vert *v0 = face->v[NEXT(i)];
+      filterRemoved(v0->adj_f);
+      Edge *e = face->adj_e[i];
+      for (int side = 0; side < 2; side++) {
+        if (e->adj_f[side] == face) {
+          e->adj_f[side] = NULL;
+        }
+      }
+    }
+  }
+  for (Face *face : removed_faces) {
+    for (int i = 0; i < 3; i++) {
+      if (face->v[i]->node->index != -1) {
+        mesh.markDirty(face->v[i]->node);
+      }
+    }
+  }
+
+  removeAll(removed_edges, mesh.edges);
+  for (Edge *edge : removed_edges) {
+    assert(!edge->adj_f[0] && !edge->adj_f[1]); /* ensure that adjacent
+                                                   faces don't exist */
+    filterRemoved(edge->n[0]->adj_e);
+    filterRemoved(edge->n[1]->adj_e);
+  }
+  for (Edge *edge : removed_edges) {
+    mesh.edge_map.erase(edge->n[0], edge->n[1], edge);
+    /* there can be more than one edge between the same nodes */
+    Edge *other = ::getEdge(edge->n[0], edge->n[1]);
+    if (other) {
+      mesh.edge_map.insert(other->n[0], other->n[1], other);
+    }
+  }
+
+  removeAll(removed_verts, mesh.verts);
+  for (Vert *vert : removed_verts) {
+    assert(vert->adj_f.empty()); /* ensure that adjacent faces don't
+                                    exist */
+  }
+
+  removeAll(removed_nodes, mesh.nodes);
+  for (Node *node : removed_nodes) {
+    assert(node->adj_e.empty()); /* ensure that adjacent edges don't
+                                    exist */
+    if (node->slot < mesh.dirty_index.size()) {
+      mesh.dirty_index[node->slot] = -1;
+    }
+  }
+  if (!removed_nodes.empty()) {
+    filterRemoved(mesh.dirty_nodes);
+    for (int i = 0; i < mesh.dirty_nodes.size(); i++) {
+      mesh.dirty_index[mesh.dirty_nodes[i]->slot] = i;
+    }
+  }
+}
+
+void MeshEdit::applyAdditions()
+{
+  /* Mesh::add(Vert *) clears vert->node, the nodes set it again */
+  for (Vert *vert : added_verts) {
+    mesh.add(vert);
+  }
+  for (Node *node : added_nodes) {
+    mesh.add(node);
+  }
+  for (Edge *edge : added_edges) {
+    mesh.add(edge);
+  }
+  for (Face *face : added_faces) {
+    mesh.add(face);
+    for (int i = 0; i < 3; i++) {
+      mesh.markDirty(face->v[i]->node);
+    }
+  }
+}
+
+void MeshEdit::commit()
+{
+  applyRemovals();
+  applyAdditions();
+  mesh.corner_tables.valid = false;
+  mesh.face_bvh.valid = false;
+
+  for (Face *face : removed_faces) {
+    mesh.deleteElement(face);
+  }
+  for (Edge *edge : removed_edges) {
+    mesh.deleteElement(edge);
+  }
+  for (Vert *vert : removed_verts) {
+    mesh.deleteElement(vert);
+  }
+  for (Node *node : removed_nodes) {
+    mesh.deleteElement(node);
+  }
+  clear();
+}
+
+void MeshEdit::clear()
+{
+  added_verts.clear();
+  added_nodes.clear();
+  added_edges.clear();
+  added_faces.clear();
+  removed_verts.clear();
+  removed_nodes.clear();
+  removed_edges.clear();
+  removed_faces.clear();
+}
@@ -0,0 +1,93 @@
+#ifndef MESH_EDIT_HPP
+#define MESH_EDIT_HPP
+
+#include <vector>
+
+#include "mesh.hpp"
+
+using namespace std;
+
+/* Batch of element additions and removals applied to a Mesh at once.
+ *
+ * Edits are only recorded until commit(), which first applies all
+ * removals and then all additions. Removals are done in one pass per
+ * element type: the arrays of the mesh are compacted by moving
+ * elements from their ends into the holes, and only the adjacency of
+ * the elements next to removed ones is filtered. Additions behave like
+ * Mesh::add(), so faces create their missing edges. After the commit
+ * the removed elements are given back to the mesh for reuse, and the
+ * nodes around changed faces are marked dirty for
+ * Mesh::refreshNormals().
+ *
+ * Usage matches Mesh::add() and Mesh::remove(): elements to add are
+ * created with Mesh::newVert() etc., and removed edges must not have
+ * faces left once the removed faces are gone. An element can't be both
+ * added and removed in the same edit. */
+class MeshEdit {
+ private:
+  Mesh &mesh;
+  vector<Vert *> added_verts;
+  vector<Node *> added_nodes;
+  vector<Edge *> added_edges;
+  vector<Face *> added_faces;
+  vector<Vert *> removed_verts;
+  vector<Node *> removed_nodes;
+  vector<Edge *> removed_edges;
+  vector<Face *> removed_faces;
+
+  void applyRemovals();
+  void applyAdditions();
+
+ public:
+  explicit MeshEdit(Mesh &mesh) : mesh(mesh)
+  {
+  }
+
+  void add(Vert *vert)
+  {
+    added_verts.push_back(vert);
+  }
+  void add(Node *node)
+  {
+    added_nodes.push_back(node);
+  }
+  void add(Edge *edge)
+  {
+    added_edges.push_back(edge);
+  }
+  void add(Face *face)
+  {
+    added_faces.push_back(face);
+  }
+
+  void remove(Vert *vert)
+  {
+    removed_verts.push_back(vert);
+  }
+  void remove(Node *node)
+  {
+    removed_nodes.push_back(node);
+  }
+  void remove(Edge *edge)
+  {
+    removed_edges.push_back(edge);
+  }
+  void remove(Face *face)
+  {
+    removed_faces.push_back(face);
+  }
+
+  bool empty() const
+  {
+    return added_verts.empty() && added_nodes.empty() && added_edges.empty() &&
+           added_faces.empty() && removed_verts.empty() && removed_nodes.empty() &&
+           removed_edges.empty() && removed_faces.empty();
+  }
+
+  /* Applies the recorded edits and clears them */
+  void commit();
+  /* Drops the recorded edits */
+  void clear();
+};
+
+#endif
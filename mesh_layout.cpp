@@ -0,0 +1,206 @@
+/* Reordering of the elements of a Mesh for cache locality.
+ *
+ * Faces are ordered with Tipsify (Sander, Nehab and Barczak 2007,
+ * "Fast Triangle Reordering for Vertex Locality and Reduced Overdraw"),
+ * which runs in time linear in the size of the mesh: it fans around a
+ * node, emitting all of its remaining faces, and moves on to the node of
+ * those faces that is most likely still in the cache. Nodes, verts and
+ * edges are then ordered by their first use in the new face order, so
+ * traversals over faces walk the other arrays almost sequentially. */
+
+#include "mesh.hpp"
+
+/* Faces adjacent to each node as offset and item arrays */
+static void nodeFaces(const vector<int> &tri_nodes,
+                      int num_nodes,
+                      vector<int> &r_offs,
+                      vector<int> &r_faces)
+{
+  r_offs.assign(num_nodes + 1, 0);
+  for (int c = 0; c < tri_nodes.size(); c++) {
+    r_offs[tri_nodes[c] + 1]++;
+  }
+  for (int i = 0; i < num_nodes; i++) {
+    r_offs[i + 1] += r_offs[i];
+  }
+  r_faces.resize(tri_nodes.size());
+  vector<int> fill(r_offs.begin(), r_offs.end() - 1);
+  for (int c = 0; c < tri_nodes.size(); c++) {
+    r_faces[fill[tri_nodes[c]]++] = c / 3;
+  }
+}
+
+/* Tipsify face order of the triangles with the corner nodes tri_nodes */
+static vector<int> tipsify(const vector<int> &tri_nodes, int num_nodes, int cache_size)
+{
+  const int num_faces = tri_nodes.size() / 3;
+  vector<int> offs, adj_faces;
+  nodeFaces(tri_nodes, num_nodes, offs, adj_faces);
+
+  vector<int> live(num_nodes); /* faces of the node not emitted yet */
+  for (int i = 0; i < num_nodes; i++) {
+    live[i] = offs[i + 1] - offs[i];
+  }
+  vector<int> cache_time(num_nodes, 0);
+  vector<bool> emitted(num_faces, false);
+  vector<int> dead_end; /* recently used nodes, to continue from */
+  vector<int> candidates;
+  vector<int> order;
+  order.reserve(num_faces);
+  int time = cache_size + 1;
+  int cursor = 0; /* nodes below it have no live faces */
+
+  int fan = num_nodes > 0 ? 0 : -1;
+  while (fan >= 0) {
+    candidates.clear();
+    for (int k = offs[fan]; k < offs[fan + 1]; k++) {
+      const int f = adj_faces[k];
+      if (emitted[f]) {
+        continue;
+      }
+      emitted[f] = true;
+      order.push_back(f);
+      for (int j = 0; j < 3; j++) {
+        const int v = tri_nodes[3 * f + j];
+        dead_end.push_back(v);
+        candidates.push_back(v);
+        live[v]--;
+        if (time - cache_time[v] > cache_size) {
+          cache_time[v] = time++;
+        }
+      }
+    }
+
+    /* the candidate that stays in the cache while its remaining faces
+     * are emitted and entered it earliest */
+    fan = -1;
+    int best_priority = -1;
+    for (int v : candidates) {
+      if (live[v] <= 0) {
+        continue;
+      }
+      int priority = 0;
+      if (time - cache_time[v] + 2 * live[v] <= cache_size) {
+        priority = time - cache_time[v];
+      }
+      if (priority > best_priority) {
+        best_priority = priority;
+        fan = v;
+      }
+    }
+    if (fan != -1) {
+      continue;
+    }
+    /* dead end, continue with a recently used node or the next node
+     * in index order that still has faces */
+    while (!dead_end.empty() && fan == -1) {
+      const int v = dead_end.back();
+      dead_end.pop_back();
+      if (live[v] > 0) {
+        fan = v;
+      }
+    }
+    while (fan == -1 && cursor < num_nodes) {
+      if (live[cursor] > 0) {
+        fan = cursor;
+      }
+      cursor++;
+    }
+  }
+  return order;
+}
+
+/* Moves elems[order[i]] to position i, followed by the elements not in
+ * order in their current order, and renumbers the indices.
+ * order must not contain duplicates. */
+template<typename T> static void reorderElements(const vector<int> &order, vector<T *> &elems)
+{
+  vector<T *> reordered;
+  reordered.reserve(elems.size());
+  vector<bool> placed(elems.size(), false);
+  for (int i : order) {
+    reordered.push_back(elems[i]);
+    placed[i] = true;
+  }
+  for (int i = 0; i < elems.size(); i++) {
+    if (!placed[i]) {
+      reordered.push_back(elems[i]);
+    }
+  }
+  elems.swap(reordered);
+  for (int i = 0; i < elems.size(); i++) {
+    elems[i]->index = i;
+  }
+}
+
+/* Appends index to r_order the first time it is seen */
+static inline void firstUse(int index, vector<bool> &seen, vector<int> &r_order)
+{
+  if (!seen[index]) {
+    seen[index] = true;
+    r_order.push_back(index);
+  }
+}
+
+void Mesh::optimizeLayout(int cache_size)
+{
+  const int num_faces = faces.size();
+  vector<int> tri_nodes(3 * num_faces);
+  for (int f = 0; f < num_faces; f++) {
+    for (int j = 0; j < 3; j++) {
+      tri_nodes[3 * f + j] = faces[f]->v[j]->node->index;
+    }
+  }
+  reorderElements(tipsify(tri_nodes, nodes.size(), cache_size), faces);
+
+  vector<int> node_order, vert_order, edge_order;
+  vector<bool> node_seen(nodes.size(), false), vert_seen(verts.size(), false),
+      edge_seen(edges.size(), false);
+  for (const Face *face : faces) {
+    for (int j = 0; j < 3; j++) {
+      firstUse(face->v[j]->node->index, node_seen, node_order);
+      firstUse(face->v[j]->index, vert_seen, vert_order);
+      firstUse(face->adj_e[PREV(j)]->index, edge_seen, edge_order);
+    }
+  }
+  reorderElements(node_order, nodes);
+  reorderElements(vert_order, verts);
+  reorderElements(edge_order, edges);
+
+  /* node buffers in node order, within the slots the nodes already
+   * have so that nodes outside the mesh keep theirs */
+  vector<int> slots(nodes.size());
+  for (int i = 0; i < nodes.size(); i++) {
+    slots[i] = nodes[i]->slot;
+  }
+  node_buffers.reorder(slots);
+  for (int i = 0; i < nodes.size(); i++) {
+    nodes[i]->slot = slots[i];
+  }
+  dirty_index.assign(node_buffers.x.size(), -1);
+  for (int i = 0; i < dirty_nodes.size(); i++) {
+    dirty_index[dirty_nodes[i]->slot] = i;
+  }
+  corner_tables.valid = false;
+  face_bvh.valid = false;
+}
+
+double Mesh::averageCacheMissRatio(int cache_size) const
+{
+  if (faces.empty()) {
+    return 0.0;
+  }
+  /* FIFO cache, a node is cached if it entered less than cache_size
+   * misses ago */
+  vector<long> entered(nodes.size(), -1);
+  long misses = 0;
+  for (const Face *face : faces) {
+    for (int j = 0; j < 3; j++) {
+      const int v = face->v[j]->node->index;
+      if (entered[v] < 0 || misses - entered[v] >= cache_size) {
+        entered[v] = misses++;
+      }
+    }
+  }
+  return (double)misses / faces.size();
+}
@@ -0,0 +1,428 @@
+/* Ray casts against the faces of a Mesh.
+ *
+ * Single rays walk the BVH of intersectionTest() front to back, testing
+ * the 4 child boxes of a node at once, and intersect the faces in full
+ * precision with the Moeller-Trumbore test. Streams of rays are split
+ * into packets of Mesh::ray_packet_size rays that walk the BVH
+ * together: a child is entered when any ray of the packet hits its box
+ * and every box and face test is done for all rays of the packet at
+ * once on SIMD vectors with a lane per ray, in single precision.
+ * Coherent rays visit mostly the same nodes, so a packet costs little
+ * more than its most expensive ray. */
+
+#include "mesh.hpp"
+#include "thread_pool.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstring>
+
+/* The float bounds and the float transformation of the rays can be off
+ * by a few ulp, box exits are pushed out by this factor so that rays
+ * grazing a box aren't missed */
+static const float box_exit_scale = 1.0f + 4.0f * numeric_limits<float>::epsilon();
+
+/* 1 / d, with zero components replaced by a tiny value of their sign
+ * so that the slab test doesn't compute 0 * inf */
+static float safeInverse(Scalar d)
+{
+  const float tiny = 1e-30f;
+  const float f = d;
+  return 1.0f / (fabsf(f) < tiny ? copysignf(tiny, f) : f);
+}
+
+/* Bounds of the 4 children of a node on one axis */
+typedef float ChildFloat __attribute__((vector_size(16)));
+
+/* Entry distances of a ray into the 4 children of node, infinite for
+ * the children it misses or only enters beyond t_max */
+static void childEntries(const BVHNode &node,
+                         const float origin[3],
+                         const float inv_dir[3],
+                         float t_max,
+                         float r_t[4])
+{
+  ChildFloat t_near = {}, t_far = ChildFloat{} + t_max;
+  for (int axis = 0; axis < 3; axis++) {
+    ChildFloat lower, upper;
+    memcpy(&lower, node.lower[axis], sizeof(lower));
+    memcpy(&upper, node.upper[axis], sizeof(upper));
+    const ChildFloat t0 = (lower - origin[axis]) * inv_dir[axis];
+    const ChildFloat t1 = (upper - origin[axis]) * inv_dir[axis];
+    const ChildFloat t_enter = t0 < t1 ? t0 : t1, t_exit = t0 < t1 ? t1 : t0;
+    t_near = t_near < t_enter ? t_enter : t_near;
+    t_far = t_far < t_exit ? t_far : t_exit;
+  }
+  const ChildFloat inf = ChildFloat{} + numeric_limits<float>::infinity();
+  const ChildFloat t = t_near <= t_far * box_exit_scale ? t_near : inf;
+  for (int k = 0; k < 4; k++) {
+    r_t[k] = node.count[k] >= 0 ? t[k] : numeric_limits<float>::infinity();
+  }
+}
+
+/* Children of node with a finite entry distance, nearest first */
+static int sortChildren(const float t[4], int r_order[4])
+{
+  int num_children = 0;
+  for (int k = 0; k < 4; k++) {
+    if (t[k] != numeric_limits<float>::infinity()) {
+      int i = num_children++;
+      for (; i > 0 && t[r_order[i - 1]] > t[k]; i--) {
+        r_order[i] = r_order[i - 1];
+      }
+      r_order[i] = k;
+    }
+  }
+  return num_children;
+}
+
+bool Mesh::rayCast(const Vec3 &origin, const Vec3 &direction, RayHit &r_hit, Scalar max_distance)
+{
+  r_hit = RayHit();
+  if (faces.empty()) {
+    return false;
+  }
+  updateFaceBVH();
+  const FaceBVH &d = face_bvh;
+  const float origin_f[3] = {(float)origin[0], (float)origin[1], (float)origin[2]};
+  const float inv_dir[3] = {
+      safeInverse(direction[0]), safeInverse(direction[1]), safeInverse(direction[2])};
+  Scalar best_t = max_distance;
+  int best_item = -1;
+
+  auto testLeaf = [&](int first, int count) {
+    for (int k = first; k < first + count; k++) {
+      const Vec3 &a = d.x[d.corners[3 * k]];
+      const Vec3 e1 = d.x[d.corners[3 * k + 1]] - a;
+      const Vec3 e2 = d.x[d.corners[3 * k + 2]] - a;
+      const Vec3 p = direction.cross(e2);
+      const Scalar det = e1.dot(p);
+      if (det == 0) {
+        continue;
+      }
+      const Scalar inv_det = 1 / det;
+      const Vec3 s = origin - a;
+      const Scalar u = s.dot(p) * inv_det;
+      if (u < 0 || u > 1) {
+        continue;
+      }
+      const Vec3 q = s.cross(e1);
+      const Scalar v = direction.dot(q) * inv_det;
+      if (v < 0 || u + v > 1) {
+        continue;
+      }
+      const Scalar t = e2.dot(q) * inv_det;
+      if (t >= 0 && t <= best_t) {
+        best_t = t;
+        best_item = k;
+        r_hit.u = u;
+        r_hit.v = v;
+      }
+    }
+  };
+
+  struct Entry {
+    int node;
+    float t;
+  };
+  BVHStack<Entry> stack(d.bvh);
+  stack.push({0, 0.0f});
+  while (!stack.empty()) {
+    const Entry entry = stack.pop();
+    if (entry.t > best_t) {
+      continue;
+    }
+    const BVHNode &node = d.bvh.nodes[entry.node];
+    float t[4];
+    int order[4];
+    childEntries(node, origin_f, inv_dir, best_t, t);
+    const int num_children = sortChildren(t, order);
+    /* leaves first to shorten the ray, then the inner children with the
+     * nearest on top of the stack */
+    for (int i = 0; i < num_children; i++) {
+      const int k = order[i];
+      if (node.isLeaf(k) && t[k] <= best_t) {
+        testLeaf(node.child[k], node.count[k]);
+      }
+    }
+    for (int i = num_children - 1; i >= 0; i--) {
+      const int k = order[i];
+      if (node.isInner(k)) {
+        stack.push({node.child[k], t[k]});
+      }
+    }
+  }
+
+  if (best_item < 0) {
+    return false;
+  }
+  r_hit.face = faces[d.bvh.items[best_item]];
+  r_hit.distance = best_t;
+  return true;
+}
+
+/* Lanes of a packet. GCC vector types compile to SSE or AVX
+ * instructions, whichever the target has, and to scalar code on other
+ * architectures. Mesh::ray_packet_size is the width of the widest
+ * register, GCC splits a wider vector into several registers and loses
+ * more than it gains. */
+typedef float PacketFloat __attribute__((vector_size(4 * Mesh::ray_packet_size)));
+typedef int32_t PacketInt __attribute__((vector_size(4 * Mesh::ray_packet_size)));
+
+/* Rays of a packet, one lane per ray. t is the current end of every
+ * ray, negative for lanes without a ray and for rays that are done. */
+struct RayPacket {
+  static const int size = Mesh::ray_packet_size;
+  PacketFloat origin[3];
+  PacketFloat dir[3];
+  PacketFloat inv_dir[3];
+  PacketFloat t;
+  PacketFloat hit_t;
+  PacketFloat u;
+  PacketFloat v;
+  PacketInt item;
+};
+
+/* Whether any ray of packet enters the box of child k of node, and the
+ * nearest entry in r_t */
+static bool packetHitsChild(const RayPacket &packet, const BVHNode &node, int k, float &r_t)
+{
+  PacketFloat t_near = {}, t_far = packet.t;
+  for (int axis = 0; axis < 3; axis++) {
+    const PacketFloat t0 = (node.lower[axis][k] - packet.origin[axis]) * packet.inv_dir[axis];
+    const PacketFloat t1 = (node.upper[axis][k] - packet.origin[axis]) * packet.inv_dir[axis];
+    const PacketFloat t_min = t0 < t1 ? t0 : t1, t_max = t0 < t1 ? t1 : t0;
+    t_near = t_near < t_min ? t_min : t_near;
+    t_far = t_far < t_max ? t_far : t_max;
+  }
+  const PacketFloat inf = PacketFloat{} + numeric_limits<float>::infinity();
+  const PacketFloat entry = t_near <= t_far * box_exit_scale ? t_near : inf;
+  r_t = entry[0];
+  for (int l = 1; l < RayPacket::size; l++) {
+    r_t = min(r_t, entry[l]);
+  }
+  return r_t != numeric_limits<float>::infinity();
+}
+
+/* Moeller-Trumbore test of all rays of packet against the triangle a,
+ * a + e1, a + e2, the item of the face is stored for the lanes it is
+ * the closest hit of */
+static void packetTestTriangle(RayPacket &packet,
+                               const float a[3],
+                               const float e1[3],
+                               const float e2[3],
+                               int item,
+                               bool any_hit)
+{
+  const PacketFloat *dir = packet.dir;
+  const PacketFloat px = dir[1] * e2[2] - dir[2] * e2[1];
+  const PacketFloat py = dir[2] * e2[0] - dir[0] * e2[2];
+  const PacketFloat pz = dir[0] * e2[1] - dir[1] * e2[0];
+  const PacketFloat inv_det = 1.0f / (e1[0] * px + e1[1] * py + e1[2] * pz);
+  const PacketFloat sx = packet.origin[0] - a[0];
+  const PacketFloat sy = packet.origin[1] - a[1];
+  const PacketFloat sz = packet.origin[2] - a[2];
+  const PacketFloat u = (sx * px + sy * py + sz * pz) * inv_det;
+  const PacketFloat qx = sy * e1[2] - sz * e1[1];
+  const PacketFloat qy = sz * e1[0] - sx * e1[2];
+  const PacketFloat qz = sx * e1[1] - sy * e1[0];
+  const PacketFloat v = (dir[0] * qx + dir[1] * qy + dir[2] * qz) * inv_det;
+  const PacketFloat t = (e2[0] * qx + e2[1] * qy + e2[2] * qz) * inv_det;
+  /* a zero determinant gives nan or inf which fail these tests */
+  const PacketInt hit = (u >= 0.0f) & (v >= 0.0f) & (u + v <= 1.0f) & (t >= 0.0f) &
+                        (t <= packet.t);
+  packet.hit_t = hit ? t : packet.hit_t;
+  packet.u = hit ? u : packet.u;
+  packet.v = hit ? v : packet.v;
+  packet.item = hit ? PacketInt{} + item : packet.item;
+  packet.t = hit ? (any_hit ? PacketFloat{} - 1.0f : t) : packet.t;
+}
+
+void Mesh::castRayPacket(const Vec3 *origins,
+                         const Vec3 *directions,
+                         int num_rays,
+                         Scalar max_distance,
+                         bool any_hit,
+                         RayHit *r_hits) const
+{
+  assert(num_rays <= ray_packet_size);
+  const FaceBVH &d = face_bvh;
+  RayPacket packet;
+  for (int l = 0; l < RayPacket::size; l++) {
+    /* unused lanes repeat the first ray, they start out done */
+    const int i = l < num_rays ? l : 0;
+    for (int axis = 0; axis < 3; axis++) {
+      packet.origin[axis][l] = origins[i][axis];
+      packet.dir[axis][l] = directions[i][axis];
+      packet.inv_dir[axis][l] = safeInverse(directions[i][axis]);
+    }
+    packet.t[l] = l < num_rays ? (float)max_distance : -1.0f;
+  }
+  packet.hit_t = PacketFloat{};
+  packet.u = PacketFloat{};
+  packet.v = PacketFloat{};
+  packet.item = PacketInt{} - 1;
+  auto packetEnd = [&]() {
+    float t = packet.t[0];
+    for (int l = 1; l < RayPacket::size; l++) {
+      t = max(t, packet.t[l]);
+    }
+    return t;
+  };
+
+  struct Entry {
+    int node;
+    float t;
+  };
+  BVHStack<Entry> stack(d.bvh);
+  stack.push({0, 0.0f});
+  float end = packetEnd();
+  while (!stack.empty() && end >= 0.0f) {
+    const Entry entry = stack.pop();
+    if (entry.t > end) {
+      continue;
+    }
+    const BVHNode &node = d.bvh.nodes[entry.node];
+    float t[4];
+    for (int k = 0; k < 4; k++) {
+      if (node.count[k] < 0 || !packetHitsChild(packet, node, k, t[k])) {
+        t[k] = numeric_limits<float>::infinity();
+      }
+    }
+    int order[4];
+    const int num_children = sortChildren(t, order);
+    for (int i = 0; i < num_children; i++) {
+      const int k = order[i];
+      if (!node.isLeaf(k)) {
+        continue;
+      }
+      for (int item = node.child[k]; item < node.child[k] + node.count[k]; item++) {
+        const Vec3 &a = d.x[d.corners[3 * item]];
+        const Vec3 e1 = d.x[d.corners[3 * item + 1]] - a;
+        const Vec3 e2 = d.x[d.corners[3 * item + 2]] - a;
+        const float a_f[3] = {(float)a[0], (float)a[1], (float)a[2]};
+        const float e1_f[3] = {(float)e1[0], (float)e1[1], (float)e1[2]};
+        const float e2_f[3] = {(float)e2[0], (float)e2[1], (float)e2[2]};
+        packetTestTriangle(packet, a_f, e1_f, e2_f, item, any_hit);
+      }
+      end = packetEnd();
+    }
+    for (int i = num_children - 1; i >= 0; i--) {
+      const int k = order[i];
+      if (node.isInner(k) && t[k] <= end) {
+        stack.push({node.child[k], t[k]});
+      }
+    }
+  }
+
+  for (int l = 0; l < num_rays; l++) {
+    RayHit &hit = r_hits[l];
+    hit = RayHit();
+    if (packet.item[l] >= 0) {
+      hit.face = faces[d.bvh.items[packet.item[l]]];
+      hit.u = packet.u[l];
+      hit.v = packet.v[l];
+      hit.distance = packet.hit_t[l];
+    }
+  }
+}
+
+int Mesh::rayCast(const vector<Vec3> &origins,
+                  const vector<Vec3> &directions,
+                  vector<RayHit> &r_hits,
+                  Scalar max_distance)
+{
+  assert(origins.size() == directions.size());
+  const int num_rays = origins.size();
+  r_hits.assign(num_rays, RayHit());
+  if (faces.empty() || num_rays == 0) {
+    return 0;
+  }
+  updateFaceBVH();
+  const int num_packets = (num_rays + ray_packet_size - 1) / ray_packet_size;
+  atomic<int> num_hits(0);
+  ThreadPool::global().parallelForRange(0, num_packets, 16, [&](int begin, int end) {
+    int count = 0;
+    for (int i = begin; i < end; i++) {
+      const int first = i * ray_packet_size;
+      const int size = min(ray_packet_size, num_rays - first);
+      castRayPacket(
+          &origins[first], &directions[first], size, max_distance, false, &r_hits[first]);
+      for (int l = 0; l < size; l++) {
+        count += r_hits[first + l].face != NULL;
+      }
+    }
+    num_hits += count;
+  });
+  return num_hits;
+}
+
+void Mesh::bakeAmbientOcclusion(vector<Scalar> &r_occlusion, int num_samples, Scalar max_distance)
+{
+  const int num_nodes = nodes.size();
+  r_occlusion.assign(num_nodes, 0);
+  if (faces.empty() || num_samples <= 0) {
+    return;
+  }
+  updateFaceBVH();
+  const FaceBVH &d = face_bvh;
+  const AABB bounds = d.bvh.bounds();
+  /* rays start a little above the surface so that they don't hit the
+   * faces around their node */
+  const Scalar offset = 1e-4 * (bounds.upper - bounds.lower).norm();
+
+  /* cosine weighted directions on a Fibonacci spiral in the frame of the
+   * normal, sorted by their angle around it so that the rays of a
+   * packet point into the same part of the hemisphere */
+  struct Sample {
+    Scalar phi, r;
+  };
+  vector<Sample> samples(num_samples);
+  const Scalar golden_angle = M_PI * (3 - sqrt(5.0));
+  for (int s = 0; s < num_samples; s++) {
+    samples[s].r = sqrt((s + 0.5) / num_samples);
+    samples[s].phi = fmod(s * golden_angle, 2 * M_PI);
+  }
+  sort(samples.begin(), samples.end(), [](const Sample &a, const Sample &b) {
+    return a.phi < b.phi;
+  });
+
+  ThreadPool::global().parallelForRange(0, num_nodes, 64, [&](int begin, int end) {
+    vector<Vec3> origins(num_samples), directions(num_samples);
+    vector<RayHit> hits(num_samples);
+    for (int i = begin; i < end; i++) {
+      const int slot = nodes[i]->slot;
+      const Scalar length = d.node_normals[slot].norm();
+      if (length == 0) {
+        continue;
+      }
+      /* orthonormal frame around the normal (Duff et al. 2017) */
+      const Vec3 n = d.node_normals[slot] / length;
+      const Scalar sign = n[2] >= 0 ? 1 : -1;
+      const Scalar a = -1 / (sign + n[2]);
+      const Scalar b = n[0] * n[1] * a;
+      const Vec3 tangent(1 + sign * n[0] * n[0] * a, sign * b, -sign * n[0]);
+      const Vec3 bitangent(b, sign + n[1] * n[1] * a, -n[1]);
+      /* the spiral is turned by a different angle at every node to
+       * avoid banding between neighbours */
+      const Scalar turn = 2 * M_PI * fmod(i * 0.6180339887498949, 1.0);
+      const Vec3 origin = d.x[slot] + n * offset;
+      for (int s = 0; s < num_samples; s++) {
+        const Scalar phi = samples[s].phi + turn, r = samples[s].r;
+        origins[s] = origin;
+        directions[s] = tangent * (r * cos(phi)) + bitangent * (r * sin(phi)) +
+                        n * sqrt(max(Scalar(0), 1 - r * r));
+      }
+      int num_hits = 0;
+      for (int first = 0; first < num_samples; first += ray_packet_size) {
+        const int size = min(ray_packet_size, num_samples - first);
+        castRayPacket(&origins[first], &directions[first], size, max_distance, true, &hits[first]);
+        for (int l = 0; l < size; l++) {
+          num_hits += hits[first + l].face != NULL;
+        }
+      }
+      r_occlusion[i] = Scalar(num_hits) / num_samples;
+    }
+  });
+}
@@ -4,6 +4,7 @@
 #include <vector>
 #include <limits>
 #include <algorithm>
+#include <cassert>
 #include <cstdlib>
 
 #include "math.hpp"
@@ -123,6 +124,20 @@ template<typename T> inline void exclude(const T &x, vector<T> &xs)
   }
 }
 
+/* Removes x from xs in O(1) using x->index, its position in xs, and
+ * fixes the index of the element moved into its place. x->index
+ * becomes -1. */
+template<typename T> inline void removeByIndex(T *x, vector<T *> &xs)
+{
+  int i = x->index;
+  assert(i >= 0 && i < xs.size() && xs[i] == x);
+  remove(i, xs);
+  if (i < xs.size()) {
+    xs[i]->index = i;
+  }
+  x->index = -1;
+}
+
 template<typename T> inline void replace(const T &v0, const T &v1, T vs[3])
 {
   int i = find(v0, vs);
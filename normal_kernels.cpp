@@ -0,0 +1,350 @@
+#include "normal_kernels.hpp"
+
+#include <cmath>
+
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+#  define NORMAL_KERNELS_X86
+#  include <immintrin.h>
+/* The loops over corners, axes and lanes in the SIMD kernels must be
+ * unrolled for their vector arrays to stay in registers, which -O2
+ * doesn't do by itself and without which they are slower than the
+ * scalar kernel */
+#  define NORMAL_KERNEL_UNROLL _Pragma("GCC unroll 8")
+#endif
+
+/* The SIMD kernels do the same operations in the same order as the
+ * scalar kernel. Each has a double and a float version, only the one
+ * matching Scalar is built. */
+
+template<typename T> static inline void faceNormal(const T *x, const int *corners, T *r_n)
+{
+  const T *a = x + 3 * corners[0], *b = x + 3 * corners[1], *c = x + 3 * corners[2];
+  T e1[3] = {b[0] - a[0], b[1] - a[1], b[2] - a[2]};
+  T e2[3] = {c[0] - a[0], c[1] - a[1], c[2] - a[2]};
+  T n[3] = {e1[1] * e2[2] - e1[2] * e2[1],
+            e1[2] * e2[0] - e1[0] * e2[2],
+            e1[0] * e2[1] - e1[1] * e2[0]};
+  T len2 = n[0] * n[0] + n[1] * n[1] + n[2] * n[2];
+  if (len2 > 0) {
+    T len = std::sqrt(len2);
+    n[0] /= len;
+    n[1] /= len;
+    n[2] /= len;
+  }
+  r_n[0] = n[0];
+  r_n[1] = n[1];
+  r_n[2] = n[2];
+}
+
+static void faceNormalsScalar(const Scalar *x, const int *corners, int num_tris, Scalar *r_normals)
+{
+  for (int t = 0; t < num_tris; t++) {
+    faceNormal(x, corners + 3 * t, r_normals + 3 * t);
+  }
+}
+
+#ifdef NORMAL_KERNELS_X86
+
+#  ifndef MESH_USE_FLOAT
+
+__attribute__((target("sse2"))) static void faceNormalsSSE2(const double *x,
+                                                           const int *corners,
+                                                           int num_tris,
+                                                           double *r_normals)
+{
+  int t = 0;
+  for (; t + 2 <= num_tris; t += 2) {
+    const int *c = corners + 3 * t;
+    __m128d p[3][3]; /* [corner][axis] */
+    NORMAL_KERNEL_UNROLL
+    for (int k = 0; k < 3; k++) {
+      const double *x0 = x + 3 * c[k], *x1 = x + 3 * c[3 + k];
+      NORMAL_KERNEL_UNROLL
+      for (int axis = 0; axis < 3; axis++) {
+        p[k][axis] = _mm_setr_pd(x0[axis], x1[axis]);
+      }
+    }
+    __m128d e1[3], e2[3];
+    NORMAL_KERNEL_UNROLL
+    for (int axis = 0; axis < 3; axis++) {
+      e1[axis] = _mm_sub_pd(p[1][axis], p[0][axis]);
+      e2[axis] = _mm_sub_pd(p[2][axis], p[0][axis]);
+    }
+    __m128d n[3] = {
+        _mm_sub_pd(_mm_mul_pd(e1[1], e2[2]), _mm_mul_pd(e1[2], e2[1])),
+        _mm_sub_pd(_mm_mul_pd(e1[2], e2[0]), _mm_mul_pd(e1[0], e2[2])),
+        _mm_sub_pd(_mm_mul_pd(e1[0], e2[1]), _mm_mul_pd(e1[1], e2[0])),
+    };
+    __m128d len2 = _mm_add_pd(_mm_add_pd(_mm_mul_pd(n[0], n[0]), _mm_mul_pd(n[1], n[1])),
+                              _mm_mul_pd(n[2], n[2]));
+    __m128d len = _mm_sqrt_pd(len2);
+    __m128d nonzero = _mm_cmpgt_pd(len2, _mm_setzero_pd());
+    NORMAL_KERNEL_UNROLL
+    for (int axis = 0; axis < 3; axis++) {
+      __m128d unit = _mm_div_pd(n[axis], len);
+      n[axis] = _mm_or_pd(_mm_and_pd(nonzero, unit), _mm_andnot_pd(nonzero, n[axis]));
+    }
+    /* the 6 normal components of the 2 triangles are contiguous */
+    double *out = r_normals + 3 * t;
+    _mm_storeu_pd(out, _mm_unpacklo_pd(n[0], n[1]));         /* x0 y0 */
+    _mm_storeu_pd(out + 2, _mm_shuffle_pd(n[2], n[0], 0x2)); /* z0 x1 */
+    _mm_storeu_pd(out + 4, _mm_unpackhi_pd(n[1], n[2]));     /* y1 z1 */
+  }
+  for (; t < num_tris; t++) {
+    faceNormal(x, corners + 3 * t, r_normals + 3 * t);
+  }
+}
+
+__attribute__((target("avx2"))) static void faceNormalsAVX2(const double *x,
+                                                           const int *corners,
+                                                           int num_tris,
+                                                           double *r_normals)
+{
+  /* positions are 3 doubles, masked loads and stores don't touch the
+   * fourth one */
+  const __m256i xyz_mask = _mm256_setr_epi64x(-1, -1, -1, 0);
+  int t = 0;
+  for (; t + 4 <= num_tris; t += 4) {
+    const int *c = corners + 3 * t;
+    __m256d p[3][3]; /* [corner][axis] */
+    NORMAL_KERNEL_UNROLL
+    for (int k = 0; k < 3; k++) {
+      /* load x, y, z of the corner of the 4 triangles and transpose */
+      __m256d r0 = _mm256_maskload_pd(x + 3 * c[k], xyz_mask);
+      __m256d r1 = _mm256_maskload_pd(x + 3 * c[3 + k], xyz_mask);
+      __m256d r2 = _mm256_maskload_pd(x + 3 * c[6 + k], xyz_mask);
+      __m256d r3 = _mm256_maskload_pd(x + 3 * c[9 + k], xyz_mask);
+      __m256d t0 = _mm256_unpacklo_pd(r0, r1); /* x0 x1 z0 z1 */
+      __m256d t1 = _mm256_unpackhi_pd(r0, r1); /* y0 y1 -- -- */
+      __m256d t2 = _mm256_unpacklo_pd(r2, r3); /* x2 x3 z2 z3 */
+      __m256d t3 = _mm256_unpackhi_pd(r2, r3); /* y2 y3 -- -- */
+      p[k][0] = _mm256_permute2f128_pd(t0, t2, 0x20);
+      p[k][1] = _mm256_permute2f128_pd(t1, t3, 0x20);
+      p[k][2] = _mm256_permute2f128_pd(t0, t2, 0x31);
+    }
+    __m256d e1[3], e2[3];
+    NORMAL_KERNEL_UNROLL
+    for (int axis = 0; axis < 3; axis++) {
+      e1[axis] = _mm256_sub_pd(p[1][axis], p[0][axis]);
+      e2[axis] = _mm256_sub_pd(p[2][axis], p[0][axis]);
+    }
+    __m256d n[3] = {
+        _mm256_sub_pd(_mm256_mul_pd(e1[1], e2[2]), _mm256_mul_pd(e1[2], e2[1])),
+        _mm256_sub_pd(_mm256_mul_pd(e1[2], e2[0]), _mm256_mul_pd(e1[0], e2[2])),
+        _mm256_sub_pd(_mm256_mul_pd(e1[0], e2[1]), _mm256_mul_pd(e1[1], e2[0])),
+    };
+    __m256d len2 = _mm256_add_pd(
+        _mm256_add_pd(_mm256_mul_pd(n[0], n[0]), _mm256_mul_pd(n[1], n[1])),
+        _mm256_mul_pd(n[2], n[2]));
+    __m256d len = _mm256_sqrt_pd(len2);
+    __m256d nonzero = _mm256_cmp_pd(len2, _mm256_setzero_pd(), _CMP_GT_OQ);
+    NORMAL_KERNEL_UNROLL
+    for (int axis = 0; axis < 3; axis++) {
+      n[axis] = _mm256_blendv_pd(n[axis], _mm256_div_pd(n[axis], len), nonzero);
+    }
+    /* transpose back to x, y, z per triangle */
+    __m256d t0 = _mm256_unpacklo_pd(n[0], n[1]); /* x0 y0 x2 y2 */
+    __m256d t1 = _mm256_unpackhi_pd(n[0], n[1]); /* x1 y1 x3 y3 */
+    __m256d t2 = _mm256_unpacklo_pd(n[2], n[2]); /* z0 z0 z2 z2 */
+    __m256d t3 = _mm256_unpackhi_pd(n[2], n[2]); /* z1 z1 z3 z3 */
+    double *out = r_normals + 3 * t;
+    _mm256_maskstore_pd(out, xyz_mask, _mm256_permute2f128_pd(t0, t2, 0x20));
+    _mm256_maskstore_pd(out + 3, xyz_mask, _mm256_permute2f128_pd(t1, t3, 0x20));
+    _mm256_maskstore_pd(out + 6, xyz_mask, _mm256_permute2f128_pd(t0, t2, 0x31));
+    _mm256_maskstore_pd(out + 9, xyz_mask, _mm256_permute2f128_pd(t1, t3, 0x31));
+  }
+  for (; t < num_tris; t++) {
+    faceNormal(x, corners + 3 * t, r_normals + 3 * t);
+  }
+}
+
+#  else
+
+__attribute__((target("sse2"))) static void faceNormalsSSE2(const float *x,
+                                                           const int *corners,
+                                                           int num_tris,
+                                                           float *r_normals)
+{
+  int t = 0;
+  for (; t + 4 <= num_tris; t += 4) {
+    const int *c = corners + 3 * t;
+    __m128 p[3][3]; /* [corner][axis] */
+    NORMAL_KERNEL_UNROLL
+    for (int k = 0; k < 3; k++) {
+      const float *x0 = x + 3 * c[k], *x1 = x + 3 * c[3 + k];
+      const float *x2 = x + 3 * c[6 + k], *x3 = x + 3 * c[9 + k];
+      NORMAL_KERNEL_UNROLL
+      for (int axis = 0; axis < 3; axis++) {
+        p[k][axis] = _mm_setr_ps(x0[axis], x1[axis], x2[axis], x3[axis]);
+      }
+    }
+    __m128 e1[3], e2[3];
+    NORMAL_KERNEL_UNROLL
+    for (int axis = 0; axis < 3; axis++) {
+      e1[axis] = _mm_sub_ps(p[1][axis], p[0][axis]);
+      e2[axis] = _mm_sub_ps(p[2][axis], p[0][axis]);
+    }
+    __m128 n[3] = {
+        _mm_sub_ps(_mm_mul_ps(e1[1], e2[2]), _mm_mul_ps(e1[2], e2[1])),
+        _mm_sub_ps(_mm_mul_ps(e1[2], e2[0]), _mm_mul_ps(e1[0], e2[2])),
+        _mm_sub_ps(_mm_mul_ps(e1[0], e2[1]), _mm_mul_ps(e1[1], e2[0])),
+    };
+    __m128 len2 = _mm_add_ps(_mm_add_ps(_mm_mul_ps(n[0], n[0]), _mm_mul_ps(n[1], n[1])),
+                             _mm_mul_ps(n[2], n[2]));
+    __m128 len = _mm_sqrt_ps(len2);
+    __m128 nonzero = _mm_cmpgt_ps(len2, _mm_setzero_ps());
+    float out[3][4];
+    NORMAL_KERNEL_UNROLL
+    for (int axis = 0; axis < 3; axis++) {
+      __m128 unit = _mm_div_ps(n[axis], len);
+      n[axis] = _mm_or_ps(_mm_and_ps(nonzero, unit), _mm_andnot_ps(nonzero, n[axis]));
+      _mm_storeu_ps(out[axis], n[axis]);
+    }
+    NORMAL_KERNEL_UNROLL
+    for (int l = 0; l < 4; l++) {
+      NORMAL_KERNEL_UNROLL
+      for (int axis = 0; axis < 3; axis++) {
+        r_normals[3 * (t + l) + axis] = out[axis][l];
+      }
+    }
+  }
+  for (; t < num_tris; t++) {
+    faceNormal(x, corners + 3 * t, r_normals + 3 * t);
+  }
+}
+
+__attribute__((target("avx2"))) static void faceNormalsAVX2(const float *x,
+                                                           const int *corners,
+                                                           int num_tris,
+                                                           float *r_normals)
+{
+  /* positions are 3 floats, masked loads don't touch the fourth one */
+  const __m128i xyz_mask = _mm_setr_epi32(-1, -1, -1, 0);
+  int t = 0;
+  for (; t + 8 <= num_tris; t += 8) {
+    const int *c = corners + 3 * t;
+    __m256 p[3][3]; /* [corner][axis] */
+    NORMAL_KERNEL_UNROLL
+    for (int k = 0; k < 3; k++) {
+      /* load x, y, z of the corner of the 8 triangles and transpose
+       * them 4 at a time */
+      __m128 r[8];
+      NORMAL_KERNEL_UNROLL
+      for (int l = 0; l < 8; l++) {
+        r[l] = _mm_maskload_ps(x + 3 * c[3 * l + k], xyz_mask);
+      }
+      _MM_TRANSPOSE4_PS(r[0], r[1], r[2], r[3]);
+      _MM_TRANSPOSE4_PS(r[4], r[5], r[6], r[7]);
+      NORMAL_KERNEL_UNROLL
+      for (int axis = 0; axis < 3; axis++) {
+        p[k][axis] = _mm256_set_m128(r[4 + axis], r[axis]);
+      }
+    }
+    __m256 e1[3], e2[3];
+    NORMAL_KERNEL_UNROLL
+    for (int axis = 0; axis < 3; axis++) {
+      e1[axis] = _mm256_sub_ps(p[1][axis], p[0][axis]);
+      e2[axis] = _mm256_sub_ps(p[2][axis], p[0][axis]);
+    }
+    __m256 n[3] = {
+        _mm256_sub_ps(_mm256_mul_ps(e1[1], e2[2]), _mm256_mul_ps(e1[2], e2[1])),
+        _mm256_sub_ps(_mm256_mul_ps(e1[2], e2[0]), _mm256_mul_ps(e1[0], e2[2])),
+        _mm256_sub_ps(_mm256_mul_ps(e1[0], e2[1]), _mm256_mul_ps(e1[1], e2[0])),
+    };
+    __m256 len2 = _mm256_add_ps(
+        _mm256_add_ps(_mm256_mul_ps(n[0], n[0]), _mm256_mul_ps(n[1], n[1])),
+        _mm256_mul_ps(n[2], n[2]));
+    __m256 len = _mm256_sqrt_ps(len2);
+    __m256 nonzero = _mm256_cmp_ps(len2, _mm256_setzero_ps(), _CMP_GT_OQ);
+    float out[3][8];
+    NORMAL_KERNEL_UNROLL
+    for (int axis = 0; axis < 3; axis++) {
+      n[axis] = _mm256_blendv_ps(n[axis], _mm256_div_ps(n[axis], len), nonzero);
+      _mm256_storeu_ps(out[axis], n[axis]);
+    }
+    NORMAL_KERNEL_UNROLL
+    for (int l = 0; l < 8; l++) {
+      NORMAL_KERNEL_UNROLL
+      for (int axis = 0; axis < 3; axis++) {
+        r_normals[3 * (t + l) + axis] = out[axis][l];
+      }
+    }
+  }
+  for (; t < num_tris; t++) {
+    faceNormal(x, corners + 3 * t, r_normals + 3 * t);
+  }
+}
+
+#  endif
+
+#endif
+
+bool normalKernelSupported(NormalKernel kernel)
+{
+  switch (kernel) {
+    case NORMAL_KERNEL_SCALAR:
+      return true;
+#ifdef NORMAL_KERNELS_X86
+    case NORMAL_KERNEL_SSE2:
+      return __builtin_cpu_supports("sse2");
+    case NORMAL_KERNEL_AVX2:
+      return __builtin_cpu_supports("avx2");
+#endif
+    default:
+      return false;
+  }
+}
+
+NormalKernel bestNormalKernel()
+{
+#ifdef __OPTIMIZE__
+  static const NormalKernel best = [] {
+    for (int kernel = NORMAL_KERNEL_NUM - 1; kernel > NORMAL_KERNEL_SCALAR; kernel--) {
+      if (normalKernelSupported((NormalKernel)kernel)) {
+        return (NormalKernel)kernel;
+      }
+    }
+    return NORMAL_KERNEL_SCALAR;
+  }();
+  return best;
+#else
+  /* intrinsics aren't inlined without optimization and every SIMD
+   * kernel is slower than the scalar one */
+  return NORMAL_KERNEL_SCALAR;
+#endif
+}
+
+const char *normalKernelName(NormalKernel kernel)
+{
+  switch (kernel) {
+    case NORMAL_KERNEL_SCALAR:
+      return "scalar";
+    case NORMAL_KERNEL_SSE2:
+      return "sse2";
+    case NORMAL_KERNEL_AVX2:
+      return "avx2";
+    default:
+      return "unknown";
+  }
+}
+
+void computeFaceNormals(
+    const Scalar *x, const int *corners, int num_tris, Scalar *r_normals, NormalKernel kernel)
+{
+  if (!normalKernelSupported(kernel)) {
+    kernel = NORMAL_KERNEL_SCALAR;
+  }
+  switch (kernel) {
+#ifdef NORMAL_KERNELS_X86
+    case NORMAL_KERNEL_SSE2:
+      faceNormalsSSE2(x, corners, num_tris, r_normals);
+      break;
+    case NORMAL_KERNEL_AVX2:
+      faceNormalsAVX2(x, corners, num_tris, r_normals);
+      break;
+#endif
+    default:
+      faceNormalsScalar(x, corners, num_tris, r_normals);
+      break;
+  }
+}
@@ -0,0 +1,33 @@
+#ifndef NORMAL_KERNELS_HPP
+#define NORMAL_KERNELS_HPP
+
+#include "math.hpp"
+
+/* Implementations of computeFaceNormals(), all of them give the same
+ * result bit for bit as long as the compiler doesn't contract
+ * multiplications and additions into FMAs (the makefile builds
+ * normal_kernels.cpp with -ffp-contract=off) */
+enum NormalKernel {
+  NORMAL_KERNEL_SCALAR,
+  NORMAL_KERNEL_SSE2, /* 2 triangles at a time, 4 with float Scalar */
+  NORMAL_KERNEL_AVX2, /* 4 triangles at a time, 8 with float Scalar */
+  NORMAL_KERNEL_NUM,
+};
+
+/* true if the kernel is built in and the CPU supports it */
+bool normalKernelSupported(NormalKernel kernel);
+/* Fastest kernel the CPU supports, detected once at runtime */
+NormalKernel bestNormalKernel();
+const char *normalKernelName(NormalKernel kernel);
+
+/* Unit normals of num_tris triangles, the normal of a degenerate
+ * triangle is 0.
+ * x holds 3 Scalars per position, corners 3 position indices per
+ * triangle and r_normals gets 3 Scalars per triangle. */
+void computeFaceNormals(const Scalar *x,
+                        const int *corners,
+                        int num_tris,
+                        Scalar *r_normals,
+                        NormalKernel kernel = bestNormalKernel());
+
+#endif
@@ -0,0 +1,687 @@
+#include "obj_io.hpp"
+#include "thread_pool.hpp"
+
+#include <algorithm>
+#include <charconv>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#include <limits>
+
+bool readFileToBuffer(const string &filename, vector<char> &buffer)
+{
+  FILE *fp = fopen(filename.c_str(), "rb");
+  if (!fp) {
+    return false;
+  }
+  fseek(fp, 0, SEEK_END);
+  long size = ftell(fp);
+  fseek(fp, 0, SEEK_SET);
+  if (size < 0) {
+    fclose(fp);
+    return false;
+  }
+  buffer.resize(size);
+  size_t read = size ? fread(buffer.data(), 1, size, fp) : 0;
+  fclose(fp);
+  return read == (size_t)size;
+}
+
+/* Tokenizer helpers, all of them work on [p, end) and never allocate */
+
+static inline bool isBlank(char c)
+{
+  return c == ' ' || c == '\t' || c == '\r';
+}
+
+static inline const char *skipBlanks(const char *p, const char *end)
+{
+  while (p < end && isBlank(*p)) {
+    p++;
+  }
+  return p;
+}
+
+static inline const char *skipLine(const char *p, const char *end)
+{
+  const char *nl = (const char *)memchr(p, '\n', end - p);
+  return nl ? nl + 1 : end;
+}
+
+static inline bool atLineEnd(const char *p, const char *end)
+{
+  return p >= end || *p == '\n' || *p == '#';
+}
+
+static inline bool parseScalar(const char *&p, const char *end, Scalar &r_value)
+{
+  p = skipBlanks(p, end);
+  /* from_chars() does not accept a leading '+' */
+  if (p < end && *p == '+') {
+    p++;
+  }
+  from_chars_result res = from_chars(p, end, r_value);
+  if (res.ec != errc()) {
+    return false;
+  }
+  p = res.ptr;
+  return true;
+}
+
+static inline bool parseInt(const char *&p, const char *end, int &r_value)
+{
+  if (p < end && *p == '+') {
+    p++;
+  }
+  from_chars_result res = from_chars(p, end, r_value);
+  if (res.ec != errc()) {
+    return false;
+  }
+  p = res.ptr;
+  return true;
+}
+
+/* OBJ indices are 1 based, negative indices are relative to the
+ * number of elements read so far, returns -1 if invalid */
+static inline int resolveIndex(int index, int count)
+{
+  if (index > 0 && index <= count) {
+    return index - 1;
+  }
+  if (index < 0 && -index <= count) {
+    return count + index;
+  }
+  return -1;
+}
+
+/* Parses a single `v`, `v/vt`, `v//vn` or `v/vt/vn` corner, base holds
+ * the number of records that precede data in the file */
+static inline bool parseCorner(
+    const char *&p, const char *end, const ObjCounts &base, ObjData &data, ObjCorner &r_corner)
+{
+  int index;
+  if (!parseInt(p, end, index)) {
+    return false;
+  }
+  r_corner.v = resolveIndex(index, base.positions + data.positions.size());
+  r_corner.vt = -1;
+  r_corner.vn = -1;
+  if (r_corner.v == -1) {
+    return false;
+  }
+  if (p < end && *p == '/') {
+    p++;
+    if (p < end && *p != '/') {
+      if (!parseInt(p, end, index)) {
+        return false;
+      }
+      r_corner.vt = resolveIndex(index, base.uvs + data.uvs.size());
+      if (r_corner.vt == -1) {
+        return false;
+      }
+    }
+    if (p < end && *p == '/') {
+      p++;
+      if (!parseInt(p, end, index)) {
+        return false;
+      }
+      r_corner.vn = resolveIndex(index, base.normals + data.normals.size());
+      if (r_corner.vn == -1) {
+        return false;
+      }
+    }
+  }
+  return p >= end || isBlank(*p) || *p == '\n' || *p == '#';
+}
+
+static bool parseLine(const char *&p, const char *end, const ObjCounts &base, ObjData &data)
+{
+  const char *keyword = p;
+  while (p < end && !isBlank(*p) && *p != '\n') {
+    p++;
+  }
+  int keyword_len = p - keyword;
+
+  if (keyword_len == 1 && keyword[0] == 'v') {
+    Vec3 x;
+    if (!parseScalar(p, end, x[0]) || !parseScalar(p, end, x[1]) ||
+        !parseScalar(p, end, x[2])) {
+      return false;
+    }
+    data.positions.push_back(x);
+  }
+  else if (keyword_len == 2 && keyword[0] == 'v' && keyword[1] == 't') {
+    Vec2 uv(0.0, 0.0);
+    if (!parseScalar(p, end, uv[0])) {
+      return false;
+    }
+    p = skipBlanks(p, end);
+    if (!atLineEnd(p, end) && !parseScalar(p, end, uv[1])) {
+      return false;
+    }
+    data.uvs.push_back(uv);
+  }
+  else if (keyword_len == 2 && keyword[0] == 'v' && keyword[1] == 'n') {
+    Vec3 n;
+    if (!parseScalar(p, end, n[0]) || !parseScalar(p, end, n[1]) ||
+        !parseScalar(p, end, n[2])) {
+      return false;
+    }
+    data.normals.push_back(n);
+  }
+  else if (keyword_len == 1 && keyword[0] == 'e') {
+    int n0, n1;
+    p = skipBlanks(p, end);
+    if (!parseInt(p, end, n0)) {
+      return false;
+    }
+    p = skipBlanks(p, end);
+    if (!parseInt(p, end, n1)) {
+      return false;
+    }
+    n0 = resolveIndex(n0, base.positions + data.positions.size());
+    n1 = resolveIndex(n1, base.positions + data.positions.size());
+    if (n0 == -1 || n1 == -1) {
+      return false;
+    }
+    data.edges.push_back(n0);
+    data.edges.push_back(n1);
+  }
+  else if (keyword_len == 1 && keyword[0] == 'f') {
+    int num_corners = 0;
+    while (true) {
+      p = skipBlanks(p, end);
+      if (atLineEnd(p, end)) {
+        break;
+      }
+      ObjCorner corner;
+      if (!parseCorner(p, end, base, data, corner)) {
+        data.corners.resize(data.face_offsets.back());
+        return false;
+      }
+      data.corners.push_back(corner);
+      num_corners++;
+    }
+    if (num_corners < 3) {
+      data.corners.resize(data.face_offsets.back());
+      return false;
+    }
+    data.face_offsets.push_back(data.corners.size());
+  }
+
+  return true;
+}
+
+/* Parses the records in [begin, end), file_begin is only used to
+ * report the line of malformed records */
+static bool parseObjChunk(const char *file_begin,
+                          const char *begin,
+                          const char *end,
+                          const ObjCounts &base,
+                          ObjData &data)
+{
+  const char *p = begin;
+  while (p < end) {
+    p = skipBlanks(p, end);
+    if (p < end && *p != '#' && *p != '\n') {
+      if (!parseLine(p, end, base, data)) {
+        int line = count(file_begin, p, '\n') + 1;
+        cout << "error: malformed OBJ record at line " << line << endl;
+        return false;
+      }
+    }
+    p = skipLine(p, end);
+  }
+  return true;
+}
+
+/* Counts the `v`, `vt` and `vn` records in [begin, end) without
+ * parsing them */
+static ObjCounts countObjRecords(const char *begin, const char *end)
+{
+  ObjCounts counts;
+  const char *p = begin;
+  while (p < end) {
+    p = skipBlanks(p, end);
+    if (end - p >= 2 && p[0] == 'v') {
+      if (isBlank(p[1])) {
+        counts.positions++;
+      }
+      else if (end - p >= 3 && isBlank(p[2])) {
+        if (p[1] == 't') {
+          counts.uvs++;
+        }
+        else if (p[1] == 'n') {
+          counts.normals++;
+        }
+      }
+    }
+    p = skipLine(p, end);
+  }
+  return counts;
+}
+
+/* Below this size the file is parsed on the calling thread */
+#define OBJ_MIN_CHUNK_SIZE (256 * 1024)
+
+bool parseObj(const char *begin, const char *end, ObjData &data)
+{
+  ThreadPool &pool = ThreadPool::global();
+  long len = end - begin;
+  int num_chunks = min<long>(pool.numThreads() * 4, len / OBJ_MIN_CHUNK_SIZE);
+  if (num_chunks <= 1) {
+    return parseObjChunk(begin, begin, end, ObjCounts(), data);
+  }
+
+  /* chunk boundaries are moved forward to the start of the next line */
+  vector<const char *> bounds(num_chunks + 1);
+  bounds[0] = begin;
+  bounds[num_chunks] = end;
+  for (int i = 1; i < num_chunks; i++) {
+    const char *p = max(begin + len * i / num_chunks, bounds[i - 1]);
+    bounds[i] = skipLine(p, end);
+  }
+
+  /* first pass finds the number of records that precede every chunk
+   * so that relative indices and index validation work per chunk */
+  vector<ObjCounts> bases(num_chunks + 1);
+  pool.parallelFor(num_chunks,
+                   [&](int i) { bases[i + 1] = countObjRecords(bounds[i], bounds[i + 1]); });
+  bases[0] = ObjCounts(data.positions.size(), data.uvs.size(), data.normals.size());
+  for (int i = 0; i < num_chunks; i++) {
+    bases[i + 1].positions += bases[i].positions;
+    bases[i + 1].uvs += bases[i].uvs;
+    bases[i + 1].normals += bases[i].normals;
+  }
+
+  vector<ObjData> chunks(num_chunks);
+  vector<char> chunk_ok(num_chunks);
+  pool.parallelFor(num_chunks, [&](int i) {
+    chunk_ok[i] = parseObjChunk(begin, bounds[i], bounds[i + 1], bases[i], chunks[i]);
+  });
+  for (int i = 0; i < num_chunks; i++) {
+    if (!chunk_ok[i]) {
+      return false;
+    }
+  }
+
+  /* merge, indices are already global so only the face offsets need
+   * to be shifted */
+  vector<int> edge_offsets(num_chunks + 1), corner_offsets(num_chunks + 1),
+      face_offsets(num_chunks + 1);
+  edge_offsets[0] = data.edges.size();
+  corner_offsets[0] = data.corners.size();
+  face_offsets[0] = data.numFaces();
+  for (int i = 0; i < num_chunks; i++) {
+    edge_offsets[i + 1] = edge_offsets[i] + chunks[i].edges.size();
+    corner_offsets[i + 1] = corner_offsets[i] + chunks[i].corners.size();
+    face_offsets[i + 1] = face_offsets[i] + chunks[i].numFaces();
+  }
+  data.positions.resize(bases[num_chunks].positions);
+  data.uvs.resize(bases[num_chunks].uvs);
+  data.normals.resize(bases[num_chunks].normals);
+  data.edges.resize(edge_offsets[num_chunks]);
+  data.corners.resize(corner_offsets[num_chunks]);
+  data.face_offsets.resize(face_offsets[num_chunks] + 1);
+  pool.parallelFor(num_chunks, [&](int i) {
+    const ObjData &chunk = chunks[i];
+    copy(chunk.positions.begin(),
+         chunk.positions.end(),
+         data.positions.begin() + bases[i].positions);
+    copy(chunk.uvs.begin(), chunk.uvs.end(), data.uvs.begin() + bases[i].uvs);
+    copy(chunk.normals.begin(), chunk.normals.end(), data.normals.begin() + bases[i].normals);
+    copy(chunk.edges.begin(), chunk.edges.end(), data.edges.begin() + edge_offsets[i]);
+    copy(chunk.corners.begin(), chunk.corners.end(), data.corners.begin() + corner_offsets[i]);
+    for (int f = 1; f <= chunk.numFaces(); f++) {
+      data.face_offsets[face_offsets[i] + f] = corner_offsets[i] + chunk.face_offsets[f];
+    }
+  });
+  return true;
+}
+
+bool readObj(const string &filename, ObjData &data)
+{
+  vector<char> buffer;
+  if (!readFileToBuffer(filename, buffer)) {
+    cout << "error: No file found at " << filename << endl;
+    return false;
+  }
+  return parseObj(buffer.data(), buffer.data() + buffer.size(), data);
+}
+
+/* Open addressing map from the integer coordinates of a grid cell to
+ * the first position in it, the other positions of the cell are
+ * chained through next */
+class WeldGrid {
+ private:
+  struct Cell {
+    int64_t c[3];
+    int head; /* -1 for an empty slot */
+  };
+
+  vector<Cell> cells;
+  vector<int> next;
+
+  static uint64_t hash(const int64_t c[3])
+  {
+    uint64_t h = (uint64_t)c[0] * 0x9e3779b97f4a7c15ull ^ (uint64_t)c[1] * 0xc2b2ae3d27d4eb4full ^
+                 (uint64_t)c[2] * 0x165667b19e3779f9ull;
+    return h ^ (h >> 29);
+  }
+
+  Cell &find(const int64_t c[3])
+  {
+    size_t mask = cells.size() - 1;
+    for (size_t i = hash(c) & mask;; i = (i + 1) & mask) {
+      Cell &cell = cells[i];
+      if (cell.head == -1 || (cell.c[0] == c[0] && cell.c[1] == c[1] && cell.c[2] == c[2])) {
+        return cell;
+      }
+    }
+  }
+
+ public:
+  explicit WeldGrid(int num_points) : next(num_points, -1)
+  {
+    size_t num_cells = 16;
+    while (num_cells < 2 * (size_t)num_points) {
+      num_cells *= 2;
+    }
+    cells.assign(num_cells, Cell{{0, 0, 0}, -1});
+  }
+
+  /* first point of the cell or -1 */
+  int head(const int64_t c[3])
+  {
+    return find(c).head;
+  }
+
+  int nextInCell(int point) const
+  {
+    return next[point];
+  }
+
+  void insert(const int64_t c[3], int point)
+  {
+    Cell &cell = find(c);
+    if (cell.head == -1) {
+      cell.c[0] = c[0];
+      cell.c[1] = c[1];
+      cell.c[2] = c[2];
+    }
+    next[point] = cell.head;
+    cell.head = point;
+  }
+};
+
+/* Compacts the used entries of values, used[i] becomes the new index
+ * of entry i or -1. Returns the number of entries dropped. */
+template<typename T> static int compactUsed(vector<T> &values, vector<int> &used)
+{
+  int len = 0;
+  for (int i = 0; i < values.size(); i++) {
+    if (used[i] != -1) {
+      values[len] = values[i];
+      used[i] = len++;
+    }
+  }
+  int dropped = values.size() - len;
+  values.resize(len);
+  return dropped;
+}
+
+/* Union find on uv_map, a set is represented by its smallest uv so
+ * that the result doesn't depend on the order of the merges */
+static int findUv(vector<int> &uv_map, int uv)
+{
+  while (uv_map[uv] != uv) {
+    uv_map[uv] = uv_map[uv_map[uv]];
+    uv = uv_map[uv];
+  }
+  return uv;
+}
+
+static void mergeUvs(vector<int> &uv_map, int a, int b)
+{
+  a = findUv(uv_map, a);
+  b = findUv(uv_map, b);
+  if (a < b) {
+    uv_map[b] = a;
+  }
+  else {
+    uv_map[a] = b;
+  }
+}
+
+ObjWeldStats weldObj(ObjData &data, Scalar distance)
+{
+  ObjWeldStats stats;
+  if (!(distance > 0.0)) {
+    return stats;
+  }
+  const int num_positions = data.positions.size();
+
+  /* positions, every position is merged into the earliest kept position
+   * within distance, cells of size distance make it one of the 27 cells
+   * around its own */
+  vector<int> position_map(num_positions);
+  {
+    WeldGrid grid(num_positions);
+    const Scalar distance2 = distance * distance;
+    for (int i = 0; i < num_positions; i++) {
+      const Vec3 &x = data.positions[i];
+      int64_t c[3];
+      for (int k = 0; k < 3; k++) {
+        c[k] = (int64_t)floor(x[k] / distance);
+      }
+      int match = -1;
+      for (int dz = -1; dz <= 1; dz++) {
+        for (int dy = -1; dy <= 1; dy++) {
+          for (int dx = -1; dx <= 1; dx++) {
+            const int64_t nc[3] = {c[0] + dx, c[1] + dy, c[2] + dz};
+            for (int j = grid.head(nc); j != -1; j = grid.nextInCell(j)) {
+              if ((match == -1 || j < match) && norm2(Vec3(data.positions[j] - x)) <= distance2) {
+                match = j;
+              }
+            }
+          }
+        }
+      }
+      if (match == -1) {
+        position_map[i] = i;
+        grid.insert(c, i);
+      }
+      else {
+        position_map[i] = match;
+      }
+    }
+  }
+  for (ObjCorner &corner : data.corners) {
+    corner.v = position_map[corner.v];
+  }
+  for (int &v : data.edges) {
+    v = position_map[v];
+  }
+
+  /* faces, drop corners that repeat the previous position */
+  {
+    int len = 0, offset = 0;
+    for (int f = 0; f < data.numFaces(); f++) {
+      const int begin = data.face_offsets[f], end = data.face_offsets[f + 1];
+      const int face_begin = len;
+      for (int c = begin; c < end; c++) {
+        const int prev = c == begin ? end - 1 : c - 1;
+        if (data.corners[c].v != data.corners[prev].v) {
+          data.corners[len++] = data.corners[c];
+        }
+      }
+      if (len - face_begin < 3) {
+        len = face_begin;
+        stats.faces++;
+        continue;
+      }
+      data.face_offsets[offset++] = face_begin;
+    }
+    data.face_offsets[offset] = len;
+    data.face_offsets.resize(offset + 1);
+    data.corners.resize(len);
+  }
+
+  /* uvs, corners of the same position are grouped with a counting sort
+   * and the equal uvs within a group merged */
+  const int num_uvs = data.uvs.size();
+  vector<int> uv_map(num_uvs);
+  for (int i = 0; i < num_uvs; i++) {
+    uv_map[i] = i;
+  }
+  {
+    vector<int> offs(num_positions + 1, 0);
+    for (const ObjCorner &corner : data.corners) {
+      if (corner.vt != -1) {
+        offs[corner.v + 1]++;
+      }
+    }
+    for (int i = 0; i < num_positions; i++) {
+      offs[i + 1] += offs[i];
+    }
+    vector<int> position_uvs(offs[num_positions]);
+    vector<int> fill(offs.begin(), offs.end() - 1);
+    for (const ObjCorner &corner : data.corners) {
+      if (corner.vt != -1) {
+        position_uvs[fill[corner.v]++] = corner.vt;
+      }
+    }
+    /* sorting a group by value puts the equal uvs in runs, each starting
+     * with its smallest index */
+    auto uv_less = [&](int a, int b) {
+      const Vec2 &ua = data.uvs[a], &ub = data.uvs[b];
+      if (ua[0] != ub[0]) {
+        return ua[0] < ub[0];
+      }
+      if (ua[1] != ub[1]) {
+        return ua[1] < ub[1];
+      }
+      return a < b;
+    };
+    for (int i = 0; i < num_positions; i++) {
+      sort(position_uvs.begin() + offs[i], position_uvs.begin() + offs[i + 1], uv_less);
+      int first = -1;
+      for (int a = offs[i]; a < offs[i + 1]; a++) {
+        const int vt = position_uvs[a];
+        if (first == -1 || data.uvs[vt] != data.uvs[first]) {
+          first = vt;
+        }
+        else {
+          mergeUvs(uv_map, first, vt);
+        }
+      }
+    }
+    /* uv_map[i] <= i, so one pass in index order points every uv at the
+     * smallest uv it was merged with */
+    for (int i = 0; i < num_uvs; i++) {
+      uv_map[i] = uv_map[uv_map[i]];
+    }
+  }
+  for (ObjCorner &corner : data.corners) {
+    if (corner.vt != -1) {
+      corner.vt = uv_map[corner.vt];
+    }
+  }
+
+  /* drop the positions and uvs nothing refers to anymore */
+  vector<int> position_used(num_positions, -1), uv_used(num_uvs, -1);
+  for (const ObjCorner &corner : data.corners) {
+    position_used[corner.v] = 0;
+    if (corner.vt != -1) {
+      uv_used[corner.vt] = 0;
+    }
+  }
+  for (int v : data.edges) {
+    position_used[v] = 0;
+  }
+  for (int i = 0; i < num_positions; i++) {
+    /* positions that were not used before welding are kept */
+    if (position_map[i] == i) {
+      position_used[i] = 0;
+    }
+    stats.positions += position_map[i] != i;
+  }
+  for (int i = 0; i < num_uvs; i++) {
+    if (uv_map[i] == i) {
+      uv_used[i] = 0;
+    }
+    stats.uvs += uv_map[i] != i;
+  }
+  compactUsed(data.positions, position_used);
+  compactUsed(data.uvs, uv_used);
+  for (ObjCorner &corner : data.corners) {
+    corner.v = position_used[corner.v];
+    if (corner.vt != -1) {
+      corner.vt = uv_used[corner.vt];
+    }
+  }
+  for (int &v : data.edges) {
+    v = position_used[v];
+  }
+  return stats;
+}
+
+bool writeBuffersToFile(const string &filename, const vector<ObjTextBuffer> &buffers)
+{
+  vector<size_t> offsets(buffers.size() + 1, 0);
+  for (int i = 0; i < buffers.size(); i++) {
+    offsets[i + 1] = offsets[i] + buffers[i].size();
+  }
+  vector<char> text(offsets.back());
+  ThreadPool::global().parallelFor(buffers.size(), [&](int i) {
+    memcpy(text.data() + offsets[i], buffers[i].data(), buffers[i].size());
+  });
+
+  FILE *fp = fopen(filename.c_str(), "wb");
+  if (!fp) {
+    return false;
+  }
+  bool ok = fwrite(text.data(), 1, text.size(), fp) == text.size();
+  ok &= fclose(fp) == 0;
+  return ok;
+}
+
+bool writeObjSections(const string &filename,
+                      const int section_len[OBJ_NUM_SECTIONS],
+                      const function<void(ObjSection, int, int, ObjTextBuffer &)> &format,
+                      bool parallel)
+{
+  /* every section is split into ranges that are formatted into their
+   * own buffer, the buffers are then written out in order */
+  struct Range {
+    ObjSection section;
+    int begin;
+    int end;
+  };
+  const int grain = parallel ? 16384 : numeric_limits<int>::max();
+  vector<Range> ranges;
+  for (int section = 0; section < OBJ_NUM_SECTIONS; section++) {
+    for (int begin = 0; begin < section_len[section]; begin += grain) {
+      ranges.push_back({(ObjSection)section,
+                        begin,
+                        (int)min<long>((long)begin + grain, section_len[section])});
+    }
+  }
+
+  vector<ObjTextBuffer> buffers(ranges.size());
+  auto format_range = [&](int r) {
+    buffers[r].reserve((ranges[r].end - ranges[r].begin) * 48);
+    format(ranges[r].section, ranges[r].begin, ranges[r].end, buffers[r]);
+  };
+  if (parallel) {
+    ThreadPool::global().parallelFor(ranges.size(), format_range);
+  }
+  else {
+    for (int r = 0; r < ranges.size(); r++) {
+      format_range(r);
+    }
+  }
+  return writeBuffersToFile(filename, buffers);
+}
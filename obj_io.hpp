@@ -0,0 +1,218 @@
+#ifndef OBJ_IO_HPP
+#define OBJ_IO_HPP
+
+#include <algorithm>
+#include <charconv>
+#include <cstring>
+#include <functional>
+#include <vector>
+#include <string>
+
+#include "math.hpp"
+
+using namespace std;
+
+/* Single corner of an OBJ face, indices are 0 based and already
+ * resolved (negative OBJ indices are relative), -1 when the
+ * corresponding part of `v/vt/vn` is not present */
+struct ObjCorner {
+  int v;  /* index into ObjData.positions */
+  int vt; /* index into ObjData.uvs */
+  int vn; /* index into ObjData.normals */
+};
+
+/* Number of `v`, `vt` and `vn` records */
+struct ObjCounts {
+  int positions;
+  int uvs;
+  int normals;
+
+  ObjCounts() : positions(0), uvs(0), normals(0)
+  {
+  }
+
+  ObjCounts(int positions, int uvs, int normals)
+      : positions(positions), uvs(uvs), normals(normals)
+  {
+  }
+};
+
+/* Flat, pointer free representation of an OBJ file. Faces are stored
+ * as n-gons, face i is made up of
+ * corners[face_offsets[i]] .. corners[face_offsets[i + 1] - 1] */
+struct ObjData {
+  vector<Vec3> positions;
+  vector<Vec2> uvs;
+  vector<Vec3> normals;
+  vector<int> edges; /* pairs of position indices from `e` lines */
+  vector<ObjCorner> corners;
+  vector<int> face_offsets;
+
+  ObjData()
+  {
+    face_offsets.push_back(0);
+  }
+
+  int numFaces() const
+  {
+    return face_offsets.size() - 1;
+  }
+
+  void clear()
+  {
+    positions.clear();
+    uvs.clear();
+    normals.clear();
+    edges.clear();
+    corners.clear();
+    face_offsets.clear();
+    face_offsets.push_back(0);
+  }
+};
+
+/* Reads the whole file into buffer with a single read, returns false
+ * if the file could not be read */
+bool readFileToBuffer(const string &filename, vector<char> &buffer);
+
+/* Parses the OBJ text in [begin, end) and appends to data. Only `v`,
+ * `vt`, `vn`, `e` and `f` records are considered, everything else is
+ * skipped. Returns false on malformed records or out of range
+ * indices.
+ * Large inputs are split into chunks at line boundaries which are
+ * parsed in parallel on ThreadPool::global() and then merged in file
+ * order, the result does not depend on the number of threads. */
+bool parseObj(const char *begin, const char *end, ObjData &data);
+
+/* readFileToBuffer() followed by parseObj() */
+bool readObj(const string &filename, ObjData &data);
+
+/* Number of elements weldObj() merged or dropped */
+struct ObjWeldStats {
+  int positions; /* positions merged into another one */
+  int uvs;       /* uvs merged into another one */
+  int faces;     /* faces that collapsed to less than 3 corners */
+
+  ObjWeldStats() : positions(0), uvs(0), faces(0)
+  {
+  }
+};
+
+/* Merges every position into the first earlier position within
+ * distance of it, found through a hash grid with cells of that size.
+ * Afterwards uvs with equal values used at the same position are
+ * merged, corners that repeat the previous corner's position are
+ * removed along with faces left with less than 3 corners, and unused
+ * positions and uvs are dropped. Expected time is linear in the size
+ * of data. Does nothing unless distance > 0. */
+ObjWeldStats weldObj(ObjData &data, Scalar distance);
+
+/* Growable text buffer that OBJ records are formatted into with
+ * to_chars(), scalars are written in their shortest form that reads
+ * back to the same value. Independent buffers can be filled in
+ * parallel and written out together with writeBuffersToFile(). */
+class ObjTextBuffer {
+ private:
+  vector<char> buf;
+  size_t len;
+
+  /* ensures that at least n more chars fit */
+  char *reserveTail(size_t n)
+  {
+    if (len + n > buf.size()) {
+      buf.resize(max(len + n, 2 * buf.size()));
+    }
+    return buf.data() + len;
+  }
+
+ public:
+  ObjTextBuffer() : len(0)
+  {
+  }
+
+  void reserve(size_t n)
+  {
+    reserveTail(n);
+  }
+
+  void append(const char *str, size_t n)
+  {
+    char *p = reserveTail(n);
+    memcpy(p, str, n);
+    len += n;
+  }
+
+  void append(char c)
+  {
+    *reserveTail(1) = c;
+    len++;
+  }
+
+  void appendScalar(Scalar value)
+  {
+    char *p = reserveTail(32);
+    len = to_chars(p, p + 32, value).ptr - buf.data();
+  }
+
+  void appendInt(int value)
+  {
+    char *p = reserveTail(16);
+    len = to_chars(p, p + 16, value).ptr - buf.data();
+  }
+
+  /* "keyword x y z\n" for v and vn records */
+  void appendRecord(const char *keyword, size_t keyword_len, const Scalar *values, int n)
+  {
+    append(keyword, keyword_len);
+    for (int i = 0; i < n; i++) {
+      append(' ');
+      appendScalar(values[i]);
+    }
+    append('\n');
+  }
+
+  /* " v/vt/vn" corner of a face record, indices are 0 based */
+  void appendCorner(int v, int vt, int vn)
+  {
+    append(' ');
+    appendInt(v + 1);
+    append('/');
+    appendInt(vt + 1);
+    append('/');
+    appendInt(vn + 1);
+  }
+
+  const char *data() const
+  {
+    return buf.data();
+  }
+
+  size_t size() const
+  {
+    return len;
+  }
+};
+
+/* Writes the concatenation of buffers to filename with a single
+ * write, returns false on failure */
+bool writeBuffersToFile(const string &filename, const vector<ObjTextBuffer> &buffers);
+
+/* Sections of an OBJ file in the order they are written */
+enum ObjSection {
+  OBJ_SECTION_V,
+  OBJ_SECTION_VT,
+  OBJ_SECTION_VN,
+  OBJ_SECTION_F,
+  OBJ_NUM_SECTIONS,
+};
+
+/* Writes an OBJ file with section_len[s] records in section s, the
+ * records [begin, end) of a section are formatted into a buffer by
+ * format(section, begin, end, buffer). Ranges are formatted in
+ * parallel unless parallel is false. Returns false on failure. */
+bool writeObjSections(
+    const string &filename,
+    const int section_len[OBJ_NUM_SECTIONS],
+    const function<void(ObjSection, int, int, ObjTextBuffer &)> &format,
+    bool parallel = true);
+
+#endif
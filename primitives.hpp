@@ -37,29 +37,29 @@ class Primitive {
 
   Primitive()
   {
-    pos = Vec3(0.0d, 0.0d, 0.0d);
-    scale = Vec3(1.0d, 1.0d, 1.0d);
+    pos = Vec3(0.0, 0.0, 0.0);
+    scale = Vec3(1.0, 1.0, 1.0);
     shader = &defaultShader();
     type = PRIMITIVE;
   }
 
   Primitive(Shader *shader) : shader(shader)
   {
-    pos = Vec3(0.0d, 0.0d, 0.0d);
-    scale = Vec3(1.0d, 1.0d, 1.0d);
+    pos = Vec3(0.0, 0.0, 0.0);
+    scale = Vec3(1.0, 1.0, 1.0);
     type = PRIMITIVE;
   }
 
   Primitive(Vec3 pos) : pos(pos)
   {
-    scale = Vec3(1.0d, 1.0d, 1.0d);
+    scale = Vec3(1.0, 1.0, 1.0);
     shader = &defaultShader();
     type = PRIMITIVE;
   }
 
   Primitive(Vec3 pos, Shader *shader) : pos(pos), shader(shader)
   {
-    scale = Vec3(1.0d, 1.0d, 1.0d);
+    scale = Vec3(1.0, 1.0, 1.0);
     type = PRIMITIVE;
   }
 
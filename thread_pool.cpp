@@ -0,0 +1,150 @@
+#include "thread_pool.hpp"
+
+#include <algorithm>
+
+/* Set on worker threads and while the calling thread runs tasks, used
+ * to run nested loops serially */
+static thread_local bool in_parallel_loop = false;
+
+ThreadPool::ThreadPool(int num_threads)
+    : job(NULL), generation(0), active_workers(0), stop(false)
+{
+  startWorkers(num_threads);
+}
+
+ThreadPool::~ThreadPool()
+{
+  stopWorkers();
+}
+
+void ThreadPool::startWorkers(int num_threads)
+{
+  if (num_threads <= 0) {
+    num_threads = max(1u, thread::hardware_concurrency());
+  }
+  for (int i = 1; i < num_threads; i++) {
+    workers.emplace_back(&ThreadPool::workerLoop, this);
+  }
+}
+
+void ThreadPool::stopWorkers()
+{
+  {
+    lock_guard<mutex> lock(state_mutex);
+    stop = true;
+  }
+  job_cv.notify_all();
+  for (int i = 0; i < workers.size(); i++) {
+    workers[i].join();
+  }
+  workers.clear();
+  stop = false;
+}
+
+void ThreadPool::setNumThreads(int num_threads)
+{
+  lock_guard<mutex> job_lock(job_mutex);
+  stopWorkers();
+  startWorkers(num_threads);
+}
+
+void ThreadPool::runTasks(Job *job)
+{
+  int done = 0;
+  while (true) {
+    int task = job->next_task.fetch_add(1);
+    if (task >= job->num_tasks) {
+      break;
+    }
+    (*job->func)(task);
+    done++;
+  }
+  job->tasks_done.fetch_add(done);
+}
+
+void ThreadPool::workerLoop()
+{
+  in_parallel_loop = true;
+  unsigned int seen_generation = 0;
+  while (true) {
+    Job *current;
+    {
+      unique_lock<mutex> lock(state_mutex);
+      job_cv.wait(lock, [&] { return stop || (job && generation != seen_generation); });
+      if (stop) {
+        return;
+      }
+      seen_generation = generation;
+      current = job;
+      active_workers++;
+    }
+    runTasks(current);
+    {
+      lock_guard<mutex> lock(state_mutex);
+      active_workers--;
+    }
+    done_cv.notify_all();
+  }
+}
+
+void ThreadPool::parallelFor(int num_tasks, const function<void(int)> &func)
+{
+  if (num_tasks <= 0) {
+    return;
+  }
+  if (num_tasks == 1 || workers.empty() || in_parallel_loop) {
+    for (int i = 0; i < num_tasks; i++) {
+      func(i);
+    }
+    return;
+  }
+
+  lock_guard<mutex> job_lock(job_mutex);
+  Job current;
+  current.func = &func;
+  current.num_tasks = num_tasks;
+  current.next_task = 0;
+  current.tasks_done = 0;
+  {
+    lock_guard<mutex> lock(state_mutex);
+    job = &current;
+    generation++;
+  }
+  job_cv.notify_all();
+
+  in_parallel_loop = true;
+  runTasks(&current);
+  in_parallel_loop = false;
+
+  unique_lock<mutex> lock(state_mutex);
+  /* workers may still hold a pointer to current even after the last
+   * task is done, wait for them to let go of it */
+  done_cv.wait(lock, [&] { return current.tasks_done == num_tasks && active_workers == 0; });
+  job = NULL;
+}
+
+void ThreadPool::parallelForRange(int begin,
+                                  int end,
+                                  int grain,
+                                  const function<void(int, int)> &func)
+{
+  int len = end - begin;
+  if (len <= 0) {
+    return;
+  }
+  grain = max(grain, 1);
+  /* a few ranges per thread to even out imbalanced work */
+  int num_ranges = min((len + grain - 1) / grain, numThreads() * 4);
+  int range_len = (len + num_ranges - 1) / num_ranges;
+  num_ranges = (len + range_len - 1) / range_len;
+  parallelFor(num_ranges, [&](int range) {
+    int range_begin = begin + range * range_len;
+    func(range_begin, min(range_begin + range_len, end));
+  });
+}
+
+ThreadPool &ThreadPool::global()
+{
+  static ThreadPool pool;
+  return pool;
+}
@@ -0,0 +1,73 @@
+#ifndef THREAD_POOL_HPP
+#define THREAD_POOL_HPP
+
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+using namespace std;
+
+/* Fixed size pool of worker threads that run parallel loops. Only one
+ * loop runs on the pool at a time, the calling thread works on the
+ * loop as well and parallelFor() returns once every task is done.
+ * parallelFor() called from within a task runs serially on the
+ * calling thread, so nesting is safe but not parallel. */
+class ThreadPool {
+ private:
+  struct Job {
+    const function<void(int)> *func;
+    int num_tasks;
+    atomic<int> next_task;
+    atomic<int> tasks_done;
+  };
+
+  vector<thread> workers;
+  mutex job_mutex;   /* serializes parallelFor() callers */
+  mutex state_mutex; /* guards job, generation, active_workers and stop */
+  condition_variable job_cv;
+  condition_variable done_cv;
+  Job *job;
+  unsigned int generation;
+  int active_workers; /* workers currently running tasks of job */
+  bool stop;
+
+  void workerLoop();
+  void runTasks(Job *job);
+  void startWorkers(int num_threads);
+  void stopWorkers();
+
+ public:
+  /* num_threads including the calling thread, 0 uses
+   * thread::hardware_concurrency() */
+  explicit ThreadPool(int num_threads = 0);
+  ~ThreadPool();
+
+  ThreadPool(const ThreadPool &) = delete;
+  ThreadPool &operator=(const ThreadPool &) = delete;
+
+  /* Number of threads that work on a loop, including the caller */
+  int numThreads() const
+  {
+    return workers.size() + 1;
+  }
+
+  /* Replaces the threads with num_threads threads, 0 uses
+   * thread::hardware_concurrency(). Waits for a running loop to finish
+   * and must not be called from within one. */
+  void setNumThreads(int num_threads);
+
+  /* Runs func(task) for every task in [0, num_tasks) */
+  void parallelFor(int num_tasks, const function<void(int)> &func);
+
+  /* Splits [begin, end) into contiguous ranges of at least grain
+   * elements and runs func(range_begin, range_end) on each */
+  void parallelForRange(int begin, int end, int grain, const function<void(int, int)> &func);
+
+  /* Pool shared by the mesh code, sized to the hardware */
+  static ThreadPool &global();
+};
+
+#endif